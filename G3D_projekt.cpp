@@ -2,10 +2,21 @@
 #include <SFML/Window.hpp>
 #include <SFML/Graphics.hpp>
 #include <SFML/OpenGL.hpp>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
 #include <windows.h>
-#include <GL/glu.h>
 #pragma comment(lib, "opengl32.lib")
 #pragma comment(lib, "glu32.lib")
+#pragma comment(lib, "winmm.lib")
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <GL/glu.h>
 
 #include <iostream>
 #include <cmath>
@@ -14,6 +25,34 @@
 #include <sstream>
 #include <algorithm>
 #include <string>
+#include <cstring>
+#include <iomanip>
+#include <map>
+#include <tuple>
+#include <thread>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <chrono>
+#include <fstream>
+#include <filesystem>
+#include <limits>
+#include <cstddef>
+#include <deque>
+#include <list>
+#include <unordered_map>
+
+#if defined(__AVX2__)
+#define G3D_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define G3D_SSE2 1
+#endif
+#if defined(G3D_AVX2) || defined(G3D_SSE2)
+#include <immintrin.h>
+#endif
 
 namespace
 {
@@ -27,9 +66,22 @@ namespace
     enum class ViewMode
     {
         BohrOrbits = 0,
-        ProbabilityCloud = 1
+        ProbabilityCloud = 1,
+        Molecule = 2,
+        Isosurface = 3,
+        WavePacket = 4
+    };
+
+    enum class CloudBlend
+    {
+        Alpha = 0,
+        Oit = 1,
+        Sorted = 2
     };
 
+    constexpr int CLOUD_BLEND_COUNT = 3;
+    constexpr int ISO_DEFAULT_LEVEL = -4;
+
     struct AppState
     {
         float rotX = 20.f;
@@ -38,12 +90,17 @@ namespace
         float electronAngleDeg = 0.f;
         bool showLocalAxes = true;
         ViewMode viewMode = ViewMode::BohrOrbits;
+        CloudBlend cloudBlend = CloudBlend::Oit;
+        bool cloudSplats = true;
+        bool cloudVolume = false;
+        int isoLevel = ISO_DEFAULT_LEVEL;
         int electronCount = 6;
         sf::Vector3f eye{ 2.2f, 1.8f, 4.0f };
         sf::Vector3f center{ 0.0f, 0.2f, 0.0f };
         sf::Vector3f up{ 0.0f, 1.0f, 0.0f };
         float fovDeg = 60.0f;
         float nearP = 0.1f, farP = 100.0f;
+        bool dirty = true;
     } G;
 
     struct ElementInfo
@@ -53,676 +110,9198 @@ namespace
         const char* name;
     };
 
-    static const ElementInfo ELEMENTS[] =
-    {
-        {  1, "H",  "Wodor"      },
-        {  2, "He", "Hel"        },
-        {  3, "Li", "Lit"        },
-        {  4, "Be", "Beryl"      },
-        {  5, "B",  "Bor"        },
-        {  6, "C",  "Wegiel"     },
-        {  7, "N",  "Azot"       },
-        {  8, "O",  "Tlen"       },
-        {  9, "F",  "Fluor"      },
-        { 10, "Ne", "Neon"       },
-        { 11, "Na", "Sod"        },
-        { 12, "Mg", "Magnez"     },
-        { 13, "Al", "Glin"       },
-        { 14, "Si", "Krzem"      },
-        { 15, "P",  "Fosfor"     },
-        { 16, "S",  "Siarka"     },
-        { 17, "Cl", "Chlor"      },
-        { 18, "Ar", "Argon"      },
+    constexpr int MAX_ELECTRONS = 118;
+
+    static const ElementInfo ELEMENTS[MAX_ELECTRONS] =
+    {
+        {   1, "H",  "Wodor"      },
+        {   2, "He", "Hel"        },
+        {   3, "Li", "Lit"        },
+        {   4, "Be", "Beryl"      },
+        {   5, "B",  "Bor"        },
+        {   6, "C",  "Wegiel"     },
+        {   7, "N",  "Azot"       },
+        {   8, "O",  "Tlen"       },
+        {   9, "F",  "Fluor"      },
+        {  10, "Ne", "Neon"       },
+        {  11, "Na", "Sod"        },
+        {  12, "Mg", "Magnez"     },
+        {  13, "Al", "Glin"       },
+        {  14, "Si", "Krzem"      },
+        {  15, "P",  "Fosfor"     },
+        {  16, "S",  "Siarka"     },
+        {  17, "Cl", "Chlor"      },
+        {  18, "Ar", "Argon"      },
+        {  19, "K",  "Potas"      },
+        {  20, "Ca", "Wapn"       },
+        {  21, "Sc", "Skand"      },
+        {  22, "Ti", "Tytan"      },
+        {  23, "V",  "Wanad"      },
+        {  24, "Cr", "Chrom"      },
+        {  25, "Mn", "Mangan"     },
+        {  26, "Fe", "Zelazo"     },
+        {  27, "Co", "Kobalt"     },
+        {  28, "Ni", "Nikiel"     },
+        {  29, "Cu", "Miedz"      },
+        {  30, "Zn", "Cynk"       },
+        {  31, "Ga", "Gal"        },
+        {  32, "Ge", "German"     },
+        {  33, "As", "Arsen"      },
+        {  34, "Se", "Selen"      },
+        {  35, "Br", "Brom"       },
+        {  36, "Kr", "Krypton"    },
+        {  37, "Rb", "Rubid"      },
+        {  38, "Sr", "Stront"     },
+        {  39, "Y",  "Itr"        },
+        {  40, "Zr", "Cyrkon"     },
+        {  41, "Nb", "Niob"       },
+        {  42, "Mo", "Molibden"   },
+        {  43, "Tc", "Technet"    },
+        {  44, "Ru", "Ruten"      },
+        {  45, "Rh", "Rod"        },
+        {  46, "Pd", "Pallad"     },
+        {  47, "Ag", "Srebro"     },
+        {  48, "Cd", "Kadm"       },
+        {  49, "In", "Ind"        },
+        {  50, "Sn", "Cyna"       },
+        {  51, "Sb", "Antymon"    },
+        {  52, "Te", "Tellur"     },
+        {  53, "I",  "Jod"        },
+        {  54, "Xe", "Ksenon"     },
+        {  55, "Cs", "Cez"        },
+        {  56, "Ba", "Bar"        },
+        {  57, "La", "Lantan"     },
+        {  58, "Ce", "Cer"        },
+        {  59, "Pr", "Prazeodym"  },
+        {  60, "Nd", "Neodym"     },
+        {  61, "Pm", "Promet"     },
+        {  62, "Sm", "Samar"      },
+        {  63, "Eu", "Europ"      },
+        {  64, "Gd", "Gadolin"    },
+        {  65, "Tb", "Terb"       },
+        {  66, "Dy", "Dysproz"    },
+        {  67, "Ho", "Holm"       },
+        {  68, "Er", "Erb"        },
+        {  69, "Tm", "Tul"        },
+        {  70, "Yb", "Iterb"      },
+        {  71, "Lu", "Lutet"      },
+        {  72, "Hf", "Hafn"       },
+        {  73, "Ta", "Tantal"     },
+        {  74, "W",  "Wolfram"    },
+        {  75, "Re", "Ren"        },
+        {  76, "Os", "Osm"        },
+        {  77, "Ir", "Iryd"       },
+        {  78, "Pt", "Platyna"    },
+        {  79, "Au", "Zloto"      },
+        {  80, "Hg", "Rtec"       },
+        {  81, "Tl", "Tal"        },
+        {  82, "Pb", "Olow"       },
+        {  83, "Bi", "Bizmut"     },
+        {  84, "Po", "Polon"      },
+        {  85, "At", "Astat"      },
+        {  86, "Rn", "Radon"      },
+        {  87, "Fr", "Frans"      },
+        {  88, "Ra", "Rad"        },
+        {  89, "Ac", "Aktyn"      },
+        {  90, "Th", "Tor"        },
+        {  91, "Pa", "Protaktyn"  },
+        {  92, "U",  "Uran"       },
+        {  93, "Np", "Neptun"     },
+        {  94, "Pu", "Pluton"     },
+        {  95, "Am", "Ameryk"     },
+        {  96, "Cm", "Kiur"       },
+        {  97, "Bk", "Berkel"     },
+        {  98, "Cf", "Kaliforn"   },
+        {  99, "Es", "Einstein"   },
+        { 100, "Fm", "Ferm"       },
+        { 101, "Md", "Mendelew"   },
+        { 102, "No", "Nobel"      },
+        { 103, "Lr", "Lorens"     },
+        { 104, "Rf", "Rutherford" },
+        { 105, "Db", "Dubn"       },
+        { 106, "Sg", "Seaborg"    },
+        { 107, "Bh", "Bohr"       },
+        { 108, "Hs", "Has"        },
+        { 109, "Mt", "Meitner"    },
+        { 110, "Ds", "Darmsztadt" },
+        { 111, "Rg", "Roentgen"   },
+        { 112, "Cn", "Kopernik"   },
+        { 113, "Nh", "Nihon"      },
+        { 114, "Fl", "Flerow"     },
+        { 115, "Mc", "Moskow"     },
+        { 116, "Lv", "Liwermor"   },
+        { 117, "Ts", "Tenes"      },
+        { 118, "Og", "Oganeson"   },
     };
 
     const ElementInfo* getCurrentElement()
     {
         int Z = G.electronCount;
-        if (Z < 1 || Z > 18) return nullptr;
+        if (Z < 1 || Z > MAX_ELECTRONS) return nullptr;
         return &ELEMENTS[Z - 1];
     }
 
-    constexpr int MAX_SHELLS = 3;
-    const int SHELL_CAPACITY[MAX_SHELLS] = { 2, 8, 8 };
+    constexpr int MAX_SHELLS = 7;
+    constexpr int SUBSHELL_COUNT = 19;
+
+    struct Subshell
+    {
+        int n;
+        int l;
+    };
+
+    struct SubshellOccupancy
+    {
+        int n;
+        int l;
+        int electrons;
+    };
+
+    constexpr Subshell MADELUNG_ORDER[SUBSHELL_COUNT] =
+    {
+        { 1, 0 }, { 2, 0 }, { 2, 1 }, { 3, 0 }, { 3, 1 }, { 4, 0 }, { 3, 2 }, { 4, 1 },
+        { 5, 0 }, { 4, 2 }, { 5, 1 }, { 6, 0 }, { 4, 3 }, { 5, 2 }, { 6, 1 }, { 7, 0 },
+        { 5, 3 }, { 6, 2 }, { 7, 1 },
+    };
+
+    struct ConfigException
+    {
+        int Z;
+        Subshell from;
+        Subshell to;
+        int electrons;
+    };
+
+    constexpr ConfigException CONFIG_EXCEPTIONS[] =
+    {
+        {  24, { 4, 0 }, { 3, 2 }, 1 },
+        {  29, { 4, 0 }, { 3, 2 }, 1 },
+        {  41, { 5, 0 }, { 4, 2 }, 1 },
+        {  42, { 5, 0 }, { 4, 2 }, 1 },
+        {  44, { 5, 0 }, { 4, 2 }, 1 },
+        {  45, { 5, 0 }, { 4, 2 }, 1 },
+        {  46, { 5, 0 }, { 4, 2 }, 2 },
+        {  47, { 5, 0 }, { 4, 2 }, 1 },
+        {  57, { 4, 3 }, { 5, 2 }, 1 },
+        {  58, { 4, 3 }, { 5, 2 }, 1 },
+        {  64, { 4, 3 }, { 5, 2 }, 1 },
+        {  78, { 6, 0 }, { 5, 2 }, 1 },
+        {  79, { 6, 0 }, { 5, 2 }, 1 },
+        {  89, { 5, 3 }, { 6, 2 }, 1 },
+        {  90, { 5, 3 }, { 6, 2 }, 2 },
+        {  91, { 5, 3 }, { 6, 2 }, 1 },
+        {  92, { 5, 3 }, { 6, 2 }, 1 },
+        {  93, { 5, 3 }, { 6, 2 }, 1 },
+        {  96, { 5, 3 }, { 6, 2 }, 1 },
+        { 103, { 6, 2 }, { 7, 1 }, 1 },
+    };
+
+    struct ElectronConfig
+    {
+        int subshell[SUBSHELL_COUNT];
+        int shellElectrons[MAX_SHELLS];
+        int shellCount;
+    };
+
+    struct ElectronConfigTable
+    {
+        ElectronConfig element[MAX_ELECTRONS + 1];
+    };
+
+    constexpr int madelungIndex(Subshell s)
+    {
+        for (int i = 0; i < SUBSHELL_COUNT; ++i)
+            if (MADELUNG_ORDER[i].n == s.n && MADELUNG_ORDER[i].l == s.l) return i;
+        return -1;
+    }
+
+    constexpr ElectronConfig buildElectronConfig(int Z)
+    {
+        ElectronConfig c{};
+        int remaining = Z;
+        for (int i = 0; i < SUBSHELL_COUNT && remaining > 0; ++i)
+        {
+            int capacity = 2 * (2 * MADELUNG_ORDER[i].l + 1);
+            c.subshell[i] = remaining < capacity ? remaining : capacity;
+            remaining -= c.subshell[i];
+        }
+        for (const ConfigException& e : CONFIG_EXCEPTIONS)
+        {
+            if (e.Z != Z) continue;
+            c.subshell[madelungIndex(e.from)] -= e.electrons;
+            c.subshell[madelungIndex(e.to)] += e.electrons;
+        }
+        for (int i = 0; i < SUBSHELL_COUNT; ++i)
+        {
+            int shell = MADELUNG_ORDER[i].n - 1;
+            c.shellElectrons[shell] += c.subshell[i];
+            if (c.subshell[i] > 0 && shell + 1 > c.shellCount) c.shellCount = shell + 1;
+        }
+        return c;
+    }
+
+    constexpr ElectronConfigTable buildElectronConfigTable()
+    {
+        ElectronConfigTable t{};
+        for (int Z = 1; Z <= MAX_ELECTRONS; ++Z)
+            t.element[Z] = buildElectronConfig(Z);
+        return t;
+    }
+
+    constexpr ElectronConfigTable ELECTRON_CONFIGS = buildElectronConfigTable();
+
+    constexpr bool electronConfigsValid()
+    {
+        for (int Z = 1; Z <= MAX_ELECTRONS; ++Z)
+        {
+            int total = 0;
+            for (int i = 0; i < SUBSHELL_COUNT; ++i)
+            {
+                int electrons = ELECTRON_CONFIGS.element[Z].subshell[i];
+                if (electrons < 0 || electrons > 2 * (2 * MADELUNG_ORDER[i].l + 1)) return false;
+                total += electrons;
+            }
+            if (total != Z) return false;
+        }
+        return true;
+    }
+
+    static_assert(electronConfigsValid(), "konfiguracje elektronowe niespojne");
+    static_assert(ELECTRON_CONFIGS.element[24].subshell[madelungIndex({ 3, 2 })] == 5, "Cr: 3d5 4s1");
+    static_assert(ELECTRON_CONFIGS.element[29].shellElectrons[3] == 1, "Cu: 4s1");
+    static_assert(ELECTRON_CONFIGS.element[18].shellCount == 3, "Ar: 3 powloki");
+    static_assert(ELECTRON_CONFIGS.element[MAX_ELECTRONS].shellCount == MAX_SHELLS, "Og: 7 powlok");
+
+    const ElectronConfig& currentConfig()
+    {
+        int Z = G.electronCount < 1 ? 1 : (G.electronCount > MAX_ELECTRONS ? MAX_ELECTRONS : G.electronCount);
+        return ELECTRON_CONFIGS.element[Z];
+    }
+
+    struct ShellRadii
+    {
+        float radius[MAX_SHELLS];
+    };
+
+    constexpr ShellRadii buildShellRadii()
+    {
+        ShellRadii r{};
+        float step = 0.55f;
+        r.radius[0] = 0.7f;
+        for (int s = 1; s < MAX_SHELLS; ++s)
+        {
+            r.radius[s] = r.radius[s - 1] + step;
+            if (s >= 2) step *= 0.85f;
+        }
+        return r;
+    }
+
+    constexpr ShellRadii SHELL_RADII = buildShellRadii();
 
     float shellRadius(int shellIdx)
     {
-        const float baseRadius = 0.7f;
-        const float step = 0.55f;
-        return baseRadius + step * shellIdx;
+        return SHELL_RADII.radius[shellIdx];
+    }
+
+    float sceneFitScale(int shellCount)
+    {
+        const float fitRadius = SHELL_RADII.radius[2];
+        float outer = SHELL_RADII.radius[shellCount > 0 ? shellCount - 1 : 0];
+        return outer > fitRadius ? fitRadius / outer : 1.0f;
     }
 
-    struct CloudPoint
+    struct CloudStore
+    {
+        std::unique_ptr<int16_t[]> arena;
+        size_t capacity = 0;
+        size_t count = 0;
+
+        int16_t* axis(int a) { return arena.get() + a * capacity; }
+        const int16_t* axis(int a) const { return arena.get() + a * capacity; }
+    };
+
+    struct CloudBounds
+    {
+        int16_t minQ[3] = { 0, 0, 0 };
+        int16_t maxQ[3] = { 0, 0, 0 };
+        float rmsRadius = 0.f;
+    };
+
+    struct OrbitalJob
+    {
+        int n = 1, l = 0, m = 0;
+        int occupancy = 0;
+        uint64_t key = 0;
+        float angularMax = 1.f;
+        float zEff = 1.f;
+        float sceneScale = 1.f;
+        float quantScale = 1.f;
+        int tableIndex = 0;
+        size_t offset = 0;
+        size_t count = 0;
+    };
+
+    struct CloudPlan
+    {
+        int Z = 0;
+        size_t total = 0;
+        int tableSize = 0;
+        int chunkCount = 1;
+        float shellScale[MAX_SHELLS] = {};
+        std::vector<OrbitalJob> orbitals;
+        std::vector<float> tables;
+    };
+
+    struct CloudBuildJob
+    {
+        int Z = 0;
+        size_t total = 0;
+        uint64_t seed = 0;
+        CloudPlan plan;
+        CloudStore store;
+        std::vector<CloudBounds> bounds;
+        int elapsedMs = 0;
+        std::atomic<bool> planReady{ false };
+        std::atomic<int> chunksDone{ 0 };
+        std::atomic<bool> cancelled{ false };
+        std::atomic<bool> finished{ false };
+    };
+
+    struct CloudWorker
+    {
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::shared_ptr<CloudBuildJob> pending;
+        std::shared_ptr<CloudBuildJob> running;
+        CloudStore spare;
+        bool quit = false;
+    };
+
+    constexpr char CLOUD_CACHE_MAGIC[4] = { 'G', '3', 'D', 'C' };
+    constexpr uint32_t CLOUD_CACHE_VERSION = 2;
+    constexpr uint32_t CLOUD_GENERATOR_VERSION = 2;
+
+    struct CloudCacheHeader
+    {
+        char magic[4];
+        uint32_t formatVersion;
+        uint32_t generatorVersion;
+        int32_t Z;
+        uint64_t seed;
+        uint64_t sampleCount;
+        uint64_t capacity;
+        uint32_t segmentCount;
+        uint32_t reserved;
+    };
+
+    struct CloudCacheSegment
+    {
+        uint64_t first;
+        uint64_t count;
+        int32_t shell;
+        float scale;
+        float rmsRadius;
+        int16_t minQ[3];
+        int16_t maxQ[3];
+    };
+
+    struct MappedFile
+    {
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+#ifdef _WIN32
+        HANDLE fileHandle = nullptr;
+        HANDLE mappingHandle = nullptr;
+#endif
+    };
+
+    struct CloudSegment
+    {
+        GLint first;
+        GLsizei filled;
+        int shell;
+        CloudBounds bounds;
+    };
+
+    struct CloudGpuBuffer
+    {
+        GLuint vbo = 0;
+        int Z = 0;
+        size_t capacity = 0;
+        float shellScale[MAX_SHELLS] = {};
+        std::vector<CloudSegment> segments;
+        std::shared_ptr<CloudStore> store;
+        GLuint shellVbo = 0;
+        GLuint densityVbo = 0;
+        GLuint pointVbo = 0;
+        float densityRange[MAX_SHELLS * 2] = {};
+    };
+
+    struct CloudUploadState
+    {
+        std::shared_ptr<CloudBuildJob> job;
+        int target = -1;
+        int uploadedChunks = 0;
+    };
+
+    struct CloudUniforms
+    {
+        GLint shell = -1;
+        GLint shellScale = -1;
+        GLint alphaScale = -1;
+        GLint drawnFraction = -1;
+        GLint densityRange = -1;
+        GLint pointScale = -1;
+    };
+
+    struct CloudDrawRange
+    {
+        GLint first;
+        GLsizei count;
+        int shell;
+    };
+
+    constexpr GLuint CLOUD_SHELL_ATTRIB = 3;
+    constexpr GLuint CLOUD_DENSITY_ATTRIB = 4;
+    constexpr int CLOUD_DENSITY_GRID = 16;
+    constexpr float CLOUD_SPLAT_POINTS_PER_PIXEL = 0.1f;
+    constexpr size_t CLOUD_SPLAT_MAX_POINTS = 40000;
+    constexpr int CLOUD_COLORMAP_WIDTH = 256;
+    constexpr size_t CLOUD_SORT_MIN_CHUNK = 16384;
+
+    struct CloudSortJob
+    {
+        std::shared_ptr<const CloudStore> store;
+        std::vector<CloudDrawRange> ranges;
+        float shellScale[MAX_SHELLS] = {};
+        float depthRow[4] = {};
+        std::vector<uint32_t> indices;
+        double sortMs = 0.0;
+    };
+
+    struct CloudSorter
+    {
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool quit = false;
+        bool busy = false;
+        std::unique_ptr<CloudSortJob> pending;
+        std::unique_ptr<CloudSortJob> done;
+        std::vector<std::unique_ptr<CloudSortJob>> spare;
+        std::weak_ptr<const CloudStore> submittedStore;
+        std::vector<CloudDrawRange> submittedRanges;
+        float submittedDepthRow[4] = {};
+        GLuint ibo = 0;
+        GLsizei drawCount = 0;
+        std::weak_ptr<const CloudStore> iboStore;
+        bool recordSamples = false;
+        std::vector<double> sortSamples;
+    };
+
+    struct OitTargets
+    {
+        GLuint fbo = 0;
+        GLuint accumTex = 0;
+        GLuint weightTex = 0;
+        GLuint depthRb = 0;
+        GLsizei width = 0;
+        GLsizei height = 0;
+        GLuint prevFbo = 0;
+    };
+
+    constexpr int ASSET_LOADER_THREADS = 2;
+    constexpr size_t ASSET_UPLOAD_BUDGET = size_t(8) << 20;
+    constexpr char TEXTURE_CACHE_MAGIC[4] = { 'G', '3', 'D', 'X' };
+    constexpr uint32_t TEXTURE_CACHE_VERSION = 1;
+
+    enum class AssetKind
+    {
+        Texture,
+        Font
+    };
+
+    struct TextureLevel
+    {
+        uint32_t width;
+        uint32_t height;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    struct TextureData
+    {
+        GLenum format = GL_RGBA8;
+        std::vector<TextureLevel> levels;
+        std::vector<uint8_t> pixels;
+        bool fromCache = false;
+    };
+
+    struct TextureCacheHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint64_t sourceSize;
+        int64_t sourceTime;
+        uint32_t format;
+        uint32_t levelCount;
+    };
+
+    struct AssetJob
+    {
+        AssetKind kind = AssetKind::Texture;
+        std::string path;
+        GLuint* texture = nullptr;
+        std::atomic<bool> done{ false };
+        bool ok = false;
+        TextureData data;
+        std::unique_ptr<sf::Font> font;
+    };
+
+    struct ParallelJob
+    {
+        void (*run)(void* context, size_t begin, size_t end) = nullptr;
+        void* context = nullptr;
+        size_t count = 0;
+        size_t chunk = 0;
+        size_t chunks = 0;
+        std::atomic<size_t> next{ 0 };
+        unsigned helpers = 0;
+    };
+
+    struct WorkerPool
+    {
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+        std::deque<ParallelJob*> jobs;
+        bool quit = false;
+    };
+
+    struct TextureUpload
+    {
+        std::shared_ptr<AssetJob> job;
+        GLuint texture = 0;
+        size_t level = 0;
+        uint32_t row = 0;
+    };
+
+    struct AssetLoader
+    {
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::deque<std::shared_ptr<AssetJob>> queue;
+        bool quit = false;
+        std::vector<std::shared_ptr<AssetJob>> pending;
+        std::deque<TextureUpload> uploads;
+        GLuint pbo = 0;
+        sf::Clock clock;
+    };
+
+    enum class MeshKind
+    {
+        Sphere,
+        OrbitCircle,
+        Axes,
+        BackgroundQuad
+    };
+
+    struct MeshKey
+    {
+        MeshKind kind;
+        float radius;
+        int slices;
+        int stacks;
+
+        bool operator<(const MeshKey& o) const
+        {
+            return std::tie(kind, radius, slices, stacks) <
+                std::tie(o.kind, o.radius, o.slices, o.stacks);
+        }
+    };
+
+    struct Mesh
     {
-        float x, y, z;
-        int   shell;
+        GLuint vbo = 0;
+        GLuint ibo = 0;
+        GLenum primitive = GL_TRIANGLES;
+        GLsizei vertexCount = 0;
+        GLsizei indexCount = 0;
+        GLsizei stride = 0;
+        int normalOffset = -1;
+        int colorOffset = -1;
+        int texCoordOffset = -1;
+        GLenum indexType = GL_UNSIGNED_SHORT;
+        GLuint vao = 0;
     };
 
-    std::vector<CloudPoint> gCloudPoints;
-    static GLUquadric* gQuad = nullptr;
+    struct GlStats
+    {
+        unsigned changes = 0;
+        unsigned redundant = 0;
+        unsigned queries = 0;
+        unsigned elided = 0;
+    };
+
+    struct CullStats
+    {
+        unsigned visibleNodes = 0;
+        unsigned culledNodes = 0;
+        size_t drawnAtoms = 0;
+        size_t drawnPoints = 0;
+        size_t totalPoints = 0;
+    };
+
+    struct GlStateCache
+    {
+        GLuint program = 0;
+        bool lighting = false;
+        bool blend = false;
+        float pointSize = 1.0f;
+        float lineWidth = 1.0f;
+        float color[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+        GLint viewport[4] = {};
+        GLuint vertexArray = 0;
+        GLuint framebuffer = 0;
+        float clearColor[4] = {};
+        GLenum blendFunc[4] = {};
+        bool depthTest = false;
+        bool depthMask = true;
+        bool colorMask = true;
+        bool programKnown = false;
+        bool lightingKnown = false;
+        bool blendKnown = false;
+        bool pointSizeKnown = false;
+        bool lineWidthKnown = false;
+        bool colorKnown = false;
+        bool viewportKnown = false;
+        bool vertexArrayKnown = false;
+        bool framebufferKnown = false;
+        bool clearColorKnown = false;
+        bool blendFuncKnown = false;
+        bool depthTestKnown = false;
+        bool depthMaskKnown = false;
+        bool colorMaskKnown = false;
+        GlStats stats;
+        GlStats lastFrame;
+    };
+
+    static GlStateCache gGlState;
+    static std::map<MeshKey, Mesh> gMeshCache;
     static sf::Font gFont;
     static bool gFontLoaded = false;
     static GLuint gBackgroundTex = 0;
-    static bool gBackgroundTexLoaded = false;
+    static WorkerPool gWorkerPool;
+    static AssetLoader gAssetLoader;
+    static bool gTextureCacheEnabled = true;
+    static std::string gTextureCacheDir = "cache/textures";
+    static GLint gMaxTextureSize = 0;
     static sf::View gGuiView;
     static bool gGuiViewInitialized = false;
     static GLuint gAtomProgram = 0;
+    static GLuint gCloudProgram = 0;
+    static bool gCoreProfile = false;
+    constexpr GLuint CORE_POSITION_ATTRIB = 0;
+    constexpr GLuint CORE_NORMAL_ATTRIB = 1;
+    constexpr GLuint CORE_COLOR_ATTRIB = 2;
+    constexpr GLuint CORE_TEXCOORD_ATTRIB = 5;
+    constexpr GLuint FRAME_UBO_BINDING = 0;
 
-    float rand01()
+    struct FrameUniforms
     {
-        return std::rand() / static_cast<float>(RAND_MAX);
-    }
-}
+        float projection[16];
+        float view[16];
+        float lightPosition[4];
+    };
 
-static void initOpenGL()
-{
-    glClearColor(0.02f, 0.02f, 0.06f, 1.0f);
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LEQUAL);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-}
+    struct ProgramUniforms
+    {
+        GLuint program;
+        GLint model;
+    };
 
-static void initLighting()
-{
-    glEnable(GL_LIGHTING);
-    glEnable(GL_LIGHT0);
-    const GLfloat globalAmbient[] = { 0.05f, 0.05f, 0.08f, 1.0f };
-    glLightModelfv(GL_LIGHT_MODEL_AMBIENT, globalAmbient);
-    glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, GL_FALSE);
-    const GLfloat lightAmbient[] = { 0.2f, 0.2f, 0.25f, 1.0f };
-    const GLfloat lightDiffuse[] = { 0.8f, 0.8f, 0.9f, 1.0f };
-    const GLfloat lightSpecular[] = { 1.0f, 1.0f, 1.0f, 1.0f };
-    glLightfv(GL_LIGHT0, GL_AMBIENT, lightAmbient);
-    glLightfv(GL_LIGHT0, GL_DIFFUSE, lightDiffuse);
-    glLightfv(GL_LIGHT0, GL_SPECULAR, lightSpecular);
-    glEnable(GL_COLOR_MATERIAL);
-    glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
-    const GLfloat matSpecular[] = { 0.9f, 0.9f, 0.9f, 1.0f };
-    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, matSpecular);
-    glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 64.0f);
-    glShadeModel(GL_SMOOTH);
-    glEnable(GL_NORMALIZE);
+    static std::vector<ProgramUniforms> gProgramUniforms;
+
+    constexpr char SHADER_CACHE_MAGIC[4] = { 'G', '3', 'D', 'S' };
+    constexpr uint32_t SHADER_CACHE_VERSION = 1;
+    constexpr int SHADER_INCLUDE_DEPTH = 8;
+    constexpr int SHADER_WATCH_INTERVAL_MS = 250;
+
+    struct ShaderCacheHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint64_t key;
+        uint32_t format;
+        uint32_t length;
+    };
+
+    struct ShaderSource
+    {
+        std::string vertex;
+        std::string fragment;
+        std::vector<std::pair<std::string, int64_t>> files;
+        uint64_t key = 0;
+    };
+
+    struct ShaderProgram
+    {
+        std::string name;
+        std::string vertexFile;
+        std::string fragmentFile;
+        std::string defines;
+        std::vector<std::pair<GLuint, std::string>> attribs;
+        GLuint* target = nullptr;
+        void (*configure)(GLuint program) = nullptr;
+        std::vector<std::pair<std::string, int64_t>> files;
+        uint64_t key = 0;
+    };
+
+    struct ShaderReload
+    {
+        size_t index;
+        GLuint program;
+        uint64_t key;
+    };
+
+    struct ShaderLoadStats
+    {
+        int linked = 0;
+        int cached = 0;
+    };
+
+    struct ShaderWatcher
+    {
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::vector<ShaderReload> ready;
+        bool quit = false;
+    };
+
+    static std::string gShaderDir = "resources/shaders";
+    static std::string gShaderCacheDir = "cache/shaders";
+    static bool gShaderCacheEnabled = true;
+    static bool gShaderWatchEnabled = false;
+    static bool gProgramBinarySupported = false;
+    static std::string gShaderDriverId;
+    static std::vector<ShaderProgram> gShaderPrograms;
+    static ShaderLoadStats gShaderLoadStats;
+    static ShaderWatcher gShaderWatcher;
+    static GLuint gFlatProgram = 0;
+    static GLuint gBackgroundProgram = 0;
+    static GLuint gTextProgram = 0;
+    static GLint gTextScreenLoc = -1;
+    static GLuint gFrameUbo = 0;
+    static GLuint gCloudVao = 0;
+    static GLuint gTextVao = 0;
+    static GLuint gTextVbo = 0;
+    constexpr GLuint ELECTRON_INSTANCE_ATTRIB = 6;
+    static GLuint gElectronProgram = 0;
+    static GLuint gElectronAxesProgram = 0;
+    static GLint gElectronTimeLoc = -1;
+    static GLint gElectronAxesTimeLoc = -1;
+    static GLuint gElectronInstanceVbo = 0;
+    static GLsizei gElectronInstanceCount = 0;
+    static int gElectronInstancesFor = 0;
+    constexpr GLuint MOLECULE_INSTANCE_ATTRIB = 3;
+    constexpr GLuint MOLECULE_COLOR_ATTRIB = 4;
+    constexpr size_t MOLECULE_MIN_CHUNK_BYTES = 256 * 1024;
+    constexpr size_t XYZ_MIN_ATOM_LINE_BYTES = 2;
+
+    struct MoleculeInstance
+    {
+        float position[3];
+        float radius;
+        uint8_t color[4];
+    };
+
+    struct Mat4
+    {
+        float m[16];
+    };
+
+    struct Frustum
+    {
+        float plane[6][4];
+    };
+
+    constexpr int FRUSTUM_OUTSIDE = 0;
+    constexpr int FRUSTUM_INTERSECT = 1;
+    constexpr int FRUSTUM_INSIDE = 2;
+    constexpr int SPHERE_LOD_COUNT = 4;
+    constexpr int SPHERE_LOD_SLICES[SPHERE_LOD_COUNT] = { 32, 16, 10, 6 };
+    constexpr float SPHERE_MAX_ERROR_PX = 0.5f;
+    constexpr uint32_t OCTREE_LEAF_SIZE = 2048;
+    constexpr int OCTREE_MAX_DEPTH = 10;
+    constexpr float CLOUD_POINTS_PER_PIXEL = 1.5f;
+    constexpr size_t CLOUD_MIN_SEGMENT_POINTS = 256;
+    constexpr float CLOUD_MAX_ALPHA_SCALE = 4.f;
+
+    constexpr float NUCLEUS_RADIUS = 0.25f;
+    constexpr int VOLUME_GRID = 96;
+    constexpr int VOLUME_RADIAL_TABLE = 1024;
+    constexpr int VOLUME_TILE = 32;
+    constexpr float VOLUME_STEP_VOXELS = 0.75f;
+    constexpr float VOLUME_OPACITY = 8.f;
+    constexpr float VOLUME_MIN_TRANSMITTANCE = 1.f / 256.f;
+
+    struct VolumeGrid
+    {
+        int Z = 0;
+        int size = 0;
+        float extent = 0.f;
+        float extinction = 0.f;
+        float radius = 0.f;
+        std::vector<float> voxels;
+    };
+
+    struct VolumeTileQueue
+    {
+        alignas(64) std::atomic<uint64_t> range{ 0 };
+    };
+
+    struct VolumeFrame
+    {
+        float origin[3] = {};
+        float dir00[3] = {};
+        float dirDx[3] = {};
+        float dirDy[3] = {};
+        int width = 0;
+        int height = 0;
+        int tilesX = 0;
+        uint32_t* pixels = nullptr;
+    };
+
+    struct VolumeRenderer
+    {
+        std::vector<std::thread> threads;
+        std::unique_ptr<VolumeTileQueue[]> queues;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+        uint64_t generation = 0;
+        unsigned workers = 1;
+        unsigned running = 0;
+        bool quit = false;
+        VolumeFrame frame;
+        VolumeGrid grid;
+        VolumeGrid baked;
+        std::thread bakeThread;
+        std::atomic<bool> bakeReady{ false };
+        std::vector<uint32_t> pixels;
+        GLuint texture = 0;
+        GLuint pbo = 0;
+        int texWidth = 0;
+        int texHeight = 0;
+        Mat4 modelView = {};
+        double renderMs = 0.0;
+    };
+
+    constexpr int ISO_BRICK = 8;
+    constexpr int ISO_LEVELS_PER_DECADE = 4;
+    constexpr int ISO_LEVEL_MIN = -12;
+    constexpr int ISO_LEVEL_MAX = 4;
+    constexpr int ISO_GRID_SIZES[] = { 48, 64, 96, 128 };
+    constexpr int ISO_VERTEX_FLOATS = 9;
+    constexpr size_t ISO_CACHE_BYTES = size_t(256) << 20;
+    constexpr uint64_t ISO_SEAM_EMPTY = UINT64_MAX;
+    constexpr int MC_MAX_CASE_INDICES = 16;
+
+    struct MarchingCubesTable
+    {
+        int8_t edgeCorner[12];
+        int8_t edgeAxis[12];
+        int8_t triangles[256][MC_MAX_CASE_INDICES];
+    };
+
+    struct IsoField
+    {
+        VolumeGrid grid;
+        int bricks = 0;
+        std::vector<int> levelSize;
+        std::vector<std::vector<float>> pyramid;
+    };
+
+    struct IsoBrickMesh
+    {
+        std::vector<float> vertices;
+        std::vector<uint32_t> indices;
+        std::vector<std::pair<uint64_t, uint32_t>> seams;
+    };
+
+    struct IsoKey
+    {
+        int Z = 0;
+        int level = 0;
+        int size = 0;
+        bool operator<(const IsoKey& o) const
+        {
+            return std::tie(Z, level, size) < std::tie(o.Z, o.level, o.size);
+        }
+    };
+
+    struct IsoEntry
+    {
+        Mesh mesh;
+        size_t bytes = 0;
+        size_t triangles = 0;
+        double buildMs = 0.0;
+        std::list<IsoKey>::iterator lru;
+    };
+
+    struct IsoScratch
+    {
+        std::vector<uint32_t> active;
+        std::vector<IsoBrickMesh> bricks;
+        std::vector<float> vertices;
+        std::vector<uint32_t> indices;
+        std::vector<uint32_t> remap;
+        std::vector<uint64_t> seamKeys;
+        std::vector<uint32_t> seamSlots;
+    };
+
+    struct IsoCache
+    {
+        IsoField field;
+        IsoScratch scratch;
+        std::map<IsoKey, IsoEntry> meshes;
+        std::list<IsoKey> lru;
+        size_t bytes = 0;
+        size_t hits = 0;
+        size_t misses = 0;
+    };
+
+    constexpr int WAVE_LANES = 8;
+    constexpr float WAVE_BOX_BOHR = 20.f;
+    constexpr float WAVE_DT = 0.05f;
+    constexpr float WAVE_SOFTENING = 0.5f;
+    constexpr float WAVE_ABSORBER = 0.12f;
+    constexpr float WAVE_PACKET_OFFSET = 5.f;
+    constexpr float WAVE_PACKET_WIDTH = 1.2f;
+    constexpr float WAVE_PACKET_MOMENTUM = 0.45f;
+    constexpr float WAVE_SCENE_EXTENT = 6.f;
+    constexpr float WAVE_MAX_ISO_FRACTION = 0.9f;
+
+    struct WaveFftPlan
+    {
+        int size = 0;
+        std::vector<float> cosTable;
+        std::vector<float> sinTable;
+        std::vector<uint32_t> bitReverse;
+    };
+
+    struct WaveStats
+    {
+        double time = 0.0;
+        double norm = 0.0;
+        double stepMs = 0.0;
+        uint64_t steps = 0;
+    };
+
+    struct WaveSolver
+    {
+        int size = 0;
+        float spacing = 0.f;
+        WaveFftPlan fft;
+        std::vector<float> psi;
+        std::vector<float> potential;
+        std::vector<float> kinetic;
+        std::vector<float> pending;
+        std::vector<float> ready;
+        WaveStats stats;
+        WaveStats published;
+        WaveStats shown;
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool fresh = false;
+        bool active = false;
+        bool reset = false;
+        bool quit = false;
+        IsoField field;
+        IsoScratch scratch;
+        Mesh mesh;
+        int shownLevel = 0;
+        size_t triangles = 0;
+    };
+
+    struct OctreeNode
+    {
+        uint32_t first = 0;
+        uint32_t count = 0;
+        int32_t firstChild = -1;
+        int childCount = 0;
+    };
+
+    struct NodeBounds
+    {
+        float lo[3];
+        float hi[3];
+        float maxRadius;
+    };
+
+    struct MoleculeOctree
+    {
+        std::vector<OctreeNode> nodes;
+        std::vector<uint32_t> order;
+    };
+
+    struct InstanceRun
+    {
+        uint32_t first;
+        uint32_t count;
+        int lod;
+    };
+
+    struct MoleculeData
+    {
+        std::string name;
+        std::vector<float> positions;
+        std::vector<uint8_t> elements;
+        float center[3] = {};
+        float radius = 1.f;
+        GLuint instanceVbo = 0;
+        MoleculeOctree octree;
+        std::vector<NodeBounds> bounds;
+    };
+
+    constexpr int TRAJECTORY_RING = 6;
+    constexpr char TRAJECTORY_INDEX_MAGIC[4] = { 'G', '3', 'D', 'T' };
+    constexpr uint32_t TRAJECTORY_INDEX_VERSION = 1;
+
+    struct TrajectoryIndexHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint64_t fileSize;
+        int64_t fileTime;
+        uint64_t atomCount;
+        uint64_t frameCount;
+        uint64_t reserved;
+    };
+
+    struct TrajectorySlot
+    {
+        int frame = -1;
+        bool ready = false;
+        bool uploading = false;
+        int gpuFrame = -1;
+        GLuint vbo = 0;
+        std::vector<float> positions;
+        std::vector<uint8_t> elements;
+        std::vector<MoleculeInstance> instances;
+        std::vector<NodeBounds> bounds;
+        std::vector<NodeBounds> gpuBounds;
+    };
+
+    struct Trajectory
+    {
+        MappedFile file;
+        std::vector<uint64_t> frameOffsets;
+        size_t atoms = 0;
+        float center[3] = {};
+        MoleculeOctree octree;
+        int frameCount = 0;
+        double position = 0.0;
+        int currentFrame = 0;
+        float fps = 30.f;
+        bool loop = true;
+        int shownSlot = -1;
+        TrajectorySlot slots[TRAJECTORY_RING];
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable wake;
+        int wantFrame = 0;
+        bool quit = false;
+    };
+
+    static GLuint gMoleculeProgram = 0;
+    static MoleculeData gMolecule;
+    static std::string gMoleculePath;
+    static Trajectory gTrajectory;
+    static float gTrajectoryFps = 30.f;
+    static Mat4 gProjectionMatrix;
+    static Mat4 gViewMatrix;
+    static std::vector<Mat4> gModelStack;
+    static float gViewportHeight = 1.f;
+    static CullStats gCullStats;
+    static std::vector<InstanceRun> gMoleculeRuns;
+    static CloudUniforms gCloudUniforms;
+    static CloudUniforms gCloudOitUniforms;
+    static CloudUniforms gCloudSortedUniforms;
+    static GLuint gCloudOitProgram = 0;
+    static GLuint gCloudSortedProgram = 0;
+    static GLuint gOitCompositeProgram = 0;
+    static CloudUniforms gCloudSplatUniforms;
+    static CloudUniforms gCloudSplatOitUniforms;
+    static GLuint gCloudSplatProgram = 0;
+    static GLuint gCloudSplatOitProgram = 0;
+    static GLuint gCloudColormap = 0;
+    static OitTargets gOit;
+    static CloudSorter gCloudSorter;
+    static VolumeRenderer gVolume;
+    static unsigned gVolumeThreads = 0;
+    static IsoCache gIso;
+    static int gIsoGridSize = 96;
+    static WaveSolver gWave;
+    static int gWaveGridSize = 128;
+    static size_t gCloudSampleCount = 200000;
+    static uint64_t gCloudSeed = 0x5EEDull;
+    static CloudWorker gCloudWorker;
+    static CloudUploadState gCloudUpload;
+    static CloudGpuBuffer gCloudBuffers[2];
+    static int gCloudFront = 0;
+    static int gCloudRequestedZ = 0;
+    static bool gCloudCacheEnabled = true;
+    static std::string gCloudCacheDir = "cache";
+
+    struct BenchmarkOptions
+    {
+        bool enabled = false;
+        int frames = 300;
+        int warmupFrames = 10;
+        float dt = 1.0f / 60.0f;
+        unsigned width = 1024;
+        unsigned height = 768;
+        std::string dumpDir;
+        std::vector<int> dumpFrames;
+    };
+
+    enum class ProfileStage
+    {
+        Uploads = 0,
+        Background,
+        View,
+        Atom,
+        Animation,
+        Gui,
+        Count
+    };
+
+    constexpr int PROFILE_STAGE_COUNT = static_cast<int>(ProfileStage::Count);
+    constexpr int PROFILE_RING = 4;
+    const char* const PROFILE_STAGE_NAMES[PROFILE_STAGE_COUNT] =
+    {
+        "upload", "tlo", "widok", "atom", "animacja", "gui"
+    };
+
+    struct ProfileFrame
+    {
+        uint64_t index = 0;
+        bool pending = false;
+        double frameMs = 0.0;
+        double cpuMs[PROFILE_STAGE_COUNT] = {};
+        double gpuMs[PROFILE_STAGE_COUNT] = {};
+        bool gpuUsed[PROFILE_STAGE_COUNT] = {};
+        GlStats glStats;
+        CullStats cullStats;
+    };
+
+    struct Profiler
+    {
+        bool enabled = false;
+        bool hudVisible = false;
+        bool gpuTimers = false;
+        std::ofstream csv;
+        GLuint queries[PROFILE_RING][PROFILE_STAGE_COUNT] = {};
+        ProfileFrame frames[PROFILE_RING];
+        uint64_t frameIndex = 0;
+        int slot = 0;
+        std::chrono::steady_clock::time_point frameStart;
+        double avgFrameMs = 0.0;
+        double avgCpuMs[PROFILE_STAGE_COUNT] = {};
+        double avgGpuMs[PROFILE_STAGE_COUNT] = {};
+    };
+
+    static Profiler gProfiler;
+
+    enum class GuiBlock
+    {
+        Status = 0,
+        Help,
+        Profiler,
+        Count
+    };
+
+    constexpr int GUI_BLOCK_COUNT = static_cast<int>(GuiBlock::Count);
+    constexpr int GUI_HUD_REFRESH_MS = 250;
+
+    struct GuiStatusKey
+    {
+        int electronCount = -1;
+        ViewMode viewMode = ViewMode::BohrOrbits;
+        CloudBlend cloudBlend = CloudBlend::Alpha;
+        bool cloudSplats = false;
+        bool cloudVolume = false;
+        int isoLevel = 0;
+        int isoGrid = 0;
+        uint64_t waveSteps = 0;
+        size_t atoms = 0;
+        int frame = -1;
+        int frameCount = 0;
+        bool loop = false;
+    };
+
+    struct GuiTextBlock
+    {
+        std::string text;
+        unsigned size = 18;
+        float x = 0.f;
+        float y = 0.f;
+        bool visible = false;
+    };
+
+    struct GuiDrawRange
+    {
+        unsigned size = 0;
+        GLuint texture = 0;
+        GLint first = 0;
+        GLsizei count = 0;
+    };
+
+    struct GuiOverlay
+    {
+        GuiTextBlock blocks[GUI_BLOCK_COUNT];
+        GuiStatusKey statusKey;
+        bool initialized = false;
+        bool dirty = true;
+        std::vector<float> vertices;
+        std::vector<GuiDrawRange> ranges;
+        std::chrono::steady_clock::time_point hudUpdated;
+    };
+
+    static GuiOverlay gGuiOverlay;
+
+    enum class PacingMode
+    {
+        Power = 0,
+        Latency
+    };
+
+    constexpr double PACING_SPIN_MS = 2.0;
+    constexpr int PACING_DEFAULT_REFRESH_HZ = 60;
+    constexpr int IDLE_POLL_MS = 50;
+    constexpr size_t FRAME_INTERVAL_HISTORY = 1024;
+
+    struct FramePacer
+    {
+        PacingMode mode = PacingMode::Power;
+        int fpsCap = 0;
+        int refreshHz = PACING_DEFAULT_REFRESH_HZ;
+        std::chrono::steady_clock::time_point nextFrame;
+        std::chrono::steady_clock::time_point lastPresent;
+        std::chrono::steady_clock::time_point started;
+        bool resumed = true;
+        std::vector<double> intervalsMs;
+        size_t intervalCursor = 0;
+        uint64_t frames = 0;
+        uint64_t idleWaits = 0;
+        double idleMs = 0.0;
+        double avgIntervalMs = 0.0;
+    };
+
+    static FramePacer gFramePacer;
+
+    constexpr double SIM_STEP_S = 1.0 / 120.0;
+    constexpr int SIM_MAX_CATCHUP_STEPS = 8;
+    constexpr int SIM_SLOT_FRESH = 4;
+
+    struct SimState
+    {
+        float electronAngleDeg = 0.f;
+        double trajectoryPosition = 0.0;
+    };
+
+    struct SimSnapshot
+    {
+        SimState prev;
+        SimState curr;
+        std::chrono::steady_clock::time_point time;
+        uint64_t step = 0;
+        uint64_t commandSeq = 0;
+    };
+
+    struct Simulation
+    {
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool quit = false;
+        bool resetAngle = false;
+        bool seekPending = false;
+        double seekPosition = 0.0;
+        uint64_t commandSeq = 0;
+        std::atomic<bool> animate{ true };
+        std::atomic<bool> trajectoryActive{ false };
+        std::atomic<bool> trajectoryLoop{ true };
+        SimSnapshot slots[3];
+        std::atomic<int> middle{ 1 };
+        int back = 2;
+        int front = 0;
+    };
+
+    static Simulation gSim;
+
+    struct FrameStats
+    {
+        double minMs = 0.0;
+        double medianMs = 0.0;
+        double p99Ms = 0.0;
+    };
+
+    void shellCloudColor(int shell, GLfloat out[4])
+    {
+        out[0] = 0.3f + 0.15f * std::max(0, shell - 2);
+        out[1] = std::min(1.0f, 0.5f + 0.15f * shell);
+        out[2] = 1.0f;
+        out[3] = 0.16f + 0.05f * shell;
+    }
+}
+
+static void countStateChange(bool redundant)
+{
+    if (redundant)
+        ++gGlState.stats.redundant;
+    else
+        ++gGlState.stats.changes;
+}
+
+static void invalidateGlState()
+{
+    GlStats stats = gGlState.stats;
+    GlStats lastFrame = gGlState.lastFrame;
+    gGlState = GlStateCache();
+    gGlState.stats = stats;
+    gGlState.lastFrame = lastFrame;
+    gGlState.lightingKnown = gCoreProfile;
+}
+
+static void endGlStateFrame()
+{
+    gGlState.lastFrame = gGlState.stats;
+    gGlState.stats = GlStats();
+}
+
+static void useProgram(GLuint program)
+{
+    bool redundant = gGlState.programKnown && gGlState.program == program;
+    countStateChange(redundant);
+    if (redundant) return;
+    glUseProgram(program);
+    gGlState.program = program;
+    gGlState.programKnown = true;
+}
+
+static void setLighting(bool enabled)
+{
+    bool redundant = gGlState.lightingKnown && gGlState.lighting == enabled;
+    countStateChange(redundant);
+    if (redundant) return;
+    if (!gCoreProfile)
+    {
+        if (enabled) glEnable(GL_LIGHTING);
+        else glDisable(GL_LIGHTING);
+    }
+    gGlState.lighting = enabled;
+    gGlState.lightingKnown = true;
+}
+
+static void setBlending(bool enabled)
+{
+    bool redundant = gGlState.blendKnown && gGlState.blend == enabled;
+    countStateChange(redundant);
+    if (redundant) return;
+    if (enabled) glEnable(GL_BLEND);
+    else glDisable(GL_BLEND);
+    gGlState.blend = enabled;
+    gGlState.blendKnown = true;
+}
+
+static void setBlendFunc(GLenum srcRgb, GLenum dstRgb, GLenum srcAlpha, GLenum dstAlpha)
+{
+    const GLenum* f = gGlState.blendFunc;
+    bool redundant = gGlState.blendFuncKnown && f[0] == srcRgb && f[1] == dstRgb && f[2] == srcAlpha && f[3] == dstAlpha;
+    countStateChange(redundant);
+    if (redundant) return;
+    if (srcRgb == srcAlpha && dstRgb == dstAlpha)
+        glBlendFunc(srcRgb, dstRgb);
+    else
+        glBlendFuncSeparate(srcRgb, dstRgb, srcAlpha, dstAlpha);
+    gGlState.blendFunc[0] = srcRgb;
+    gGlState.blendFunc[1] = dstRgb;
+    gGlState.blendFunc[2] = srcAlpha;
+    gGlState.blendFunc[3] = dstAlpha;
+    gGlState.blendFuncKnown = true;
+}
+
+static void setBlendFunc(GLenum src, GLenum dst)
+{
+    setBlendFunc(src, dst, src, dst);
+}
+
+static void setDepthTest(bool enabled)
+{
+    bool redundant = gGlState.depthTestKnown && gGlState.depthTest == enabled;
+    countStateChange(redundant);
+    if (redundant) return;
+    if (enabled) glEnable(GL_DEPTH_TEST);
+    else glDisable(GL_DEPTH_TEST);
+    gGlState.depthTest = enabled;
+    gGlState.depthTestKnown = true;
+}
+
+static void setDepthMask(bool enabled)
+{
+    bool redundant = gGlState.depthMaskKnown && gGlState.depthMask == enabled;
+    countStateChange(redundant);
+    if (redundant) return;
+    glDepthMask(enabled ? GL_TRUE : GL_FALSE);
+    gGlState.depthMask = enabled;
+    gGlState.depthMaskKnown = true;
+}
+
+static void setColorMask(bool enabled)
+{
+    bool redundant = gGlState.colorMaskKnown && gGlState.colorMask == enabled;
+    countStateChange(redundant);
+    if (redundant) return;
+    const GLboolean mask = enabled ? GL_TRUE : GL_FALSE;
+    glColorMask(mask, mask, mask, mask);
+    gGlState.colorMask = enabled;
+    gGlState.colorMaskKnown = true;
+}
+
+static void setClearColor(float r, float g, float b, float a)
+{
+    const float* c = gGlState.clearColor;
+    bool redundant = gGlState.clearColorKnown && c[0] == r && c[1] == g && c[2] == b && c[3] == a;
+    countStateChange(redundant);
+    if (redundant) return;
+    glClearColor(r, g, b, a);
+    gGlState.clearColor[0] = r;
+    gGlState.clearColor[1] = g;
+    gGlState.clearColor[2] = b;
+    gGlState.clearColor[3] = a;
+    gGlState.clearColorKnown = true;
+}
+
+static void bindFramebuffer(GLuint fbo)
+{
+    bool redundant = gGlState.framebufferKnown && gGlState.framebuffer == fbo;
+    countStateChange(redundant);
+    if (redundant) return;
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    gGlState.framebuffer = fbo;
+    gGlState.framebufferKnown = true;
+}
+
+static void setPointSize(float size)
+{
+    bool redundant = gGlState.pointSizeKnown && gGlState.pointSize == size;
+    countStateChange(redundant);
+    if (redundant) return;
+    glPointSize(size);
+    gGlState.pointSize = size;
+    gGlState.pointSizeKnown = true;
+}
+
+static void setLineWidth(float width)
+{
+    if (gCoreProfile)
+        width = 1.0f;
+    bool redundant = gGlState.lineWidthKnown && gGlState.lineWidth == width;
+    countStateChange(redundant);
+    if (redundant) return;
+    glLineWidth(width);
+    gGlState.lineWidth = width;
+    gGlState.lineWidthKnown = true;
+}
+
+static void setColor(float r, float g, float b, float a = 1.0f)
+{
+    const float* c = gGlState.color;
+    bool redundant = gGlState.colorKnown && c[0] == r && c[1] == g && c[2] == b && c[3] == a;
+    countStateChange(redundant);
+    if (redundant) return;
+    if (gCoreProfile)
+        glVertexAttrib4f(CORE_COLOR_ATTRIB, r, g, b, a);
+    else
+        glColor4f(r, g, b, a);
+    gGlState.color[0] = r;
+    gGlState.color[1] = g;
+    gGlState.color[2] = b;
+    gGlState.color[3] = a;
+    gGlState.colorKnown = true;
+}
+
+static void setViewport(GLint x, GLint y, GLsizei w, GLsizei h)
+{
+    const GLint* v = gGlState.viewport;
+    bool redundant = gGlState.viewportKnown && v[0] == x && v[1] == y && v[2] == w && v[3] == h;
+    countStateChange(redundant);
+    if (redundant) return;
+    glViewport(x, y, w, h);
+    gGlState.viewport[0] = x;
+    gGlState.viewport[1] = y;
+    gGlState.viewport[2] = w;
+    gGlState.viewport[3] = h;
+    gGlState.viewportKnown = true;
+}
+
+static void bindVertexArray(GLuint vao)
+{
+    bool redundant = gGlState.vertexArrayKnown && gGlState.vertexArray == vao;
+    countStateChange(redundant);
+    if (redundant) return;
+    glBindVertexArray(vao);
+    gGlState.vertexArray = vao;
+    gGlState.vertexArrayKnown = true;
+}
+
+static void vertexAttribDivisor(GLuint index, GLuint divisor)
+{
+    if (gCoreProfile)
+        glVertexAttribDivisor(index, divisor);
+    else
+        glVertexAttribDivisorARB(index, divisor);
+}
+
+static bool lightingEnabled()
+{
+    if (!gGlState.lightingKnown)
+    {
+        gGlState.lighting = glIsEnabled(GL_LIGHTING) == GL_TRUE;
+        gGlState.lightingKnown = true;
+        ++gGlState.stats.queries;
+    }
+    else
+    {
+        ++gGlState.stats.elided;
+    }
+    return gGlState.lighting;
+}
+
+static GLuint currentProgram()
+{
+    if (!gGlState.programKnown)
+    {
+        GLint program = 0;
+        glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+        gGlState.program = static_cast<GLuint>(program);
+        gGlState.programKnown = true;
+        ++gGlState.stats.queries;
+    }
+    else
+    {
+        ++gGlState.stats.elided;
+    }
+    return gGlState.program;
+}
+
+static const float* currentClearColor()
+{
+    if (!gGlState.clearColorKnown)
+    {
+        glGetFloatv(GL_COLOR_CLEAR_VALUE, gGlState.clearColor);
+        gGlState.clearColorKnown = true;
+        ++gGlState.stats.queries;
+    }
+    else
+    {
+        ++gGlState.stats.elided;
+    }
+    return gGlState.clearColor;
+}
+
+static GLuint currentFramebuffer()
+{
+    if (!gGlState.framebufferKnown)
+    {
+        GLint fbo = 0;
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &fbo);
+        gGlState.framebuffer = static_cast<GLuint>(fbo);
+        gGlState.framebufferKnown = true;
+        ++gGlState.stats.queries;
+    }
+    else
+    {
+        ++gGlState.stats.elided;
+    }
+    return gGlState.framebuffer;
+}
+
+static const GLint* currentViewport()
+{
+    if (!gGlState.viewportKnown)
+    {
+        glGetIntegerv(GL_VIEWPORT, gGlState.viewport);
+        gGlState.viewportKnown = true;
+        ++gGlState.stats.queries;
+    }
+    else
+    {
+        ++gGlState.stats.elided;
+    }
+    return gGlState.viewport;
+}
+
+static Mat4 mat4Identity()
+{
+    Mat4 r = {};
+    r.m[0] = r.m[5] = r.m[10] = r.m[15] = 1.f;
+    return r;
+}
+
+static Mat4 mat4Multiply(const Mat4& a, const Mat4& b)
+{
+    Mat4 r;
+    for (int c = 0; c < 4; ++c)
+        for (int row = 0; row < 4; ++row)
+            r.m[c * 4 + row] = a.m[row] * b.m[c * 4] + a.m[4 + row] * b.m[c * 4 + 1]
+                + a.m[8 + row] * b.m[c * 4 + 2] + a.m[12 + row] * b.m[c * 4 + 3];
+    return r;
+}
+
+static Mat4 mat4Perspective(float fovDeg, float aspect, float zNear, float zFar)
+{
+    const float f = 1.f / std::tan(deg2rad(fovDeg) * 0.5f);
+    Mat4 r = {};
+    r.m[0] = f / aspect;
+    r.m[5] = f;
+    r.m[10] = (zFar + zNear) / (zNear - zFar);
+    r.m[11] = -1.f;
+    r.m[14] = 2.f * zFar * zNear / (zNear - zFar);
+    return r;
+}
+
+static Mat4 mat4LookAt(const sf::Vector3f& eye, const sf::Vector3f& center, const sf::Vector3f& up)
+{
+    sf::Vector3f f(center.x - eye.x, center.y - eye.y, center.z - eye.z);
+    const float fLen = std::sqrt(f.x * f.x + f.y * f.y + f.z * f.z);
+    f = sf::Vector3f(f.x / fLen, f.y / fLen, f.z / fLen);
+    sf::Vector3f s(f.y * up.z - f.z * up.y, f.z * up.x - f.x * up.z, f.x * up.y - f.y * up.x);
+    const float sLen = std::sqrt(s.x * s.x + s.y * s.y + s.z * s.z);
+    s = sf::Vector3f(s.x / sLen, s.y / sLen, s.z / sLen);
+    sf::Vector3f u(s.y * f.z - s.z * f.y, s.z * f.x - s.x * f.z, s.x * f.y - s.y * f.x);
+    Mat4 r = mat4Identity();
+    r.m[0] = s.x; r.m[4] = s.y; r.m[8] = s.z;
+    r.m[1] = u.x; r.m[5] = u.y; r.m[9] = u.z;
+    r.m[2] = -f.x; r.m[6] = -f.y; r.m[10] = -f.z;
+    r.m[12] = -(s.x * eye.x + s.y * eye.y + s.z * eye.z);
+    r.m[13] = -(u.x * eye.x + u.y * eye.y + u.z * eye.z);
+    r.m[14] = f.x * eye.x + f.y * eye.y + f.z * eye.z;
+    return r;
+}
+
+static Mat4 mat4Rotate(float deg, float x, float y, float z)
+{
+    const float c = std::cos(deg2rad(deg));
+    const float s = std::sin(deg2rad(deg));
+    const float t = 1.f - c;
+    Mat4 r = mat4Identity();
+    r.m[0] = t * x * x + c;     r.m[4] = t * x * y - s * z; r.m[8] = t * x * z + s * y;
+    r.m[1] = t * x * y + s * z; r.m[5] = t * y * y + c;     r.m[9] = t * y * z - s * x;
+    r.m[2] = t * x * z - s * y; r.m[6] = t * y * z + s * x; r.m[10] = t * z * z + c;
+    return r;
+}
+
+static Mat4 mat4Scale(float s)
+{
+    Mat4 r = mat4Identity();
+    r.m[0] = r.m[5] = r.m[10] = s;
+    return r;
+}
+
+static Mat4 mat4Translate(float x, float y, float z)
+{
+    Mat4 r = mat4Identity();
+    r.m[12] = x;
+    r.m[13] = y;
+    r.m[14] = z;
+    return r;
+}
+
+static void resetModel()
+{
+    gModelStack.assign(1, mat4Identity());
+}
+
+static const Mat4& currentModel()
+{
+    return gModelStack.back();
+}
+
+static Mat4 currentModelView()
+{
+    return mat4Multiply(gViewMatrix, gModelStack.back());
+}
+
+static void pushModel()
+{
+    gModelStack.push_back(gModelStack.back());
+    if (!gCoreProfile) glPushMatrix();
+}
+
+static void popModel()
+{
+    gModelStack.pop_back();
+    if (!gCoreProfile) glPopMatrix();
+}
+
+static void multModel(const Mat4& m)
+{
+    gModelStack.back() = mat4Multiply(gModelStack.back(), m);
+    if (!gCoreProfile) glMultMatrixf(m.m);
+}
+
+static void rotateModel(float deg, float x, float y, float z)
+{
+    multModel(mat4Rotate(deg, x, y, z));
+}
+
+static void scaleModel(float s)
+{
+    multModel(mat4Scale(s));
+}
+
+static void translateModel(float x, float y, float z)
+{
+    multModel(mat4Translate(x, y, z));
+}
+
+static void initOpenGL()
+{
+    invalidateGlState();
+    resetModel();
+    setClearColor(0.02f, 0.02f, 0.06f, 1.0f);
+    setDepthTest(true);
+    glDepthFunc(GL_LEQUAL);
+    setBlending(true);
+    setBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+static void initLighting()
+{
+    setLighting(true);
+    glEnable(GL_LIGHT0);
+    const GLfloat globalAmbient[] = { 0.05f, 0.05f, 0.08f, 1.0f };
+    glLightModelfv(GL_LIGHT_MODEL_AMBIENT, globalAmbient);
+    glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, GL_FALSE);
+    const GLfloat lightAmbient[] = { 0.2f, 0.2f, 0.25f, 1.0f };
+    const GLfloat lightDiffuse[] = { 0.8f, 0.8f, 0.9f, 1.0f };
+    const GLfloat lightSpecular[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    glLightfv(GL_LIGHT0, GL_AMBIENT, lightAmbient);
+    glLightfv(GL_LIGHT0, GL_DIFFUSE, lightDiffuse);
+    glLightfv(GL_LIGHT0, GL_SPECULAR, lightSpecular);
+    glEnable(GL_COLOR_MATERIAL);
+    glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
+    const GLfloat matSpecular[] = { 0.9f, 0.9f, 0.9f, 1.0f };
+    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, matSpecular);
+    glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 64.0f);
+    glShadeModel(GL_SMOOTH);
+    glEnable(GL_NORMALIZE);
+}
+
+static const char* LEGACY_VERTEX_PRELUDE = R"(
+#define VERTEX gl_Vertex
+#define NORMAL gl_Normal
+#define VERTEX_COLOR gl_Color
+#define MODEL_VIEW gl_ModelViewMatrix
+#define NORMAL_MATRIX gl_NormalMatrix
+#define PROJECTION gl_ProjectionMatrix
+)";
+
+static const char* LEGACY_FRAGMENT_PRELUDE = R"(
+#define FRAG_COLOR gl_FragColor
+#define FRAG_DATA0 gl_FragData[0]
+#define FRAG_DATA1 gl_FragData[1]
+#define POINT_COORD gl_TexCoord[0].xy
+#define LIGHT_POSITION vec3(2.0, 3.0, 4.0)
+)";
+
+static const char* CORE_VERTEX_PRELUDE = R"(#version 330 core
+#define attribute in
+#define varying out
+layout(std140) uniform Frame
+{
+    mat4 uProjection;
+    mat4 uView;
+    vec4 uLightPosition;
+};
+uniform mat4 uModel;
+in vec4 aPosition;
+in vec3 aNormal;
+in vec4 aColor;
+#define VERTEX aPosition
+#define NORMAL aNormal
+#define VERTEX_COLOR aColor
+#define MODEL_VIEW (uView * uModel)
+#define NORMAL_MATRIX mat3(uView * uModel)
+#define PROJECTION uProjection
+)";
+
+static const char* CORE_FRAGMENT_PRELUDE = R"(#version 330 core
+#define varying in
+#define texture2D texture
+layout(std140) uniform Frame
+{
+    mat4 uProjection;
+    mat4 uView;
+    vec4 uLightPosition;
+};
+layout(location = 0) out vec4 fragColor;
+layout(location = 1) out vec4 fragData1;
+#define FRAG_COLOR fragColor
+#define FRAG_DATA0 fragColor
+#define FRAG_DATA1 fragData1
+#define POINT_COORD gl_PointCoord
+#define LIGHT_POSITION uLightPosition.xyz
+)";
+
+static int64_t fileTimeStamp(const std::string& path)
+{
+    std::error_code ec;
+    auto time = std::filesystem::last_write_time(path, ec);
+    return ec ? 0 : static_cast<int64_t>(time.time_since_epoch().count());
+}
+
+static uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+static uint64_t hashString(const std::string& str, uint64_t hash)
+{
+    return hashBytes(str.c_str(), str.size() + 1, hash);
+}
+
+static const char* shaderPrelude(GLenum type)
+{
+    const bool vertex = type == GL_VERTEX_SHADER;
+    return gCoreProfile ? (vertex ? CORE_VERTEX_PRELUDE : CORE_FRAGMENT_PRELUDE)
+        : (vertex ? LEGACY_VERTEX_PRELUDE : LEGACY_FRAGMENT_PRELUDE);
+}
+
+static void appendLineDirective(std::string& text, int line, size_t source)
+{
+    // GLSL 1.10 numbers the line after "#line N" as N + 1, GLSL 330 as N.
+    text += "#line " + std::to_string(gCoreProfile ? line : line - 1) + " " + std::to_string(source) + "\n";
+}
+
+static bool appendShaderFile(const std::string& name, ShaderSource& out, std::string& text, int depth)
+{
+    const std::string path = gShaderDir + "/" + name;
+    const size_t source = out.files.size();
+    out.files.push_back({ path, fileTimeStamp(path) });
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+    {
+        std::cerr << "Brak pliku shadera: " << path << "\n";
+        return false;
+    }
+    appendLineDirective(text, 1, source);
+    std::string line;
+    for (int lineNumber = 1; std::getline(in, line); ++lineNumber)
+    {
+        const size_t start = line.find_first_not_of(" \t");
+        if (start != std::string::npos && line.compare(start, 8, "#include") == 0)
+        {
+            const size_t open = line.find('"', start);
+            const size_t close = open == std::string::npos ? open : line.find('"', open + 1);
+            if (close == std::string::npos || depth >= SHADER_INCLUDE_DEPTH)
+            {
+                std::cerr << "Niepoprawny #include w " << path << ": " << line << "\n";
+                return false;
+            }
+            if (!appendShaderFile(line.substr(open + 1, close - open - 1), out, text, depth + 1))
+                return false;
+            appendLineDirective(text, lineNumber + 1, source);
+            continue;
+        }
+        text += line;
+        text += '\n';
+    }
+    return true;
+}
+
+static bool readShaderSource(const ShaderProgram& p, ShaderSource& out)
+{
+    out = ShaderSource();
+    out.vertex = shaderPrelude(GL_VERTEX_SHADER) + p.defines;
+    out.fragment = shaderPrelude(GL_FRAGMENT_SHADER) + p.defines;
+    if (!appendShaderFile(p.vertexFile, out, out.vertex, 0)
+        || !appendShaderFile(p.fragmentFile, out, out.fragment, 0))
+        return false;
+    uint64_t key = hashBytes(&SHADER_CACHE_VERSION, sizeof(SHADER_CACHE_VERSION));
+    key = hashString(gShaderDriverId, key);
+    key = hashString(out.vertex, key);
+    key = hashString(out.fragment, key);
+    for (const auto& attrib : p.attribs)
+        key = hashString(attrib.second, hashBytes(&attrib.first, sizeof(attrib.first), key));
+    out.key = key;
+    return true;
+}
+
+static GLuint compileShader(GLenum type, const std::string& src, const std::string& name)
+{
+    GLuint shader = glCreateShader(type);
+    if (!shader) return 0;
+    const char* text = src.c_str();
+    glShaderSource(shader, 1, &text, nullptr);
+    glCompileShader(shader);
+    GLint status = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        GLint logLength = 0;
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
+        if (logLength > 0)
+        {
+            std::string log(logLength, '\0');
+            glGetShaderInfoLog(shader, logLength, nullptr, &log[0]);
+            std::cerr << "Błąd kompilacji shadera " << name << ": " << log << std::endl;
+        }
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+static GLuint linkProgram(const ShaderProgram& p, const ShaderSource& src)
+{
+    GLuint vs = compileShader(GL_VERTEX_SHADER, src.vertex, p.vertexFile);
+    GLuint fs = compileShader(GL_FRAGMENT_SHADER, src.fragment, p.fragmentFile);
+    if (!vs || !fs)
+    {
+        if (vs) glDeleteShader(vs);
+        if (fs) glDeleteShader(fs);
+        return 0;
+    }
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vs);
+    glAttachShader(program, fs);
+    if (gCoreProfile)
+    {
+        glBindAttribLocation(program, CORE_POSITION_ATTRIB, "aPosition");
+        glBindAttribLocation(program, CORE_NORMAL_ATTRIB, "aNormal");
+        glBindAttribLocation(program, CORE_COLOR_ATTRIB, "aColor");
+        glBindAttribLocation(program, CORE_TEXCOORD_ATTRIB, "aTexCoord");
+    }
+    for (const auto& attrib : p.attribs)
+        glBindAttribLocation(program, attrib.first, attrib.second.c_str());
+    if (gProgramBinarySupported && gShaderCacheEnabled)
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program);
+    GLint linkStatus = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linkStatus);
+    if (linkStatus != GL_TRUE)
+    {
+        GLint logLength = 0;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLength);
+        if (logLength > 0)
+        {
+            std::string log(logLength, '\0');
+            glGetProgramInfoLog(program, logLength, nullptr, &log[0]);
+            std::cerr << "Błąd linkowania programu shaderów " << p.name << ": " << log << std::endl;
+        }
+        glDeleteProgram(program);
+        program = 0;
+    }
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+    return program;
+}
+
+static std::string shaderCachePath(const ShaderProgram& p)
+{
+    return gShaderCacheDir + "/" + p.name + (gCoreProfile ? "_core" : "_legacy") + ".bin";
+}
+
+static GLuint loadProgramBinary(const ShaderProgram& p, uint64_t key)
+{
+    if (!gProgramBinarySupported || !gShaderCacheEnabled)
+        return 0;
+    std::ifstream in(shaderCachePath(p), std::ios::binary);
+    ShaderCacheHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))
+        || std::memcmp(header.magic, SHADER_CACHE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != SHADER_CACHE_VERSION
+        || header.key != key
+        || header.length == 0)
+        return 0;
+    std::vector<char> binary(header.length);
+    if (!in.read(binary.data(), binary.size()))
+        return 0;
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, header.format, binary.data(), static_cast<GLsizei>(header.length));
+    GLint status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+static void storeProgramBinary(const ShaderProgram& p, uint64_t key, GLuint program)
+{
+    if (!gProgramBinarySupported || !gShaderCacheEnabled)
+        return;
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+    std::vector<char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(program, length, &length, &format, binary.data());
+    if (length <= 0)
+        return;
+    ShaderCacheHeader header;
+    std::memcpy(header.magic, SHADER_CACHE_MAGIC, sizeof(header.magic));
+    header.version = SHADER_CACHE_VERSION;
+    header.key = key;
+    header.format = format;
+    header.length = static_cast<uint32_t>(length);
+
+    std::error_code ec;
+    std::filesystem::create_directories(gShaderCacheDir, ec);
+    const std::string path = shaderCachePath(p);
+    const std::string tmpPath = path + ".tmp";
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!out)
+        return;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(binary.data(), length);
+    out.close();
+    if (!out)
+    {
+        std::filesystem::remove(tmpPath, ec);
+        return;
+    }
+    std::filesystem::rename(tmpPath, path, ec);
+    if (ec)
+        std::filesystem::remove(tmpPath, ec);
+}
+
+static GLuint buildProgram(const ShaderProgram& p, const ShaderSource& src, bool& cached)
+{
+    GLuint program = loadProgramBinary(p, src.key);
+    cached = program != 0;
+    if (!program)
+    {
+        program = linkProgram(p, src);
+        if (program)
+            storeProgramBinary(p, src.key, program);
+    }
+    if (program && gCoreProfile)
+    {
+        GLuint block = glGetUniformBlockIndex(program, "Frame");
+        if (block != GL_INVALID_INDEX)
+            glUniformBlockBinding(program, block, FRAME_UBO_BINDING);
+    }
+    return program;
+}
+
+static void installProgram(ShaderProgram& p, GLuint program)
+{
+    const GLuint old = *p.target;
+    if (old)
+    {
+        if (currentProgram() == old)
+            useProgram(0);
+        glDeleteProgram(old);
+        gProgramUniforms.erase(std::remove_if(gProgramUniforms.begin(), gProgramUniforms.end(),
+            [old](const ProgramUniforms& u) { return u.program == old; }), gProgramUniforms.end());
+    }
+    *p.target = program;
+    if (!program)
+        return;
+    if (gCoreProfile)
+        gProgramUniforms.push_back({ program, glGetUniformLocation(program, "uModel") });
+    if (p.configure)
+        p.configure(program);
+}
+
+static GLuint loadShaderProgram(GLuint* target, const char* name, const char* vertexFile, const char* fragmentFile,
+    std::vector<std::pair<GLuint, std::string>> attribs = {}, const std::string& defines = std::string(),
+    void (*configure)(GLuint) = nullptr)
+{
+    ShaderProgram p;
+    p.name = name;
+    p.vertexFile = vertexFile;
+    p.fragmentFile = fragmentFile;
+    p.defines = defines;
+    p.attribs = std::move(attribs);
+    p.target = target;
+    p.configure = configure;
+    ShaderSource src;
+    GLuint program = 0;
+    bool cached = false;
+    if (readShaderSource(p, src))
+        program = buildProgram(p, src, cached);
+    p.files = src.files;
+    p.key = src.key;
+    gShaderPrograms.push_back(p);
+    installProgram(gShaderPrograms.back(), program);
+    if (program)
+        ++(cached ? gShaderLoadStats.cached : gShaderLoadStats.linked);
+    return program;
+}
+
+static void releaseShaderProgram(GLuint* target)
+{
+    for (size_t i = 0; i < gShaderPrograms.size(); ++i)
+    {
+        if (gShaderPrograms[i].target != target) continue;
+        installProgram(gShaderPrograms[i], 0);
+        gShaderPrograms.erase(gShaderPrograms.begin() + i);
+        return;
+    }
+}
+
+static void freeShaderPrograms()
+{
+    for (ShaderProgram& p : gShaderPrograms)
+        installProgram(p, 0);
+    gShaderPrograms.clear();
+}
+
+static std::string maxShellsDefine()
+{
+    return "#define MAX_SHELLS " + std::to_string(MAX_SHELLS) + "\n";
+}
+
+static void applyModelUniform()
+{
+    if (!gCoreProfile) return;
+    for (const ProgramUniforms& u : gProgramUniforms)
+    {
+        if (u.program != gGlState.program) continue;
+        if (u.model >= 0)
+            glUniformMatrix4fv(u.model, 1, GL_FALSE, currentModel().m);
+        return;
+    }
+}
+
+static void initAtomShader()
+{
+    if (loadShaderProgram(&gAtomProgram, "atom", "atom.vert", "atom.frag"))
+        std::cout << "Shadery atomu (Phong + rim lighting) zainicjalizowane.\n";
+    else
+        std::cerr << "Nie udało się zbudować shaderów atomu, używam tylko potoku stałego.\n";
+}
+
+static void configureCloudUniforms(GLuint program, CloudUniforms& u)
+{
+    u.shell = glGetUniformLocation(program, "uShell");
+    u.shellScale = glGetUniformLocation(program, "uShellScale");
+    u.alphaScale = glGetUniformLocation(program, "uAlphaScale");
+    u.drawnFraction = glGetUniformLocation(program, "uDrawnFraction");
+    u.densityRange = glGetUniformLocation(program, "uDensityRange");
+    u.pointScale = glGetUniformLocation(program, "uPointScale");
+    GLfloat colors[MAX_SHELLS * 4];
+    for (int s = 0; s < MAX_SHELLS; ++s)
+        shellCloudColor(s, &colors[s * 4]);
+    useProgram(program);
+    glUniform4fv(glGetUniformLocation(program, "uShellColor"), MAX_SHELLS, colors);
+    glUniform1i(glGetUniformLocation(program, "uColormap"), 0);
+    useProgram(0);
+}
+
+static void configureCloudProgram(GLuint program)
+{
+    configureCloudUniforms(program, gCloudUniforms);
+}
+
+static void configureCloudOitProgram(GLuint program)
+{
+    configureCloudUniforms(program, gCloudOitUniforms);
+}
+
+static void configureSortedCloudProgram(GLuint program)
+{
+    configureCloudUniforms(program, gCloudSortedUniforms);
+}
+
+static void configureSplatProgram(GLuint program)
+{
+    configureCloudUniforms(program, gCloudSplatUniforms);
+}
+
+static void configureSplatOitProgram(GLuint program)
+{
+    configureCloudUniforms(program, gCloudSplatOitUniforms);
+}
+
+static void configureOitCompositeProgram(GLuint program)
+{
+    useProgram(program);
+    glUniform1i(glGetUniformLocation(program, "uAccum"), 0);
+    glUniform1i(glGetUniformLocation(program, "uWeight"), 1);
+    useProgram(0);
+}
+
+static bool oitSupported()
+{
+    return gCoreProfile || (GLEW_VERSION_2_0 && GLEW_ARB_framebuffer_object && GLEW_ARB_texture_float);
+}
+
+static void initCloudShader()
+{
+    const std::vector<std::pair<GLuint, std::string>> attribs = { { 0, "aX" }, { 1, "aY" }, { 2, "aZ" } };
+    if (!loadShaderProgram(&gCloudProgram, "cloud", "cloud.vert", "color.frag",
+        attribs, maxShellsDefine(), configureCloudProgram))
+        std::cerr << "Nie udało się zbudować shadera chmury, chmura prawdopodobieństwa będzie niewidoczna.\n";
+    if (oitSupported())
+    {
+        loadShaderProgram(&gCloudOitProgram, "cloud_oit", "cloud.vert", "cloud_oit.frag",
+            attribs, maxShellsDefine(), configureCloudOitProgram);
+        loadShaderProgram(&gOitCompositeProgram, "oit_composite", "oit_composite.vert", "oit_composite.frag",
+            {}, std::string(), configureOitCompositeProgram);
+    }
+    if (!gCloudOitProgram || !gOitCompositeProgram)
+    {
+        std::cout << "Brak FBO z teksturami float - chmura bez przezroczystosci OIT.\n";
+        releaseShaderProgram(&gCloudOitProgram);
+        releaseShaderProgram(&gOitCompositeProgram);
+    }
+    std::vector<std::pair<GLuint, std::string>> sortedAttribs = attribs;
+    sortedAttribs.push_back({ CLOUD_SHELL_ATTRIB, "aShell" });
+    loadShaderProgram(&gCloudSortedProgram, "cloud_sorted", "cloud.vert", "color.frag",
+        sortedAttribs, maxShellsDefine() + "#define CLOUD_SHELL_ATTRIB\n", configureSortedCloudProgram);
+    std::vector<std::pair<GLuint, std::string>> splatAttribs = sortedAttribs;
+    splatAttribs.push_back({ CLOUD_DENSITY_ATTRIB, "aDensity" });
+    if (!loadShaderProgram(&gCloudSplatProgram, "cloud_splat", "cloud_splat.vert", "cloud_splat.frag",
+        splatAttribs, maxShellsDefine(), configureSplatProgram))
+        std::cerr << "Nie udalo sie zbudowac shadera splatow, chmura rysowana punktami.\n";
+    if (gCloudOitProgram)
+        loadShaderProgram(&gCloudSplatOitProgram, "cloud_splat_oit", "cloud_splat.vert", "cloud_splat.frag",
+            splatAttribs, maxShellsDefine() + "#define CLOUD_OIT\n", configureSplatOitProgram);
+}
+
+static void initCloudColormap()
+{
+    std::vector<uint8_t> pixels(CLOUD_COLORMAP_WIDTH * MAX_SHELLS * 4);
+    for (int s = 0; s < MAX_SHELLS; ++s)
+    {
+        GLfloat base[4];
+        shellCloudColor(s, base);
+        for (int i = 0; i < CLOUD_COLORMAP_WIDTH; ++i)
+        {
+            const float t = i / float(CLOUD_COLORMAP_WIDTH - 1);
+            const float shade = 0.35f + 0.65f * std::min(1.f, 2.f * t);
+            const float white = std::max(0.f, 2.f * t - 1.f) * 0.7f;
+            uint8_t* px = &pixels[(s * CLOUD_COLORMAP_WIDTH + i) * 4];
+            for (int c = 0; c < 3; ++c)
+                px[c] = static_cast<uint8_t>(255.f * clampFloat(base[c] * shade * (1.f - white) + white, 0.f, 1.f));
+            px[3] = 255;
+        }
+    }
+    glGenTextures(1, &gCloudColormap);
+    glBindTexture(GL_TEXTURE_2D, gCloudColormap);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, CLOUD_COLORMAP_WIDTH, MAX_SHELLS, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+static Mesh uploadMesh(GLenum primitive, const std::vector<float>& vertices, int floatsPerVertex,
+    const void* indices, size_t indexCount, GLenum indexType)
+{
+    Mesh mesh;
+    mesh.primitive = primitive;
+    mesh.stride = static_cast<GLsizei>(floatsPerVertex * sizeof(float));
+    mesh.vertexCount = static_cast<GLsizei>(vertices.size() / floatsPerVertex);
+    mesh.indexCount = static_cast<GLsizei>(indexCount);
+    mesh.indexType = indexType;
+    if (gCoreProfile)
+        bindVertexArray(0);
+    glGenBuffers(1, &mesh.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    if (indexCount)
+    {
+        const size_t indexSize = indexType == GL_UNSIGNED_INT ? sizeof(GLuint) : sizeof(GLushort);
+        glGenBuffers(1, &mesh.ibo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCount * indexSize, indices, GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+    return mesh;
+}
+
+static Mesh uploadMesh(GLenum primitive, const std::vector<float>& vertices, int floatsPerVertex,
+    const std::vector<GLushort>& indices)
+{
+    return uploadMesh(primitive, vertices, floatsPerVertex, indices.data(), indices.size(), GL_UNSIGNED_SHORT);
+}
+
+static Mesh buildSphereMesh(float radius, int slices, int stacks)
+{
+    std::vector<float> v;
+    std::vector<GLushort> idx;
+    v.reserve((slices + 1) * (stacks + 1) * 6);
+    idx.reserve(slices * stacks * 6);
+    for (int i = 0; i <= stacks; ++i)
+    {
+        float phi = PI * i / stacks;
+        float sinPhi = std::sin(phi);
+        float cosPhi = std::cos(phi);
+        for (int j = 0; j <= slices; ++j)
+        {
+            float theta = 2.f * PI * j / slices;
+            float nx = sinPhi * std::cos(theta);
+            float ny = cosPhi;
+            float nz = sinPhi * std::sin(theta);
+            v.insert(v.end(), { nx * radius, ny * radius, nz * radius, nx, ny, nz });
+        }
+    }
+    for (int i = 0; i < stacks; ++i)
+    {
+        for (int j = 0; j < slices; ++j)
+        {
+            GLushort a = static_cast<GLushort>(i * (slices + 1) + j);
+            GLushort b = static_cast<GLushort>(a + slices + 1);
+            idx.insert(idx.end(), { a, static_cast<GLushort>(a + 1), b,
+                b, static_cast<GLushort>(a + 1), static_cast<GLushort>(b + 1) });
+        }
+    }
+    Mesh mesh = uploadMesh(GL_TRIANGLES, v, 6, idx);
+    mesh.normalOffset = 3 * sizeof(float);
+    return mesh;
+}
+
+static Mesh buildOrbitMesh(float radius, int segments)
+{
+    std::vector<float> v;
+    v.reserve(segments * 3);
+    for (int i = 0; i < segments; ++i)
+    {
+        float angle = 2.f * PI * i / segments;
+        v.insert(v.end(), { radius * std::cos(angle), 0.f, radius * std::sin(angle) });
+    }
+    return uploadMesh(GL_LINE_LOOP, v, 3, {});
+}
+
+static Mesh buildAxesMesh(float len)
+{
+    const std::vector<float> v =
+    {
+        0.f, 0.f, 0.f, 1.f, 0.f, 0.f,   len, 0.f, 0.f, 1.f, 0.f, 0.f,
+        0.f, 0.f, 0.f, 0.f, 1.f, 0.f,   0.f, len, 0.f, 0.f, 1.f, 0.f,
+        0.f, 0.f, 0.f, 0.f, 0.f, 1.f,   0.f, 0.f, len, 0.f, 0.f, 1.f,
+    };
+    Mesh mesh = uploadMesh(GL_LINES, v, 6, {});
+    mesh.colorOffset = 3 * sizeof(float);
+    return mesh;
+}
+
+static Mesh buildBackgroundQuadMesh()
+{
+    const std::vector<float> v =
+    {
+        -1.f, -1.f, 0.f, 0.f, 1.f,
+         1.f, -1.f, 0.f, 1.f, 1.f,
+         1.f,  1.f, 0.f, 1.f, 0.f,
+        -1.f,  1.f, 0.f, 0.f, 0.f,
+    };
+    Mesh mesh = uploadMesh(GL_TRIANGLE_FAN, v, 5, {});
+    mesh.texCoordOffset = 3 * sizeof(float);
+    return mesh;
+}
+
+static void buildMeshVao(Mesh& mesh)
+{
+    glGenVertexArrays(1, &mesh.vao);
+    bindVertexArray(mesh.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    const std::pair<GLuint, int> attribs[] =
+    {
+        { CORE_POSITION_ATTRIB, 0 },
+        { CORE_NORMAL_ATTRIB, mesh.normalOffset },
+        { CORE_COLOR_ATTRIB, mesh.colorOffset },
+        { CORE_TEXCOORD_ATTRIB, mesh.texCoordOffset },
+    };
+    for (const auto& attrib : attribs)
+    {
+        if (attrib.second < 0) continue;
+        glEnableVertexAttribArray(attrib.first);
+        glVertexAttribPointer(attrib.first, attrib.first == CORE_TEXCOORD_ATTRIB ? 2 : 3, GL_FLOAT, GL_FALSE,
+            mesh.stride, reinterpret_cast<const void*>(static_cast<size_t>(attrib.second)));
+    }
+    if (mesh.ibo)
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo);
+    bindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+static const Mesh& getMesh(MeshKind kind, float radius = 0.f, int slices = 0, int stacks = 0)
+{
+    const MeshKey key{ kind, radius, slices, stacks };
+    auto it = gMeshCache.find(key);
+    if (it != gMeshCache.end())
+        return it->second;
+    Mesh mesh;
+    switch (kind)
+    {
+    case MeshKind::Sphere:         mesh = buildSphereMesh(radius, slices, stacks); break;
+    case MeshKind::OrbitCircle:    mesh = buildOrbitMesh(radius, slices); break;
+    case MeshKind::Axes:           mesh = buildAxesMesh(radius); break;
+    case MeshKind::BackgroundQuad: mesh = buildBackgroundQuadMesh(); break;
+    }
+    if (gCoreProfile)
+        buildMeshVao(mesh);
+    return gMeshCache.emplace(key, mesh).first->second;
+}
+
+static void bindMesh(const Mesh& mesh)
+{
+    if (gCoreProfile)
+        bindVertexArray(mesh.vao);
+}
+
+static void drawMeshCore(const Mesh& mesh, GLsizei instances)
+{
+    applyModelUniform();
+    bindVertexArray(mesh.vao);
+    if (mesh.ibo && instances > 0)
+        glDrawElementsInstanced(mesh.primitive, mesh.indexCount, mesh.indexType, nullptr, instances);
+    else if (mesh.ibo)
+        glDrawElements(mesh.primitive, mesh.indexCount, mesh.indexType, nullptr);
+    else if (instances > 0)
+        glDrawArraysInstanced(mesh.primitive, 0, mesh.vertexCount, instances);
+    else
+        glDrawArrays(mesh.primitive, 0, mesh.vertexCount);
+    if (mesh.colorOffset >= 0)
+        gGlState.colorKnown = false;
+}
+
+static void drawMesh(const Mesh& mesh, GLsizei instances = 0)
+{
+    if (gCoreProfile)
+    {
+        drawMeshCore(mesh, instances);
+        return;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_FLOAT, mesh.stride, nullptr);
+    if (mesh.normalOffset >= 0)
+    {
+        glEnableClientState(GL_NORMAL_ARRAY);
+        glNormalPointer(GL_FLOAT, mesh.stride, reinterpret_cast<const void*>(static_cast<size_t>(mesh.normalOffset)));
+    }
+    if (mesh.colorOffset >= 0)
+    {
+        glEnableClientState(GL_COLOR_ARRAY);
+        glColorPointer(3, GL_FLOAT, mesh.stride, reinterpret_cast<const void*>(static_cast<size_t>(mesh.colorOffset)));
+    }
+    if (mesh.texCoordOffset >= 0)
+    {
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glTexCoordPointer(2, GL_FLOAT, mesh.stride, reinterpret_cast<const void*>(static_cast<size_t>(mesh.texCoordOffset)));
+    }
+    if (mesh.ibo)
+    {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo);
+        if (instances > 0)
+            glDrawElementsInstancedARB(mesh.primitive, mesh.indexCount, mesh.indexType, nullptr, instances);
+        else
+            glDrawElements(mesh.primitive, mesh.indexCount, mesh.indexType, nullptr);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+    else if (instances > 0)
+    {
+        glDrawArraysInstancedARB(mesh.primitive, 0, mesh.vertexCount, instances);
+    }
+    else
+    {
+        glDrawArrays(mesh.primitive, 0, mesh.vertexCount);
+    }
+    if (mesh.texCoordOffset >= 0) glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    if (mesh.colorOffset >= 0)
+    {
+        glDisableClientState(GL_COLOR_ARRAY);
+        gGlState.colorKnown = false;
+    }
+    if (mesh.normalOffset >= 0) glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+static void freeMesh(Mesh& mesh)
+{
+    if (mesh.vbo) glDeleteBuffers(1, &mesh.vbo);
+    if (mesh.ibo) glDeleteBuffers(1, &mesh.ibo);
+    if (mesh.vao && gGlState.vertexArray == mesh.vao)
+        gGlState.vertexArrayKnown = false;
+    if (mesh.vao) glDeleteVertexArrays(1, &mesh.vao);
+    mesh = Mesh();
+}
+
+static void freeMeshCache()
+{
+    for (auto& entry : gMeshCache)
+        freeMesh(entry.second);
+    gMeshCache.clear();
+}
+
+static void enableInstanceAttrib(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, size_t offset)
+{
+    glEnableVertexAttribArray(index);
+    glVertexAttribPointer(index, size, type, normalized, stride, reinterpret_cast<const void*>(offset));
+    vertexAttribDivisor(index, 1);
+}
+
+static void disableInstanceAttrib(GLuint index)
+{
+    vertexAttribDivisor(index, 0);
+    glDisableVertexAttribArray(index);
+}
+
+static void drawScreenTexture(GLuint texture)
+{
+    if (gCoreProfile)
+    {
+        GLuint prevProgram = currentProgram();
+        useProgram(gBackgroundProgram);
+        setDepthMask(false);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        drawMesh(getMesh(MeshKind::BackgroundQuad));
+        glBindTexture(GL_TEXTURE_2D, 0);
+        setDepthMask(true);
+        useProgram(prevProgram);
+        return;
+    }
+    bool lighting = lightingEnabled();
+    GLuint prevProgram = currentProgram();
+    setLighting(false);
+    useProgram(0);
+    const GLint* viewport = currentViewport();
+    float w = static_cast<float>(viewport[2]);
+    float h = static_cast<float>(viewport[3]);
+    if (h == 0.f) h = 1.f;
+    float aspect = w / h;
+    const float depth = 10.f;
+    float halfHeight = depth * std::tan(deg2rad(G.fovDeg * 0.5f));
+    float halfWidth = halfHeight * aspect;
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    {
+        glLoadIdentity();
+        glTranslatef(0.f, 0.f, -depth);
+        glScalef(halfWidth, halfHeight, 1.f);
+        glEnable(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        setColor(1.f, 1.f, 1.f);
+        drawMesh(getMesh(MeshKind::BackgroundQuad));
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glDisable(GL_TEXTURE_2D);
+    }
+    glPopMatrix();
+    setLighting(lighting);
+    useProgram(prevProgram);
+}
+
+static void drawBackgroundQuad()
+{
+    if (gBackgroundTex)
+        drawScreenTexture(gBackgroundTex);
+}
+
+static Frustum extractFrustum(const Mat4& clip)
+{
+    Frustum fr;
+    for (int i = 0; i < 6; ++i)
+    {
+        const int row = i / 2;
+        const float sign = (i % 2) ? -1.f : 1.f;
+        float len = 0.f;
+        for (int k = 0; k < 4; ++k)
+        {
+            fr.plane[i][k] = clip.m[k * 4 + 3] + sign * clip.m[k * 4 + row];
+            if (k < 3) len += fr.plane[i][k] * fr.plane[i][k];
+        }
+        len = std::sqrt(len);
+        for (int k = 0; k < 4; ++k)
+            fr.plane[i][k] /= len;
+    }
+    return fr;
+}
+
+static int classifyBox(const Frustum& fr, const float lo[3], const float hi[3])
+{
+    int result = FRUSTUM_INSIDE;
+    for (const auto& p : fr.plane)
+    {
+        float nearest = p[3], farthest = p[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            nearest += p[a] * (p[a] >= 0.f ? lo[a] : hi[a]);
+            farthest += p[a] * (p[a] >= 0.f ? hi[a] : lo[a]);
+        }
+        if (farthest < 0.f) return FRUSTUM_OUTSIDE;
+        if (nearest < 0.f) result = FRUSTUM_INTERSECT;
+    }
+    return result;
+}
+
+static float pixelsPerUnitAtDepth(const Mat4& modelView, float depth)
+{
+    const float scale = std::sqrt(modelView.m[0] * modelView.m[0] + modelView.m[1] * modelView.m[1] + modelView.m[2] * modelView.m[2]);
+    return scale * gProjectionMatrix.m[5] * 0.5f * gViewportHeight / std::max(depth, G.nearP);
+}
+
+static float nearestBoxDepth(const Mat4& modelView, const float lo[3], const float hi[3])
+{
+    float center[3], half2 = 0.f;
+    for (int a = 0; a < 3; ++a)
+    {
+        center[a] = 0.5f * (lo[a] + hi[a]);
+        half2 += 0.25f * (hi[a] - lo[a]) * (hi[a] - lo[a]);
+    }
+    const float* m = modelView.m;
+    const float scale = std::sqrt(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+    const float zEye = m[2] * center[0] + m[6] * center[1] + m[10] * center[2] + m[14];
+    return -zEye - std::sqrt(half2) * scale;
+}
+
+static int sphereLodForPixels(float radiusPx)
+{
+    for (int lod = SPHERE_LOD_COUNT - 1; lod > 0; --lod)
+    {
+        float sagitta = radiusPx * (1.f - std::cos(PI / SPHERE_LOD_SLICES[lod]));
+        if (sagitta <= SPHERE_MAX_ERROR_PX) return lod;
+    }
+    return 0;
+}
+
+static const Mesh& sphereLodMesh(float radius, int lod)
+{
+    return getMesh(MeshKind::Sphere, radius, SPHERE_LOD_SLICES[lod], SPHERE_LOD_SLICES[lod] / 2);
+}
+
+static int sphereLodAt(const Mat4& modelView, float radius)
+{
+    const float depth = -modelView.m[14];
+    return sphereLodForPixels(radius * pixelsPerUnitAtDepth(modelView, depth));
+}
+
+static void setupProjection(sf::Vector2u s)
+{
+    if (!s.y) s.y = 1;
+    const double aspect = s.x / static_cast<double>(s.y);
+    setViewport(0, 0, (GLsizei)s.x, (GLsizei)s.y);
+    gProjectionMatrix = mat4Perspective(G.fovDeg, static_cast<float>(aspect), G.nearP, G.farP);
+    gViewportHeight = static_cast<float>(s.y);
+    if (gCoreProfile) return;
+    glMatrixMode(GL_PROJECTION);
+    glLoadMatrixf(gProjectionMatrix.m);
+    glMatrixMode(GL_MODELVIEW);
+}
+
+static void setupView()
+{
+    gViewMatrix = mat4LookAt(G.eye, G.center, G.up);
+    resetModel();
+    if (gCoreProfile)
+    {
+        FrameUniforms frame;
+        std::copy(std::begin(gProjectionMatrix.m), std::end(gProjectionMatrix.m), frame.projection);
+        std::copy(std::begin(gViewMatrix.m), std::end(gViewMatrix.m), frame.view);
+        const float light[4] = { 2.0f, 3.0f, 4.0f, 1.0f };
+        std::copy(std::begin(light), std::end(light), frame.lightPosition);
+        glBindBuffer(GL_UNIFORM_BUFFER, gFrameUbo);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(frame), &frame);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        return;
+    }
+    glMatrixMode(GL_MODELVIEW);
+    glLoadMatrixf(gViewMatrix.m);
+}
+
+static void useFlatProgram()
+{
+    useProgram(gCoreProfile ? gFlatProgram : 0);
+}
+
+static void drawAxes(float len = 0.4f)
+{
+    bool lighting = lightingEnabled();
+    GLuint prevProgram = currentProgram();
+    useFlatProgram();
+    setLighting(false);
+    setLineWidth(2.0f);
+    drawMesh(getMesh(MeshKind::Axes, len));
+    setLighting(lighting);
+    useProgram(prevProgram);
+}
+
+static uint64_t splitMix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+static uint64_t counterRandom(uint64_t key, uint64_t counter)
+{
+    return splitMix64(key ^ splitMix64(counter));
+}
+
+static float bitsToUnit(uint32_t bits)
+{
+    return (bits >> 8) * (1.0f / 16777216.0f);
+}
+
+static void runParallelChunks(ParallelJob& job)
+{
+    for (size_t c = job.next.fetch_add(1, std::memory_order_relaxed); c < job.chunks;
+        c = job.next.fetch_add(1, std::memory_order_relaxed))
+        job.run(job.context, c * job.chunk, std::min(job.count, (c + 1) * job.chunk));
+}
+
+static void dropParallelJob(WorkerPool& p, ParallelJob* job)
+{
+    auto it = std::find(p.jobs.begin(), p.jobs.end(), job);
+    if (it != p.jobs.end())
+        p.jobs.erase(it);
+}
+
+static void parallelWorkerLoop()
+{
+    WorkerPool& p = gWorkerPool;
+    for (;;)
+    {
+        ParallelJob* job = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(p.mutex);
+            p.wake.wait(lock, [&p]() { return p.quit || !p.jobs.empty(); });
+            if (p.quit) return;
+            job = p.jobs.front();
+            ++job->helpers;
+        }
+        runParallelChunks(*job);
+        {
+            std::lock_guard<std::mutex> lock(p.mutex);
+            dropParallelJob(p, job);
+            --job->helpers;
+        }
+        p.done.notify_all();
+    }
+}
+
+static void runParallelJob(ParallelJob& job)
+{
+    WorkerPool& p = gWorkerPool;
+    {
+        std::lock_guard<std::mutex> lock(p.mutex);
+        p.jobs.push_back(&job);
+    }
+    p.wake.notify_all();
+    runParallelChunks(job);
+    std::unique_lock<std::mutex> lock(p.mutex);
+    dropParallelJob(p, &job);
+    p.done.wait(lock, [&job]() { return job.helpers == 0; });
+}
+
+static void startWorkerPool()
+{
+    WorkerPool& p = gWorkerPool;
+    const unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    p.quit = false;
+    for (unsigned t = 1; t < threads; ++t)
+        p.threads.emplace_back(parallelWorkerLoop);
+}
+
+static void stopWorkerPool()
+{
+    WorkerPool& p = gWorkerPool;
+    {
+        std::lock_guard<std::mutex> lock(p.mutex);
+        p.quit = true;
+    }
+    p.wake.notify_all();
+    for (std::thread& th : p.threads)
+        th.join();
+    p.threads.clear();
+}
+
+template <typename Fn>
+static void parallelFor(size_t count, Fn fn, size_t grain = 4096)
+{
+    unsigned threads = static_cast<unsigned>(gWorkerPool.threads.size()) + 1;
+    threads = static_cast<unsigned>(std::min<size_t>(threads, (count + grain - 1) / grain));
+    if (threads <= 1)
+    {
+        fn(size_t(0), count);
+        return;
+    }
+    ParallelJob job;
+    job.run = [](void* context, size_t begin, size_t end) { (*static_cast<Fn*>(context))(begin, end); };
+    job.context = &fn;
+    job.count = count;
+    job.chunk = (count + threads - 1) / threads;
+    job.chunks = (count + job.chunk - 1) / job.chunk;
+    runParallelJob(job);
+}
+
+static std::vector<SubshellOccupancy> electronConfiguration(int Z)
+{
+    std::vector<SubshellOccupancy> config;
+    const ElectronConfig& table = ELECTRON_CONFIGS.element[Z];
+    for (int i = 0; i < SUBSHELL_COUNT; ++i)
+    {
+        if (table.subshell[i] > 0)
+            config.push_back({ MADELUNG_ORDER[i].n, MADELUNG_ORDER[i].l, table.subshell[i] });
+    }
+    return config;
+}
+
+static float slaterEffectiveCharge(int Z, const std::vector<SubshellOccupancy>& config, int n, int l)
+{
+    float shielding = 0.f;
+    for (const SubshellOccupancy& o : config)
+    {
+        int others = (o.n == n && o.l == l) ? o.electrons - 1 : o.electrons;
+        if (others <= 0) continue;
+        float factor = 0.f;
+        if (l <= 1)
+        {
+            if (o.n == n && o.l <= 1) factor = (n == 1) ? 0.30f : 0.35f;
+            else if (o.n == n - 1) factor = 0.85f;
+            else if (o.n < n - 1) factor = 1.0f;
+        }
+        else
+        {
+            if (o.n == n && o.l == l) factor = 0.35f;
+            else if (o.n < n || (o.n == n && o.l < l)) factor = 1.0f;
+        }
+        shielding += factor * others;
+    }
+    return std::max(1.0f, Z - shielding);
+}
+
+static double radialProbability(int n, int l, double zEff, double r)
+{
+    const double rho = 2.0 * zEff * r / n;
+    const int k = n - l - 1;
+    const double alpha = 2.0 * l + 1.0;
+    double lPrev = 1.0;
+    double lCur = 1.0 + alpha - rho;
+    double laguerre = (k == 0) ? lPrev : lCur;
+    for (int i = 1; i < k; ++i)
+    {
+        double lNext = ((2.0 * i + 1.0 + alpha - rho) * lCur - (i + alpha) * lPrev) / (i + 1.0);
+        lPrev = lCur;
+        lCur = lNext;
+        laguerre = lCur;
+    }
+    const double radial = std::pow(rho, l) * std::exp(-0.5 * rho) * laguerre;
+    return r * r * radial * radial;
+}
+
+static float meanOrbitalRadius(int n, int l, float zEff)
+{
+    return (3.f * n * n - l * (l + 1)) / (2.f * zEff);
+}
+
+static void buildRadialInverseCdf(int n, int l, float zEff, float* table, int size)
+{
+    const int bins = 4 * size;
+    const double rMax = (4.0 * n * n + 10.0) / zEff;
+    std::vector<double> cdf(bins + 1, 0.0);
+    for (int i = 0; i < bins; ++i)
+    {
+        double r = rMax * (i + 0.5) / bins;
+        cdf[i + 1] = cdf[i] + radialProbability(n, l, zEff, r);
+    }
+    const double total = cdf[bins] > 0.0 ? cdf[bins] : 1.0;
+    int bin = 0;
+    for (int j = 0; j < size; ++j)
+    {
+        double target = total * j / (size - 1);
+        while (bin < bins - 1 && cdf[bin + 1] < target) ++bin;
+        double span = cdf[bin + 1] - cdf[bin];
+        double frac = span > 0.0 ? (target - cdf[bin]) / span : 0.0;
+        table[j] = static_cast<float>(rMax * (bin + clampFloat(static_cast<float>(frac), 0.f, 1.f)) / bins);
+    }
+}
+
+template <typename Fn>
+static void evalAngularBatch(Fn amplitude, const float* x, const float* y, const float* z, float* out, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        float a = amplitude(x[i], y[i], z[i]);
+        out[i] = a * a;
+    }
+}
+
+static void evalAngularDensityBatch(int l, int m, const float* x, const float* y, const float* z, float* out, int count)
+{
+    switch (l * 10 + m)
+    {
+    case 0:  evalAngularBatch([](float, float, float) { return 1.f; }, x, y, z, out, count); break;
+    case 9:  evalAngularBatch([](float, float y, float) { return y; }, x, y, z, out, count); break;
+    case 10: evalAngularBatch([](float, float, float z) { return z; }, x, y, z, out, count); break;
+    case 11: evalAngularBatch([](float x, float, float) { return x; }, x, y, z, out, count); break;
+    case 18: evalAngularBatch([](float x, float y, float) { return x * y; }, x, y, z, out, count); break;
+    case 19: evalAngularBatch([](float, float y, float z) { return y * z; }, x, y, z, out, count); break;
+    case 20: evalAngularBatch([](float, float, float z) { return 3.f * z * z - 1.f; }, x, y, z, out, count); break;
+    case 21: evalAngularBatch([](float x, float, float z) { return x * z; }, x, y, z, out, count); break;
+    case 22: evalAngularBatch([](float x, float y, float) { return x * x - y * y; }, x, y, z, out, count); break;
+    case 27: evalAngularBatch([](float x, float y, float) { return y * (3.f * x * x - y * y); }, x, y, z, out, count); break;
+    case 28: evalAngularBatch([](float x, float y, float z) { return x * y * z; }, x, y, z, out, count); break;
+    case 29: evalAngularBatch([](float, float y, float z) { return y * (5.f * z * z - 1.f); }, x, y, z, out, count); break;
+    case 30: evalAngularBatch([](float, float, float z) { return z * (5.f * z * z - 3.f); }, x, y, z, out, count); break;
+    case 31: evalAngularBatch([](float x, float, float z) { return x * (5.f * z * z - 1.f); }, x, y, z, out, count); break;
+    case 32: evalAngularBatch([](float x, float y, float z) { return z * (x * x - y * y); }, x, y, z, out, count); break;
+    case 33: evalAngularBatch([](float x, float y, float) { return x * (x * x - 3.f * y * y); }, x, y, z, out, count); break;
+    default: evalAngularBatch([](float, float, float) { return 1.f; }, x, y, z, out, count); break;
+    }
+}
+
+static std::vector<float> sampleAngularDensity(int l, int m)
+{
+    const int thetaSteps = 128, phiSteps = 256;
+    std::vector<float> x, y, z, d;
+    x.reserve(thetaSteps * phiSteps);
+    y.reserve(thetaSteps * phiSteps);
+    z.reserve(thetaSteps * phiSteps);
+    for (int i = 0; i <= thetaSteps; ++i)
+    {
+        float cosT = -1.f + 2.f * i / thetaSteps;
+        float sinT = std::sqrt(std::max(0.f, 1.f - cosT * cosT));
+        for (int j = 0; j < phiSteps; ++j)
+        {
+            float phi = 2.f * PI * j / phiSteps;
+            x.push_back(sinT * std::cos(phi));
+            y.push_back(sinT * std::sin(phi));
+            z.push_back(cosT);
+        }
+    }
+    d.resize(x.size());
+    evalAngularDensityBatch(l, m, x.data(), y.data(), z.data(), d.data(), static_cast<int>(d.size()));
+    return d;
+}
+
+static float angularDensityMax(int l, int m)
+{
+    const std::vector<float> d = sampleAngularDensity(l, m);
+    return 1.001f * *std::max_element(d.begin(), d.end());
+}
+
+static float angularDensityMean(int l, int m)
+{
+    const std::vector<float> d = sampleAngularDensity(l, m);
+    double sum = 0.0;
+    for (float v : d)
+        sum += v;
+    return static_cast<float>(sum / d.size());
+}
+
+static size_t paddedCloudCapacity(size_t count)
+{
+    return (count + 15) & ~static_cast<size_t>(15);
+}
+
+static void quantizeAxis(const float* src, int16_t* dst, size_t count, float scale)
+{
+    size_t i = 0;
+#if defined(G3D_AVX2)
+    const __m256 s8 = _mm256_set1_ps(scale);
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i a = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + i), s8));
+        __m256i b = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + i + 8), s8));
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), packed);
+    }
+#elif defined(G3D_SSE2)
+    const __m128 s4 = _mm_set1_ps(scale);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i), s4));
+        __m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i + 4), s4));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packs_epi32(a, b));
+    }
+#endif
+    for (; i < count; ++i)
+        dst[i] = static_cast<int16_t>(clampFloat(std::nearbyint(src[i] * scale), -32768.f, 32767.f));
+}
+
+static void axisBounds(const int16_t* src, size_t count, int16_t& outMin, int16_t& outMax)
+{
+    int16_t mn = 32767, mx = -32768;
+    size_t i = 0;
+#if defined(G3D_AVX2)
+    if (count >= 16)
+    {
+        __m256i vmin = _mm256_set1_epi16(32767), vmax = _mm256_set1_epi16(-32768);
+        for (; i + 16 <= count; i += 16)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+            vmin = _mm256_min_epi16(vmin, v);
+            vmax = _mm256_max_epi16(vmax, v);
+        }
+        alignas(32) int16_t lanesMin[16], lanesMax[16];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanesMin), vmin);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanesMax), vmax);
+        for (int k = 0; k < 16; ++k)
+        {
+            mn = std::min(mn, lanesMin[k]);
+            mx = std::max(mx, lanesMax[k]);
+        }
+    }
+#elif defined(G3D_SSE2)
+    if (count >= 8)
+    {
+        __m128i vmin = _mm_set1_epi16(32767), vmax = _mm_set1_epi16(-32768);
+        for (; i + 8 <= count; i += 8)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            vmin = _mm_min_epi16(vmin, v);
+            vmax = _mm_max_epi16(vmax, v);
+        }
+        alignas(16) int16_t lanesMin[8], lanesMax[8];
+        _mm_store_si128(reinterpret_cast<__m128i*>(lanesMin), vmin);
+        _mm_store_si128(reinterpret_cast<__m128i*>(lanesMax), vmax);
+        for (int k = 0; k < 8; ++k)
+        {
+            mn = std::min(mn, lanesMin[k]);
+            mx = std::max(mx, lanesMax[k]);
+        }
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        mn = std::min(mn, src[i]);
+        mx = std::max(mx, src[i]);
+    }
+    outMin = mn;
+    outMax = mx;
+}
+
+static uint64_t axisSumSquares(const int16_t* src, size_t count)
+{
+    uint64_t sum = 0;
+    size_t i = 0;
+#if defined(G3D_AVX2)
+    __m256i acc = _mm256_setzero_si256();
+    const __m256i zero = _mm256_setzero_si256();
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i sq = _mm256_madd_epi16(v, v);
+        acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(sq, zero));
+        acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(sq, zero));
+    }
+    alignas(32) uint64_t lanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(G3D_SSE2)
+    __m128i acc = _mm_setzero_si128();
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i sq = _mm_madd_epi16(v, v);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+    }
+    alignas(16) uint64_t lanes[2];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    sum = lanes[0] + lanes[1];
+#endif
+    for (; i < count; ++i)
+        sum += static_cast<uint64_t>(static_cast<int32_t>(src[i]) * src[i]);
+    return sum;
+}
+
+static CloudStore acquireCloudStore(size_t count)
+{
+    const size_t capacity = paddedCloudCapacity(count);
+    CloudStore store;
+    {
+        std::lock_guard<std::mutex> lock(gCloudWorker.mutex);
+        if (gCloudWorker.spare.capacity >= capacity)
+        {
+            store = std::move(gCloudWorker.spare);
+            gCloudWorker.spare = CloudStore();
+        }
+    }
+    if (store.capacity < capacity)
+    {
+        store.arena.reset(new int16_t[3 * capacity]);
+        store.capacity = capacity;
+    }
+    store.count = count;
+    std::fill(store.arena.get() + count, store.arena.get() + capacity, int16_t(0));
+    std::fill(store.axis(1) + count, store.axis(1) + capacity, int16_t(0));
+    std::fill(store.axis(2) + count, store.axis(2) + capacity, int16_t(0));
+    return store;
+}
+
+static void releaseCloudStore(CloudStore&& store)
+{
+    std::lock_guard<std::mutex> lock(gCloudWorker.mutex);
+    if (store.capacity > gCloudWorker.spare.capacity)
+        gCloudWorker.spare = std::move(store);
+}
+
+static void sampleOrbital(const OrbitalJob& job, const float* radialTable, int tableSize,
+    size_t begin, size_t end, CloudStore& out, const std::atomic<bool>& cancelled)
+{
+    constexpr int BATCH = 256;
+    float rx[BATCH], ry[BATCH], rz[BATCH], radius[BATCH], density[BATCH], accept[BATCH];
+    float px[BATCH], py[BATCH], pz[BATCH];
+    const float quant = 32767.f / job.quantScale;
+    uint32_t lane[BATCH], attempt[BATCH];
+    for (size_t base = begin; base < end; base += BATCH)
+    {
+        if (cancelled.load(std::memory_order_relaxed))
+            return;
+        int pending = static_cast<int>(std::min<size_t>(BATCH, end - base));
+        for (int i = 0; i < pending; ++i)
+        {
+            lane[i] = static_cast<uint32_t>(i);
+            attempt[i] = 0;
+            uint64_t bits = counterRandom(job.key, (base + i) << 8);
+            float u = bitsToUnit(static_cast<uint32_t>(bits)) * (tableSize - 1);
+            int idx = std::min(static_cast<int>(u), tableSize - 2);
+            float t = u - idx;
+            radius[i] = (radialTable[idx] + t * (radialTable[idx + 1] - radialTable[idx])) * job.sceneScale;
+        }
+        while (pending > 0)
+        {
+            for (int i = 0; i < pending; ++i)
+            {
+                uint64_t counter = ((base + lane[i]) << 8) | ((attempt[i] + 1) & 0xFF);
+                uint64_t bits = counterRandom(job.key, counter);
+                float cosT = 2.f * bitsToUnit(static_cast<uint32_t>(bits)) - 1.f;
+                float phi = 2.f * PI * bitsToUnit(static_cast<uint32_t>(bits >> 32));
+                float sinT = std::sqrt(std::max(0.f, 1.f - cosT * cosT));
+                rx[i] = sinT * std::cos(phi);
+                ry[i] = sinT * std::sin(phi);
+                rz[i] = cosT;
+                accept[i] = bitsToUnit(static_cast<uint32_t>(counterRandom(job.key ^ 0xA5A5A5A5ull, counter)));
+            }
+            evalAngularDensityBatch(job.l, job.m, rx, ry, rz, density, pending);
+            int kept = 0;
+            for (int i = 0; i < pending; ++i)
+            {
+                if (accept[i] * job.angularMax <= density[i] || attempt[i] >= 254)
+                {
+                    px[lane[i]] = rx[i] * radius[lane[i]];
+                    py[lane[i]] = ry[i] * radius[lane[i]];
+                    pz[lane[i]] = rz[i] * radius[lane[i]];
+                }
+                else
+                {
+                    lane[kept] = lane[i];
+                    attempt[kept] = attempt[i] + 1;
+                    ++kept;
+                }
+            }
+            pending = kept;
+        }
+        const size_t n = std::min<size_t>(BATCH, end - base);
+        const size_t dst = job.offset + base;
+        quantizeAxis(px, out.axis(0) + dst, n, quant);
+        quantizeAxis(py, out.axis(1) + dst, n, quant);
+        quantizeAxis(pz, out.axis(2) + dst, n, quant);
+    }
+}
+
+static CloudPlan planOrbitalCloud(int Z, size_t totalSamples, uint64_t seed)
+{
+    static const int HUND_ORDER[] = { 0, 1, -1, 2, -2, 3, -3 };
+    CloudPlan plan;
+    plan.Z = Z;
+    plan.total = totalSamples;
+    plan.tableSize = 1024;
+    const std::vector<SubshellOccupancy> config = electronConfiguration(Z);
+    std::vector<float> zEff(config.size());
+    plan.tables.resize(config.size() * plan.tableSize);
+    int outerN = 1;
+    float outerRadius = 1.f;
+    for (size_t i = 0; i < config.size(); ++i)
+    {
+        zEff[i] = slaterEffectiveCharge(Z, config, config[i].n, config[i].l);
+        float mean = meanOrbitalRadius(config[i].n, config[i].l, zEff[i]);
+        if (config[i].n > outerN || (config[i].n == outerN && mean > outerRadius))
+        {
+            outerN = config[i].n;
+            outerRadius = mean;
+        }
+        buildRadialInverseCdf(config[i].n, config[i].l, zEff[i], &plan.tables[i * plan.tableSize], plan.tableSize);
+    }
+    const float sceneScale = shellRadius(outerN - 1) / outerRadius;
+    for (size_t i = 0; i < config.size(); ++i)
+    {
+        const float extent = plan.tables[(i + 1) * plan.tableSize - 1] * sceneScale;
+        plan.shellScale[config[i].n - 1] = std::max(plan.shellScale[config[i].n - 1], extent);
+    }
+
+    for (size_t i = 0; i < config.size(); ++i)
+    {
+        const SubshellOccupancy& o = config[i];
+        const int orbitals = 2 * o.l + 1;
+        for (int k = 0; k < orbitals; ++k)
+        {
+            int occupancy = (o.electrons > k ? 1 : 0) + (o.electrons > k + orbitals ? 1 : 0);
+            if (!occupancy) continue;
+            OrbitalJob job;
+            job.n = o.n;
+            job.l = o.l;
+            job.m = HUND_ORDER[k];
+            job.occupancy = occupancy;
+            job.key = splitMix64(seed * 1000003ull + o.n * 64 + o.l * 8 + (job.m + 3));
+            job.angularMax = angularDensityMax(job.l, job.m);
+            job.zEff = zEff[i];
+            job.sceneScale = sceneScale;
+            job.quantScale = plan.shellScale[o.n - 1];
+            job.tableIndex = static_cast<int>(i);
+            plan.orbitals.push_back(job);
+        }
+    }
+    std::stable_sort(plan.orbitals.begin(), plan.orbitals.end(),
+        [](const OrbitalJob& a, const OrbitalJob& b) { return a.n < b.n; });
+
+    size_t offset = 0;
+    int electronsLeft = Z;
+    for (OrbitalJob& job : plan.orbitals)
+    {
+        job.offset = offset;
+        job.count = (electronsLeft == job.occupancy) ? totalSamples - offset
+            : static_cast<size_t>(static_cast<double>(totalSamples) * job.occupancy / Z);
+        electronsLeft -= job.occupancy;
+        offset += job.count;
+    }
+    plan.chunkCount = static_cast<int>(std::min<size_t>(32,
+        std::max<size_t>(1, totalSamples / 65536)));
+    return plan;
+}
+
+static size_t chunkBoundary(const OrbitalJob& job, int chunk, int chunkCount)
+{
+    return static_cast<size_t>(static_cast<double>(job.count) * chunk / chunkCount);
+}
+
+static void sampleCloudChunk(const CloudPlan& plan, int chunk, CloudStore& out, const std::atomic<bool>& cancelled)
+{
+    std::vector<size_t> sliceStart(plan.orbitals.size() + 1, 0);
+    for (size_t j = 0; j < plan.orbitals.size(); ++j)
+    {
+        const OrbitalJob& job = plan.orbitals[j];
+        sliceStart[j + 1] = sliceStart[j] + chunkBoundary(job, chunk + 1, plan.chunkCount)
+            - chunkBoundary(job, chunk, plan.chunkCount);
+    }
+    parallelFor(sliceStart.back(), [&](size_t begin, size_t end)
+    {
+        for (size_t j = 0; j < plan.orbitals.size(); ++j)
+        {
+            size_t b = std::max(begin, sliceStart[j]);
+            size_t e = std::min(end, sliceStart[j + 1]);
+            if (b >= e) continue;
+            const OrbitalJob& job = plan.orbitals[j];
+            size_t local = chunkBoundary(job, chunk, plan.chunkCount) + (b - sliceStart[j]);
+            sampleOrbital(job, &plan.tables[job.tableIndex * plan.tableSize], plan.tableSize,
+                local, local + (e - b), out, cancelled);
+        }
+    });
+}
+
+static bool openMappedFile(const std::string& path, MappedFile& file)
+{
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(handle);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping)
+    {
+        CloseHandle(handle);
+        return false;
+    }
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view)
+    {
+        CloseHandle(mapping);
+        CloseHandle(handle);
+        return false;
+    }
+    file.data = static_cast<const uint8_t*>(view);
+    file.size = static_cast<size_t>(size.QuadPart);
+    file.fileHandle = handle;
+    file.mappingHandle = mapping;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    void* view = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (view == MAP_FAILED) return false;
+    madvise(view, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+    file.data = static_cast<const uint8_t*>(view);
+    file.size = static_cast<size_t>(st.st_size);
+#endif
+    return true;
+}
+
+static void closeMappedFile(MappedFile& file)
+{
+    if (!file.data) return;
+#ifdef _WIN32
+    UnmapViewOfFile(file.data);
+    CloseHandle(file.mappingHandle);
+    CloseHandle(file.fileHandle);
+#else
+    munmap(const_cast<uint8_t*>(file.data), file.size);
+#endif
+    file = MappedFile();
+}
+
+static std::string cloudCachePath(int Z, size_t total, uint64_t seed)
+{
+    std::ostringstream oss;
+    oss << gCloudCacheDir << "/cloud_Z" << Z << "_n" << total << "_s" << std::hex << seed
+        << std::dec << "_g" << CLOUD_GENERATOR_VERSION << ".bin";
+    return oss.str();
+}
+
+static void computeCloudBounds(CloudBuildJob& job)
+{
+    job.bounds.assign(job.plan.orbitals.size(), CloudBounds());
+    for (size_t j = 0; j < job.plan.orbitals.size(); ++j)
+    {
+        const OrbitalJob& o = job.plan.orbitals[j];
+        CloudBounds& b = job.bounds[j];
+        uint64_t sumSquares = 0;
+        for (int a = 0; a < 3; ++a)
+        {
+            const int16_t* axis = job.store.axis(a) + o.offset;
+            axisBounds(axis, o.count, b.minQ[a], b.maxQ[a]);
+            sumSquares += axisSumSquares(axis, o.count);
+        }
+        if (o.count)
+            b.rmsRadius = std::sqrt(static_cast<float>(static_cast<double>(sumSquares) / o.count))
+                * o.quantScale / 32767.f;
+    }
+}
+
+static void writeCloudCache(const CloudBuildJob& job)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(gCloudCacheDir, ec);
+    const std::string path = cloudCachePath(job.Z, job.total, job.seed);
+    const std::string tmpPath = path + ".tmp";
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!out)
+    {
+        std::cerr << "Nie udalo sie zapisac cache chmury: " << path << "\n";
+        return;
+    }
+    CloudCacheHeader header;
+    std::memcpy(header.magic, CLOUD_CACHE_MAGIC, sizeof(header.magic));
+    header.formatVersion = CLOUD_CACHE_VERSION;
+    header.generatorVersion = CLOUD_GENERATOR_VERSION;
+    header.Z = job.Z;
+    header.seed = job.seed;
+    header.sampleCount = job.total;
+    header.capacity = job.store.capacity;
+    header.segmentCount = static_cast<uint32_t>(job.plan.orbitals.size());
+    header.reserved = 0;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    for (size_t j = 0; j < job.plan.orbitals.size(); ++j)
+    {
+        const OrbitalJob& o = job.plan.orbitals[j];
+        CloudCacheSegment seg;
+        seg.first = o.offset;
+        seg.count = o.count;
+        seg.shell = o.n - 1;
+        seg.scale = o.quantScale;
+        seg.rmsRadius = job.bounds[j].rmsRadius;
+        std::memcpy(seg.minQ, job.bounds[j].minQ, sizeof(seg.minQ));
+        std::memcpy(seg.maxQ, job.bounds[j].maxQ, sizeof(seg.maxQ));
+        out.write(reinterpret_cast<const char*>(&seg), sizeof(seg));
+    }
+    out.write(reinterpret_cast<const char*>(job.store.arena.get()),
+        static_cast<std::streamsize>(3 * job.store.capacity * sizeof(int16_t)));
+    out.close();
+    if (!out)
+    {
+        std::filesystem::remove(tmpPath, ec);
+        return;
+    }
+    std::filesystem::rename(tmpPath, path, ec);
+    if (ec)
+        std::filesystem::remove(tmpPath, ec);
+}
+
+static void recycleCloudSlot(CloudGpuBuffer& buf)
+{
+    for (GLuint* vbo : { &buf.shellVbo, &buf.densityVbo, &buf.pointVbo })
+    {
+        if (*vbo) glDeleteBuffers(1, vbo);
+        *vbo = 0;
+    }
+    if (buf.store && buf.store.use_count() == 1)
+        releaseCloudStore(std::move(*buf.store));
+    buf.store.reset();
+}
+
+static bool loadCloudCache(int Z, size_t total, uint64_t seed)
+{
+    sf::Clock timer;
+    MappedFile file;
+    if (!openMappedFile(cloudCachePath(Z, total, seed), file))
+        return false;
+    bool ok = file.size >= sizeof(CloudCacheHeader);
+    const CloudCacheHeader* header = reinterpret_cast<const CloudCacheHeader*>(file.data);
+    ok = ok && std::memcmp(header->magic, CLOUD_CACHE_MAGIC, sizeof(header->magic)) == 0
+        && header->formatVersion == CLOUD_CACHE_VERSION
+        && header->generatorVersion == CLOUD_GENERATOR_VERSION
+        && header->Z == Z && header->seed == seed && header->sampleCount == total
+        && header->capacity >= total && header->capacity <= file.size;
+    const size_t payloadOffset = sizeof(CloudCacheHeader) + (ok ? header->segmentCount : 0) * sizeof(CloudCacheSegment);
+    const size_t payloadSize = ok ? 3 * header->capacity * sizeof(int16_t) : 0;
+    ok = ok && file.size == payloadOffset + payloadSize;
+    const CloudCacheSegment* segments = reinterpret_cast<const CloudCacheSegment*>(file.data + sizeof(CloudCacheHeader));
+    for (uint32_t s = 0; ok && s < header->segmentCount; ++s)
+        ok = segments[s].first <= total && segments[s].count <= total - segments[s].first
+            && segments[s].shell >= 0 && segments[s].shell < MAX_SHELLS;
+    if (!ok)
+    {
+        closeMappedFile(file);
+        return false;
+    }
+
+    const int target = 1 - gCloudFront;
+    CloudGpuBuffer& buf = gCloudBuffers[target];
+    recycleCloudSlot(buf);
+    if (!buf.vbo) glGenBuffers(1, &buf.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, buf.vbo);
+    glBufferData(GL_ARRAY_BUFFER, payloadSize, file.data + payloadOffset, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    buf.Z = Z;
+    buf.capacity = header->capacity;
+    std::fill(std::begin(buf.shellScale), std::end(buf.shellScale), 0.f);
+    buf.segments.clear();
+    for (uint32_t s = 0; s < header->segmentCount; ++s)
+    {
+        const CloudCacheSegment& seg = segments[s];
+        CloudSegment out{ static_cast<GLint>(seg.first), static_cast<GLsizei>(seg.count), seg.shell, CloudBounds() };
+        std::memcpy(out.bounds.minQ, seg.minQ, sizeof(seg.minQ));
+        std::memcpy(out.bounds.maxQ, seg.maxQ, sizeof(seg.maxQ));
+        out.bounds.rmsRadius = seg.rmsRadius;
+        buf.segments.push_back(out);
+        buf.shellScale[seg.shell] = seg.scale;
+    }
+    CloudStore store = acquireCloudStore(total);
+    const int16_t* payload = reinterpret_cast<const int16_t*>(file.data + payloadOffset);
+    for (int a = 0; a < 3; ++a)
+        std::copy(payload + a * header->capacity, payload + a * header->capacity + total, store.axis(a));
+    buf.store = std::make_shared<CloudStore>(std::move(store));
+    closeMappedFile(file);
+    gCloudFront = target;
+    std::cout << "Chmura elektronowa Z = " << Z << ": " << total << " probek z cache w "
+        << timer.getElapsedTime().asMilliseconds() << " ms\n";
+    return true;
+}
+
+static void runCloudBuild(CloudBuildJob& job)
+{
+    sf::Clock timer;
+    job.plan = planOrbitalCloud(job.Z, job.total, job.seed);
+    job.store = acquireCloudStore(job.total);
+    job.planReady.store(true, std::memory_order_release);
+    for (int chunk = 0; chunk < job.plan.chunkCount; ++chunk)
+    {
+        if (!job.cancelled.load(std::memory_order_relaxed))
+            sampleCloudChunk(job.plan, chunk, job.store, job.cancelled);
+        if (job.cancelled.load(std::memory_order_relaxed))
+        {
+            releaseCloudStore(std::move(job.store));
+            return;
+        }
+        job.chunksDone.store(chunk + 1, std::memory_order_release);
+    }
+    computeCloudBounds(job);
+    job.elapsedMs = timer.getElapsedTime().asMilliseconds();
+    if (gCloudCacheEnabled)
+        writeCloudCache(job);
+    job.finished.store(true, std::memory_order_release);
+}
+
+static void cloudWorkerLoop()
+{
+    for (;;)
+    {
+        std::shared_ptr<CloudBuildJob> job;
+        {
+            std::unique_lock<std::mutex> lock(gCloudWorker.mutex);
+            gCloudWorker.wake.wait(lock, [] { return gCloudWorker.quit || gCloudWorker.pending; });
+            if (gCloudWorker.quit) return;
+            job = std::move(gCloudWorker.pending);
+            gCloudWorker.running = job;
+        }
+        runCloudBuild(*job);
+        {
+            std::lock_guard<std::mutex> lock(gCloudWorker.mutex);
+            gCloudWorker.running.reset();
+        }
+    }
+}
+
+static void startCloudWorker()
+{
+    gCloudWorker.quit = false;
+    gCloudWorker.thread = std::thread(cloudWorkerLoop);
+}
+
+static void stopCloudWorker()
+{
+    {
+        std::lock_guard<std::mutex> lock(gCloudWorker.mutex);
+        gCloudWorker.quit = true;
+        gCloudWorker.pending.reset();
+        if (gCloudWorker.running) gCloudWorker.running->cancelled = true;
+    }
+    gCloudWorker.wake.notify_all();
+    if (gCloudWorker.thread.joinable())
+        gCloudWorker.thread.join();
+    gCloudUpload = CloudUploadState();
+}
+
+static void requestCloudBuild(int Z)
+{
+    gCloudRequestedZ = Z;
+    gCloudUpload = CloudUploadState();
+    {
+        std::lock_guard<std::mutex> lock(gCloudWorker.mutex);
+        if (gCloudWorker.running) gCloudWorker.running->cancelled = true;
+        gCloudWorker.pending.reset();
+    }
+    if (gCloudCacheEnabled && loadCloudCache(Z, gCloudSampleCount, gCloudSeed))
+        return;
+    auto job = std::make_shared<CloudBuildJob>();
+    job->Z = Z;
+    job->total = gCloudSampleCount;
+    job->seed = gCloudSeed;
+    {
+        std::lock_guard<std::mutex> lock(gCloudWorker.mutex);
+        gCloudWorker.pending = job;
+    }
+    gCloudWorker.wake.notify_one();
+    gCloudUpload.job = job;
+}
+
+static void uploadBufferRange(GLenum target, GLintptr offset, GLsizeiptr size, const void* data)
+{
+    if (gCoreProfile || GLEW_ARB_map_buffer_range)
+    {
+        void* dst = glMapBufferRange(target, offset, size,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        if (dst)
+        {
+            std::memcpy(dst, data, static_cast<size_t>(size));
+            glUnmapBuffer(target);
+            return;
+        }
+    }
+    glBufferSubData(target, offset, size, data);
+}
+
+static void pumpCloudUploads()
+{
+    if (gCloudRequestedZ != G.electronCount)
+        requestCloudBuild(G.electronCount);
+    CloudUploadState& up = gCloudUpload;
+    if (!up.job || !up.job->planReady.load(std::memory_order_acquire))
+        return;
+    const CloudBuildJob& job = *up.job;
+    if (up.target < 0)
+    {
+        up.target = 1 - gCloudFront;
+        CloudGpuBuffer& buf = gCloudBuffers[up.target];
+        recycleCloudSlot(buf);
+        if (!buf.vbo) glGenBuffers(1, &buf.vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, buf.vbo);
+        glBufferData(GL_ARRAY_BUFFER, 3 * job.store.capacity * sizeof(int16_t), nullptr, GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        buf.Z = job.Z;
+        buf.capacity = job.store.capacity;
+        std::copy(std::begin(job.plan.shellScale), std::end(job.plan.shellScale), buf.shellScale);
+        buf.segments.clear();
+        for (const OrbitalJob& o : job.plan.orbitals)
+            buf.segments.push_back({ static_cast<GLint>(o.offset), 0, o.n - 1, CloudBounds() });
+    }
+    const int done = job.chunksDone.load(std::memory_order_acquire);
+    if (done > up.uploadedChunks)
+    {
+        CloudGpuBuffer& buf = gCloudBuffers[up.target];
+        glBindBuffer(GL_ARRAY_BUFFER, buf.vbo);
+        for (size_t j = 0; j < job.plan.orbitals.size(); ++j)
+        {
+            const OrbitalJob& o = job.plan.orbitals[j];
+            size_t from = chunkBoundary(o, up.uploadedChunks, job.plan.chunkCount);
+            size_t to = chunkBoundary(o, done, job.plan.chunkCount);
+            for (int a = 0; to > from && a < 3; ++a)
+                uploadBufferRange(GL_ARRAY_BUFFER, (a * buf.capacity + o.offset + from) * sizeof(int16_t),
+                    (to - from) * sizeof(int16_t), job.store.axis(a) + o.offset + from);
+            buf.segments[j].filled = static_cast<GLsizei>(to);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        up.uploadedChunks = done;
+        gCloudFront = up.target;
+    }
+    if (up.uploadedChunks == job.plan.chunkCount && job.finished.load(std::memory_order_acquire))
+    {
+        CloudGpuBuffer& buf = gCloudBuffers[up.target];
+        for (size_t j = 0; j < buf.segments.size() && j < job.bounds.size(); ++j)
+            buf.segments[j].bounds = job.bounds[j];
+        std::cout << "Chmura elektronowa Z = " << job.Z << ": " << job.total
+            << " probek w " << job.elapsedMs << " ms ("
+            << std::max(1u, std::thread::hardware_concurrency()) << " watkow), "
+            << (3 * job.store.capacity * sizeof(int16_t)) / 1024 << " KiB\n";
+        buf.store = std::make_shared<CloudStore>(std::move(up.job->store));
+        up.job.reset();
+    }
+}
+
+static bool cloudBuildPending()
+{
+    return static_cast<bool>(gCloudUpload.job);
+}
+
+static void finishCloudBuild()
+{
+    while (cloudBuildPending())
+    {
+        pumpCloudUploads();
+        if (cloudBuildPending())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+static void freeCloudBuffers()
+{
+    for (CloudGpuBuffer& buf : gCloudBuffers)
+    {
+        if (buf.vbo) glDeleteBuffers(1, &buf.vbo);
+        if (buf.shellVbo) glDeleteBuffers(1, &buf.shellVbo);
+        if (buf.densityVbo) glDeleteBuffers(1, &buf.densityVbo);
+        if (buf.pointVbo) glDeleteBuffers(1, &buf.pointVbo);
+        buf = CloudGpuBuffer();
+    }
+    gCloudRequestedZ = 0;
+}
+
+static bool textureCompressionSupported()
+{
+    return gTextureCacheEnabled && GLEW_EXT_texture_compression_s3tc;
+}
+
+static std::string textureCachePath(const std::string& path)
+{
+    std::ostringstream oss;
+    oss << gTextureCacheDir << "/" << std::filesystem::path(path).stem().string()
+        << "_" << std::hex << hashBytes(path.data(), path.size()) << ".tex";
+    return oss.str();
+}
+
+static uint64_t sourceFileSize(const std::string& path)
+{
+    std::error_code ec;
+    const uintmax_t size = std::filesystem::file_size(path, ec);
+    return ec ? 0 : static_cast<uint64_t>(size);
+}
+
+static bool validDxt1Levels(const std::vector<TextureLevel>& levels, uint64_t available)
+{
+    uint64_t offset = 0;
+    for (const TextureLevel& level : levels)
+    {
+        if (level.width == 0 || level.height == 0 || level.offset != offset)
+            return false;
+        const uint64_t blocks = static_cast<uint64_t>(std::max(1u, (level.width + 3) / 4))
+            * std::max(1u, (level.height + 3) / 4);
+        if (level.size != blocks * 8 || level.size > available - offset)
+            return false;
+        offset += level.size;
+    }
+    return true;
+}
+
+static bool loadTextureCache(const std::string& path, TextureData& out)
+{
+    const std::string cachePath = textureCachePath(path);
+    std::ifstream in(cachePath, std::ios::binary);
+    TextureCacheHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        return false;
+    if (std::memcmp(header.magic, TEXTURE_CACHE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != TEXTURE_CACHE_VERSION
+        || header.sourceSize != sourceFileSize(path)
+        || header.sourceTime != fileTimeStamp(path)
+        || header.format != GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+        || header.levelCount == 0 || header.levelCount > 32)
+        return false;
+    out.format = header.format;
+    out.levels.resize(header.levelCount);
+    if (!in.read(reinterpret_cast<char*>(out.levels.data()), out.levels.size() * sizeof(TextureLevel)))
+        return false;
+    const uint64_t headerBytes = sizeof(header) + out.levels.size() * sizeof(TextureLevel);
+    const uint64_t fileBytes = sourceFileSize(cachePath);
+    if (fileBytes < headerBytes || !validDxt1Levels(out.levels, fileBytes - headerBytes))
+        return false;
+    const TextureLevel& last = out.levels.back();
+    out.pixels.resize(static_cast<size_t>(last.offset + last.size));
+    if (!in.read(reinterpret_cast<char*>(out.pixels.data()), out.pixels.size()))
+        return false;
+    out.fromCache = true;
+    return true;
+}
+
+static void writeTextureCache(const std::string& path, const TextureData& data)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(gTextureCacheDir, ec);
+    const std::string cachePath = textureCachePath(path);
+    const std::string tmpPath = cachePath + ".tmp";
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!out)
+    {
+        std::cerr << "Nie udalo sie zapisac cache tekstury: " << cachePath << "\n";
+        return;
+    }
+    TextureCacheHeader header;
+    std::memcpy(header.magic, TEXTURE_CACHE_MAGIC, sizeof(header.magic));
+    header.version = TEXTURE_CACHE_VERSION;
+    header.sourceSize = sourceFileSize(path);
+    header.sourceTime = fileTimeStamp(path);
+    header.format = data.format;
+    header.levelCount = static_cast<uint32_t>(data.levels.size());
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(data.levels.data()), data.levels.size() * sizeof(TextureLevel));
+    out.write(reinterpret_cast<const char*>(data.pixels.data()), data.pixels.size());
+    out.close();
+    if (!out)
+    {
+        std::filesystem::remove(tmpPath, ec);
+        return;
+    }
+    std::filesystem::rename(tmpPath, cachePath, ec);
+    if (ec)
+        std::filesystem::remove(tmpPath, ec);
+}
+
+static void downsampleRgba(const uint8_t* src, uint32_t srcW, uint32_t srcH, uint8_t* dst, uint32_t dstW, uint32_t dstH)
+{
+    parallelFor(dstH, [&](size_t begin, size_t end)
+    {
+        for (size_t y = begin; y < end; ++y)
+        {
+            const uint8_t* row0 = src + std::min<size_t>(2 * y, srcH - 1) * srcW * 4;
+            const uint8_t* row1 = src + std::min<size_t>(2 * y + 1, srcH - 1) * srcW * 4;
+            uint8_t* out = dst + y * dstW * 4;
+            for (uint32_t x = 0; x < dstW; ++x)
+            {
+                const size_t x0 = std::min<size_t>(2 * x, srcW - 1) * 4;
+                const size_t x1 = std::min<size_t>(2 * x + 1, srcW - 1) * 4;
+                for (int c = 0; c < 4; ++c)
+                    out[x * 4 + c] = static_cast<uint8_t>((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+            }
+        }
+    }, 16);
+}
+
+static void buildMipChain(const sf::Image& img, TextureData& out)
+{
+    uint32_t w = img.getSize().x;
+    uint32_t h = img.getSize().y;
+    std::vector<uint8_t> level(img.getPixelsPtr(), img.getPixelsPtr() + size_t(w) * h * 4);
+    out.format = GL_RGBA8;
+    out.levels.clear();
+    out.pixels.clear();
+    while (true)
+    {
+        if (gMaxTextureSize <= 0 || (w <= static_cast<uint32_t>(gMaxTextureSize) && h <= static_cast<uint32_t>(gMaxTextureSize)))
+        {
+            out.levels.push_back({ w, h, out.pixels.size(), level.size() });
+            out.pixels.insert(out.pixels.end(), level.begin(), level.end());
+        }
+        if (w == 1 && h == 1)
+            break;
+        const uint32_t nw = std::max(1u, w / 2);
+        const uint32_t nh = std::max(1u, h / 2);
+        std::vector<uint8_t> next(size_t(nw) * nh * 4);
+        downsampleRgba(level.data(), w, h, next.data(), nw, nh);
+        level.swap(next);
+        w = nw;
+        h = nh;
+    }
+}
+
+static uint16_t packRgb565(const int* rgb)
+{
+    return static_cast<uint16_t>(((rgb[0] * 31 + 127) / 255) << 11 | ((rgb[1] * 63 + 127) / 255) << 5 | ((rgb[2] * 31 + 127) / 255));
+}
+
+static void unpackRgb565(uint16_t c, int* rgb)
+{
+    const int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+static void compressBc1Block(const uint8_t (&block)[16][4], uint8_t* out)
+{
+    int lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 };
+    for (const auto& px : block)
+        for (int c = 0; c < 3; ++c)
+        {
+            lo[c] = std::min<int>(lo[c], px[c]);
+            hi[c] = std::max<int>(hi[c], px[c]);
+        }
+    for (int c = 0; c < 3; ++c)
+    {
+        const int inset = (hi[c] - lo[c]) >> 4;
+        lo[c] += inset;
+        hi[c] -= inset;
+    }
+    uint16_t c0 = packRgb565(hi), c1 = packRgb565(lo);
+    if (c0 < c1)
+        std::swap(c0, c1);
+    uint32_t indices = 0;
+    if (c0 != c1)
+    {
+        int palette[4][3];
+        unpackRgb565(c0, palette[0]);
+        unpackRgb565(c1, palette[1]);
+        for (int c = 0; c < 3; ++c)
+        {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+        for (int i = 0; i < 16; ++i)
+        {
+            int best = 0, bestDist = std::numeric_limits<int>::max();
+            for (int p = 0; p < 4; ++p)
+            {
+                int dist = 0;
+                for (int c = 0; c < 3; ++c)
+                    dist += (block[i][c] - palette[p][c]) * (block[i][c] - palette[p][c]);
+                if (dist < bestDist)
+                {
+                    bestDist = dist;
+                    best = p;
+                }
+            }
+            indices |= static_cast<uint32_t>(best) << (2 * i);
+        }
+    }
+    const uint8_t bytes[8] =
+    {
+        static_cast<uint8_t>(c0), static_cast<uint8_t>(c0 >> 8), static_cast<uint8_t>(c1), static_cast<uint8_t>(c1 >> 8),
+        static_cast<uint8_t>(indices), static_cast<uint8_t>(indices >> 8),
+        static_cast<uint8_t>(indices >> 16), static_cast<uint8_t>(indices >> 24)
+    };
+    std::memcpy(out, bytes, sizeof(bytes));
+}
+
+static void compressBc1(TextureData& data)
+{
+    TextureData out;
+    out.format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    for (const TextureLevel& level : data.levels)
+    {
+        const uint32_t bw = (level.width + 3) / 4, bh = (level.height + 3) / 4;
+        out.levels.push_back({ level.width, level.height, out.pixels.size(), uint64_t(bw) * bh * 8 });
+        out.pixels.resize(out.pixels.size() + size_t(bw) * bh * 8);
+        const uint8_t* src = data.pixels.data() + level.offset;
+        uint8_t* dst = out.pixels.data() + out.levels.back().offset;
+        parallelFor(bh, [&](size_t begin, size_t end)
+        {
+            uint8_t block[16][4];
+            for (size_t by = begin; by < end; ++by)
+                for (uint32_t bx = 0; bx < bw; ++bx)
+                {
+                    for (uint32_t i = 0; i < 16; ++i)
+                    {
+                        const size_t x = std::min<size_t>(bx * 4 + i % 4, level.width - 1);
+                        const size_t y = std::min<size_t>(by * 4 + i / 4, level.height - 1);
+                        std::memcpy(block[i], src + (y * level.width + x) * 4, 4);
+                    }
+                    compressBc1Block(block, dst + (by * bw + bx) * 8);
+                }
+        }, 4);
+    }
+    data = std::move(out);
+}
+
+static bool imageIsOpaque(const sf::Image& img)
+{
+    const uint8_t* px = img.getPixelsPtr();
+    const size_t count = size_t(img.getSize().x) * img.getSize().y;
+    for (size_t i = 0; i < count; ++i)
+        if (px[i * 4 + 3] != 255)
+            return false;
+    return true;
+}
+
+static bool decodeTexture(const std::string& path, TextureData& out)
+{
+    const bool compress = textureCompressionSupported();
+    if (compress && loadTextureCache(path, out))
+        return true;
+    sf::Image img;
+    if (!img.loadFromFile(path))
+    {
+        std::cerr << "Nie udalo sie wczytac tekstury: " << path << "\n";
+        return false;
+    }
+    buildMipChain(img, out);
+    if (compress && imageIsOpaque(img))
+    {
+        compressBc1(out);
+        writeTextureCache(path, out);
+    }
+    return !out.levels.empty();
+}
+
+static void assetWorkerLoop()
+{
+    AssetLoader& a = gAssetLoader;
+    std::unique_lock<std::mutex> lock(a.mutex);
+    while (true)
+    {
+        a.wake.wait(lock, [&]() { return a.quit || !a.queue.empty(); });
+        if (a.quit) return;
+        std::shared_ptr<AssetJob> job = std::move(a.queue.front());
+        a.queue.pop_front();
+        lock.unlock();
+        if (job->kind == AssetKind::Texture)
+            job->ok = decodeTexture(job->path, job->data);
+        else
+        {
+            job->font.reset(new sf::Font());
+            job->ok = job->font->loadFromFile(job->path);
+        }
+        job->done.store(true, std::memory_order_release);
+        lock.lock();
+    }
+}
+
+static void createPlaceholderTexture(GLuint& texture, const GLubyte* rgba)
+{
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+static void startAssetLoader()
+{
+    AssetLoader& a = gAssetLoader;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &gMaxTextureSize);
+    glGenBuffers(1, &a.pbo);
+    const GLubyte sky[4] = { 5, 5, 15, 255 };
+    createPlaceholderTexture(gBackgroundTex, sky);
+    a.quit = false;
+    a.clock.restart();
+    for (int i = 0; i < ASSET_LOADER_THREADS; ++i)
+        a.threads.emplace_back(assetWorkerLoop);
+}
+
+static void requestAsset(AssetKind kind, const std::string& path, GLuint* texture = nullptr)
+{
+    auto job = std::make_shared<AssetJob>();
+    job->kind = kind;
+    job->path = path;
+    job->texture = texture;
+    gAssetLoader.pending.push_back(job);
+    {
+        std::lock_guard<std::mutex> lock(gAssetLoader.mutex);
+        gAssetLoader.queue.push_back(job);
+    }
+    gAssetLoader.wake.notify_one();
+}
+
+static void beginTextureUpload(const std::shared_ptr<AssetJob>& job)
+{
+    const TextureData& data = job->data;
+    TextureUpload up;
+    up.job = job;
+    glGenTextures(1, &up.texture);
+    glBindTexture(GL_TEXTURE_2D, up.texture);
+    if (GLEW_ARB_texture_storage)
+        glTexStorage2D(GL_TEXTURE_2D, static_cast<GLsizei>(data.levels.size()), data.format,
+            data.levels[0].width, data.levels[0].height);
+    else
+        for (size_t level = 0; level < data.levels.size(); ++level)
+            glTexImage2D(GL_TEXTURE_2D, static_cast<GLint>(level), data.format,
+                data.levels[level].width, data.levels[level].height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, static_cast<GLint>(data.levels.size() - 1));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, data.levels.size() > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    gAssetLoader.uploads.push_back(std::move(up));
+}
+
+static size_t uploadTextureSlice(TextureUpload& up, size_t budget)
+{
+    const TextureData& data = up.job->data;
+    const TextureLevel& level = data.levels[up.level];
+    const bool compressed = data.format != GL_RGBA8;
+    const uint32_t rowsPerUnit = compressed ? 4 : 1;
+    const size_t unitBytes = compressed ? size_t((level.width + 3) / 4) * 8 : size_t(level.width) * 4;
+    const size_t units = std::max<size_t>(1, budget / unitBytes);
+    const uint32_t rows = static_cast<uint32_t>(std::min<size_t>(units * rowsPerUnit, level.height - up.row));
+    const size_t bytes = (rows + rowsPerUnit - 1) / rowsPerUnit * unitBytes;
+    const uint8_t* src = data.pixels.data() + level.offset + size_t(up.row / rowsPerUnit) * unitBytes;
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, gAssetLoader.pbo);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+    uploadBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, src);
+    glBindTexture(GL_TEXTURE_2D, up.texture);
+    if (compressed)
+        glCompressedTexSubImage2D(GL_TEXTURE_2D, static_cast<GLint>(up.level), 0, up.row, level.width, rows,
+            data.format, static_cast<GLsizei>(bytes), nullptr);
+    else
+        glTexSubImage2D(GL_TEXTURE_2D, static_cast<GLint>(up.level), 0, up.row, level.width, rows,
+            GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    up.row += rows;
+    if (up.row >= level.height)
+    {
+        ++up.level;
+        up.row = 0;
+    }
+    return bytes;
+}
+
+static void finishTextureUpload(TextureUpload& up)
+{
+    const AssetJob& job = *up.job;
+    const TextureData& data = job.data;
+    if (*job.texture)
+        glDeleteTextures(1, job.texture);
+    *job.texture = up.texture;
+    std::cout << "Tekstura zaladowana: " << job.path << " (" << data.levels[0].width << "x" << data.levels[0].height
+        << ", " << data.levels.size() << " poziomow mipmap, "
+        << (data.format == GL_RGBA8 ? "RGBA8" : "DXT1") << (data.fromCache ? " z cache" : "")
+        << ", " << data.pixels.size() / 1024 << " KiB) po "
+        << gAssetLoader.clock.getElapsedTime().asMilliseconds() << " ms\n";
+}
+
+static void finishAssetJob(AssetJob& job)
+{
+    if (job.kind == AssetKind::Font)
+    {
+        gFontLoaded = job.ok;
+        gGuiOverlay.dirty = true;
+        if (job.ok)
+            gFont = *job.font;
+        else
+            std::cout << "UWAGA: Nie udalo sie wczytac czcionki '" << job.path << "'. "
+                << "GUI tekstowe bedzie wylaczone.\n";
+    }
+}
+
+static void pumpAssetUploads(size_t budget = ASSET_UPLOAD_BUDGET)
+{
+    AssetLoader& a = gAssetLoader;
+    for (size_t i = 0; i < a.pending.size();)
+    {
+        std::shared_ptr<AssetJob> job = a.pending[i];
+        if (!job->done.load(std::memory_order_acquire))
+        {
+            ++i;
+            continue;
+        }
+        a.pending.erase(a.pending.begin() + i);
+        if (job->kind == AssetKind::Texture && job->ok)
+            beginTextureUpload(job);
+        else
+            finishAssetJob(*job);
+    }
+    while (budget > 0 && !a.uploads.empty())
+    {
+        TextureUpload& up = a.uploads.front();
+        budget -= std::min(budget, uploadTextureSlice(up, budget));
+        if (up.level < up.job->data.levels.size())
+            continue;
+        finishTextureUpload(up);
+        a.uploads.pop_front();
+    }
+}
+
+static bool assetLoadsPending()
+{
+    return !gAssetLoader.pending.empty() || !gAssetLoader.uploads.empty();
+}
+
+static void finishAssetLoads()
+{
+    while (assetLoadsPending())
+    {
+        pumpAssetUploads(std::numeric_limits<size_t>::max());
+        if (assetLoadsPending())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+static void stopAssetLoader()
+{
+    AssetLoader& a = gAssetLoader;
+    {
+        std::lock_guard<std::mutex> lock(a.mutex);
+        a.quit = true;
+        a.queue.clear();
+    }
+    a.wake.notify_all();
+    for (std::thread& th : a.threads)
+        th.join();
+    a.threads.clear();
+    for (TextureUpload& up : a.uploads)
+        glDeleteTextures(1, &up.texture);
+    a.uploads.clear();
+    a.pending.clear();
+    if (a.pbo) glDeleteBuffers(1, &a.pbo);
+    a.pbo = 0;
+}
+
+
+static int countActiveShells()
+{
+    return currentConfig().shellCount;
+}
+
+static void drawOrbitCircle(float radius, int segments = 64)
+{
+    drawMesh(getMesh(MeshKind::OrbitCircle, radius, segments));
+}
+
+static void initMeshCache()
+{
+    for (int lod = 0; lod < SPHERE_LOD_COUNT; ++lod)
+        for (float radius : { 0.25f, 0.08f, 1.0f })
+            sphereLodMesh(radius, lod);
+    for (int s = 0; s < MAX_SHELLS; ++s)
+        getMesh(MeshKind::OrbitCircle, shellRadius(s), 64);
+    getMesh(MeshKind::Axes, 0.5f);
+    getMesh(MeshKind::Axes, 0.15f);
+    getMesh(MeshKind::BackgroundQuad);
+}
+
+static void setShellRadii(GLuint program)
+{
+    GLfloat radii[MAX_SHELLS];
+    for (int s = 0; s < MAX_SHELLS; ++s)
+        radii[s] = shellRadius(s);
+    useProgram(program);
+    glUniform1fv(glGetUniformLocation(program, "uShellRadius"), MAX_SHELLS, radii);
+    useProgram(0);
+}
+
+static void configureElectronProgram(GLuint program)
+{
+    setShellRadii(program);
+    gElectronTimeLoc = glGetUniformLocation(program, "uTime");
+}
+
+static void configureElectronAxesProgram(GLuint program)
+{
+    setShellRadii(program);
+    gElectronAxesTimeLoc = glGetUniformLocation(program, "uTime");
+}
+
+static void initElectronShaders()
+{
+    if (!gCoreProfile && (!GLEW_ARB_instanced_arrays || !GLEW_ARB_draw_instanced))
+    {
+        std::cout << "Brak ARB_instanced_arrays/ARB_draw_instanced - elektrony rysowane pojedynczo.\n";
+        return;
+    }
+    const std::vector<std::pair<GLuint, std::string>> attribs = { { ELECTRON_INSTANCE_ATTRIB, "aInstance" } };
+    loadShaderProgram(&gElectronProgram, "electron", "electron.vert", "atom.frag",
+        attribs, maxShellsDefine(), configureElectronProgram);
+    loadShaderProgram(&gElectronAxesProgram, "electron_axes", "electron_axes.vert", "color.frag",
+        attribs, maxShellsDefine(), configureElectronAxesProgram);
+    if (!gElectronProgram || !gElectronAxesProgram)
+    {
+        std::cerr << "Nie udało się zbudować shaderów instancjonowanych elektronów.\n";
+        releaseShaderProgram(&gElectronProgram);
+        releaseShaderProgram(&gElectronAxesProgram);
+        return;
+    }
+    glGenBuffers(1, &gElectronInstanceVbo);
+    std::cout << "Elektrony rysowane instancyjnie (jedno wywolanie na wszystkie elektrony).\n";
+}
+
+static void initMoleculeShader()
+{
+    if (!gCoreProfile && (!GLEW_ARB_instanced_arrays || !GLEW_ARB_draw_instanced))
+        return;
+    if (!loadShaderProgram(&gMoleculeProgram, "molecule", "molecule.vert", "atom.frag",
+        { { MOLECULE_INSTANCE_ATTRIB, "aInstance" }, { MOLECULE_COLOR_ATTRIB, "aInstanceColor" } }))
+        std::cerr << "Nie udało się zbudować shaderów struktur, atomy rysowane pojedynczo.\n";
+}
+
+static void configureTextProgram(GLuint program)
+{
+    gTextScreenLoc = glGetUniformLocation(program, "uScreen");
+}
+
+static bool initCoreResources()
+{
+    loadShaderProgram(&gFlatProgram, "flat", "flat.vert", "color.frag");
+    loadShaderProgram(&gBackgroundProgram, "background", "background.vert", "background.frag");
+    loadShaderProgram(&gTextProgram, "text", "text.vert", "text.frag", {}, std::string(), configureTextProgram);
+    if (!gFlatProgram || !gBackgroundProgram || !gTextProgram)
+    {
+        std::cerr << "Nie udalo sie zbudowac shaderow profilu core.\n";
+        return false;
+    }
+
+    glGenBuffers(1, &gFrameUbo);
+    glBindBuffer(GL_UNIFORM_BUFFER, gFrameUbo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UBO_BINDING, gFrameUbo);
+
+    glGenVertexArrays(1, &gCloudVao);
+    glGenVertexArrays(1, &gTextVao);
+    glGenBuffers(1, &gTextVbo);
+    bindVertexArray(gTextVao);
+    glBindBuffer(GL_ARRAY_BUFFER, gTextVbo);
+    glEnableVertexAttribArray(CORE_POSITION_ATTRIB);
+    glVertexAttribPointer(CORE_POSITION_ATTRIB, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), nullptr);
+    glEnableVertexAttribArray(CORE_TEXCOORD_ATTRIB);
+    glVertexAttribPointer(CORE_TEXCOORD_ATTRIB, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float),
+        reinterpret_cast<const void*>(2 * sizeof(float)));
+    bindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return true;
+}
+
+static void freeCoreResources()
+{
+    for (GLuint* vao : { &gCloudVao, &gTextVao })
+    {
+        if (*vao) glDeleteVertexArrays(1, vao);
+        *vao = 0;
+    }
+    for (GLuint* buffer : { &gFrameUbo, &gTextVbo })
+    {
+        if (*buffer) glDeleteBuffers(1, buffer);
+        *buffer = 0;
+    }
+}
+
+static void updateElectronInstances()
+{
+    if (gElectronInstancesFor == G.electronCount)
+        return;
+    std::vector<GLfloat> data;
+    const ElectronConfig& config = currentConfig();
+    for (int shell = 0; shell < config.shellCount; ++shell)
+    {
+        int electronsInShell = config.shellElectrons[shell];
+        for (int e = 0; e < electronsInShell; ++e)
+            data.insert(data.end(), { static_cast<GLfloat>(shell), 360.f * e / electronsInShell, 1.0f + 0.3f * shell });
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, gElectronInstanceVbo);
+    glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(GLfloat), data.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    gElectronInstanceCount = static_cast<GLsizei>(data.size() / 3);
+    gElectronInstancesFor = G.electronCount;
+}
+
+static void drawElectronsInstanced(int lod)
+{
+    updateElectronInstances();
+    auto drawInstances = [](const Mesh& mesh)
+    {
+        bindMesh(mesh);
+        glBindBuffer(GL_ARRAY_BUFFER, gElectronInstanceVbo);
+        enableInstanceAttrib(ELECTRON_INSTANCE_ATTRIB, 3, GL_FLOAT, GL_FALSE, 0, 0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        drawMesh(mesh, gElectronInstanceCount);
+        disableInstanceAttrib(ELECTRON_INSTANCE_ATTRIB);
+    };
+    if (G.showLocalAxes)
+    {
+        useProgram(gElectronAxesProgram);
+        glUniform1f(gElectronAxesTimeLoc, G.electronAngleDeg);
+        setLineWidth(2.0f);
+        drawInstances(getMesh(MeshKind::Axes, 0.15f));
+    }
+    useProgram(gElectronProgram);
+    glUniform1f(gElectronTimeLoc, G.electronAngleDeg);
+    setColor(0.2f, 0.6f, 1.0f);
+    drawInstances(sphereLodMesh(0.08f, lod));
+    useProgram(gAtomProgram);
+}
+
+static void drawAtomBohrModel()
+{
+    pushModel();
+    {
+        const Mat4 modelView = currentModelView();
+        setColor(1.0f, 0.3f, 0.3f);
+        drawMesh(sphereLodMesh(0.25f, sphereLodAt(modelView, 0.25f)));
+        const ElectronConfig& config = currentConfig();
+        const int electronLod = sphereLodAt(modelView, 0.08f);
+        {
+            bool lighting = lightingEnabled();
+            GLuint prevProgram = currentProgram();
+            setLighting(false);
+            useFlatProgram();
+            setColor(0.9f, 0.9f, 0.9f);
+            setLineWidth(1.0f);
+            for (int shell = 0; shell < config.shellCount; ++shell)
+                drawOrbitCircle(shellRadius(shell));
+            setLighting(lighting);
+            useProgram(prevProgram);
+        }
+        for (int shell = 0; shell < config.shellCount && !gElectronProgram; ++shell)
+        {
+            int electronsInShell = config.shellElectrons[shell];
+            float R = shellRadius(shell);
+            for (int e = 0; e < electronsInShell; ++e)
+            {
+                float baseAngle = 360.f * e / electronsInShell;
+                float speed = 1.0f + 0.3f * shell;
+                float angle = baseAngle + G.electronAngleDeg * speed;
+                pushModel();
+                rotateModel(angle, 0.f, 1.f, 0.f);
+                translateModel(R, 0.f, 0.f);
+                if (G.showLocalAxes) drawAxes(0.15f);
+                setColor(0.2f, 0.6f, 1.0f);
+                drawMesh(sphereLodMesh(0.08f, electronLod));
+                popModel();
+            }
+        }
+        if (gElectronProgram)
+            drawElectronsInstanced(electronLod);
+    }
+    popModel();
+}
+
+static GLsizei visibleSegmentPoints(const CloudSegment& seg, float scale, const Mat4& modelView, const Frustum& frustum,
+    float pointsPerPixel)
+{
+    float lo[3], hi[3];
+    const bool empty = !seg.bounds.minQ[0] && !seg.bounds.maxQ[0] && !seg.bounds.minQ[1] && !seg.bounds.maxQ[1];
+    for (int a = 0; a < 3; ++a)
+    {
+        lo[a] = empty ? -scale : seg.bounds.minQ[a] * scale / 32767.f;
+        hi[a] = empty ? scale : seg.bounds.maxQ[a] * scale / 32767.f;
+    }
+    if (classifyBox(frustum, lo, hi) == FRUSTUM_OUTSIDE)
+    {
+        ++gCullStats.culledNodes;
+        return 0;
+    }
+    ++gCullStats.visibleNodes;
+    float extent = 0.f;
+    for (int a = 0; a < 3; ++a)
+        extent = std::max(extent, 0.5f * (hi[a] - lo[a]));
+    const float radiusPx = extent * pixelsPerUnitAtDepth(modelView, std::max(nearestBoxDepth(modelView, lo, hi), G.nearP));
+    const float budget = PI * radiusPx * radiusPx * pointsPerPixel;
+    const size_t wanted = std::max(CLOUD_MIN_SEGMENT_POINTS, static_cast<size_t>(budget));
+    return static_cast<GLsizei>(std::min(static_cast<size_t>(seg.filled), wanted));
+}
+
+static CloudBlend activeCloudBlend()
+{
+    if (G.cloudBlend == CloudBlend::Oit && gCloudOitProgram && gOitCompositeProgram)
+        return CloudBlend::Oit;
+    if (G.cloudBlend == CloudBlend::Sorted && gCloudSortedProgram)
+        return CloudBlend::Sorted;
+    return CloudBlend::Alpha;
+}
+
+static const char* cloudBlendName(CloudBlend blend)
+{
+    if (blend == CloudBlend::Oit) return "OIT";
+    return blend == CloudBlend::Sorted ? "sortowanie CPU" : "alfa";
+}
+
+static GLuint createOitTexture(GLint format, GLsizei w, GLsizei h)
+{
+    GLuint tex = 0;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
+    return tex;
+}
+
+static void freeOitTargets()
+{
+    OitTargets& o = gOit;
+    if (o.fbo) glDeleteFramebuffers(1, &o.fbo);
+    for (GLuint* tex : { &o.accumTex, &o.weightTex })
+        if (*tex) glDeleteTextures(1, tex);
+    if (o.depthRb) glDeleteRenderbuffers(1, &o.depthRb);
+    o = OitTargets();
+}
+
+static bool ensureOitTargets(GLsizei w, GLsizei h)
+{
+    OitTargets& o = gOit;
+    if (o.fbo && o.width == w && o.height == h)
+        return true;
+    freeOitTargets();
+    o.accumTex = createOitTexture(GL_RGBA16F, w, h);
+    o.weightTex = createOitTexture(gCoreProfile || GLEW_ARB_texture_rg ? GL_R16F : GL_RGBA16F, w, h);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glGenRenderbuffers(1, &o.depthRb);
+    glBindRenderbuffer(GL_RENDERBUFFER, o.depthRb);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glGenFramebuffers(1, &o.fbo);
+    bindFramebuffer(o.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, o.accumTex, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, o.weightTex, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, o.depthRb);
+    const GLenum buffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(2, buffers);
+    o.width = w;
+    o.height = h;
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE)
+        return true;
+    std::cerr << "Bufor OIT " << w << "x" << h << " jest niekompletny, chmura rysowana bez OIT.\n";
+    freeOitTargets();
+    releaseShaderProgram(&gCloudOitProgram);
+    releaseShaderProgram(&gOitCompositeProgram);
+    return false;
+}
+
+static bool beginCloudOit(const Mesh& nucleus)
+{
+    const GLuint prevFbo = currentFramebuffer();
+    const GLint* viewport = currentViewport();
+    if (!ensureOitTargets(viewport[2], viewport[3]))
+    {
+        bindFramebuffer(prevFbo);
+        return false;
+    }
+    OitTargets& o = gOit;
+    o.prevFbo = prevFbo;
+    bindFramebuffer(o.fbo);
+    const float* current = currentClearColor();
+    const float clearColor[4] = { current[0], current[1], current[2], current[3] };
+    setClearColor(0.f, 0.f, 0.f, 1.f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    setClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+    setColorMask(false);
+    drawMesh(nucleus);
+    if (G.showLocalAxes)
+        drawAxes(0.5f);
+    setColorMask(true);
+    setDepthMask(false);
+    setBlendFunc(GL_ONE, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+    return true;
+}
+
+static void resolveCloudOit()
+{
+    const OitTargets& o = gOit;
+    bindFramebuffer(o.prevFbo);
+    setBlendFunc(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA);
+    setDepthTest(false);
+    useProgram(gOitCompositeProgram);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, o.weightTex);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, o.accumTex);
+    drawMesh(getMesh(MeshKind::BackgroundQuad));
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    setDepthTest(true);
+    setDepthMask(true);
+    setBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+static void radixSortPass(const uint16_t* keys, const uint32_t* values, uint16_t* outKeys, uint32_t* outValues,
+    size_t count, int shift)
+{
+    const size_t chunks = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+        count / CLOUD_SORT_MIN_CHUNK + 1);
+    const size_t chunkSize = (count + chunks - 1) / chunks;
+    std::vector<size_t> histogram(chunks * 256, 0);
+    parallelFor(chunks, [&](size_t begin, size_t end)
+    {
+        for (size_t c = begin; c < end; ++c)
+        {
+            size_t* h = &histogram[c * 256];
+            const size_t last = std::min(count, (c + 1) * chunkSize);
+            for (size_t i = c * chunkSize; i < last; ++i)
+                ++h[(keys[i] >> shift) & 0xFF];
+        }
+    }, 1);
+    size_t offset = 0;
+    for (int digit = 0; digit < 256; ++digit)
+        for (size_t c = 0; c < chunks; ++c)
+        {
+            const size_t n = histogram[c * 256 + digit];
+            histogram[c * 256 + digit] = offset;
+            offset += n;
+        }
+    parallelFor(chunks, [&](size_t begin, size_t end)
+    {
+        for (size_t c = begin; c < end; ++c)
+        {
+            size_t* h = &histogram[c * 256];
+            const size_t last = std::min(count, (c + 1) * chunkSize);
+            for (size_t i = c * chunkSize; i < last; ++i)
+            {
+                const size_t dst = h[(keys[i] >> shift) & 0xFF]++;
+                outKeys[dst] = keys[i];
+                outValues[dst] = values[i];
+            }
+        }
+    }, 1);
+}
+
+static void sortCloudJob(CloudSortJob& job, std::vector<uint16_t>& keys, std::vector<uint16_t>& keyScratch,
+    std::vector<uint32_t>& valueScratch)
+{
+    const CloudStore& store = *job.store;
+    std::vector<size_t> offsets(1, 0);
+    for (const CloudDrawRange& r : job.ranges)
+        offsets.push_back(offsets.back() + r.count);
+    const size_t total = offsets.back();
+    job.indices.resize(total);
+    keys.resize(total);
+    keyScratch.resize(total);
+    valueScratch.resize(total);
+    const float* row = job.depthRow;
+    float radius = 0.f;
+    for (float scale : job.shellScale)
+        radius = std::max(radius, scale);
+    radius *= std::sqrt(3.f * (row[0] * row[0] + row[1] * row[1] + row[2] * row[2]));
+    const float farthest = row[3] - radius;
+    const float keyScale = radius > 0.f ? 65535.f / (2.f * radius) : 0.f;
+    parallelFor(total, [&](size_t begin, size_t end)
+    {
+        size_t r = std::upper_bound(offsets.begin(), offsets.end(), begin) - offsets.begin() - 1;
+        for (size_t i = begin; i < end; ++i)
+        {
+            while (i >= offsets[r + 1])
+                ++r;
+            const CloudDrawRange& range = job.ranges[r];
+            const size_t p = range.first + (i - offsets[r]);
+            const float scale = job.shellScale[range.shell] / 32767.f;
+            const float z = (row[0] * store.axis(0)[p] + row[1] * store.axis(1)[p] + row[2] * store.axis(2)[p]) * scale + row[3];
+            keys[i] = static_cast<uint16_t>(clampFloat((z - farthest) * keyScale + 0.5f, 0.f, 65535.f));
+            job.indices[i] = static_cast<uint32_t>(p);
+        }
+    });
+    radixSortPass(keys.data(), job.indices.data(), keyScratch.data(), valueScratch.data(), total, 0);
+    radixSortPass(keyScratch.data(), valueScratch.data(), keys.data(), job.indices.data(), total, 8);
+}
+
+static void cloudSorterLoop()
+{
+    CloudSorter& s = gCloudSorter;
+    std::vector<uint16_t> keys;
+    std::vector<uint16_t> keyScratch;
+    std::vector<uint32_t> valueScratch;
+    for (;;)
+    {
+        std::unique_ptr<CloudSortJob> job;
+        {
+            std::unique_lock<std::mutex> lock(s.mutex);
+            s.wake.wait(lock, [&s]() { return s.quit || s.pending; });
+            if (s.quit) return;
+            job = std::move(s.pending);
+            s.busy = true;
+        }
+        sf::Clock timer;
+        sortCloudJob(*job, keys, keyScratch, valueScratch);
+        job->sortMs = timer.getElapsedTime().asMicroseconds() / 1000.0;
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (s.done)
+        {
+            s.done->store.reset();
+            s.spare.push_back(std::move(s.done));
+        }
+        s.done = std::move(job);
+        s.busy = false;
+    }
+}
+
+static void startCloudSorter()
+{
+    gCloudSorter.quit = false;
+    gCloudSorter.thread = std::thread(cloudSorterLoop);
+}
+
+static void stopCloudSorter()
+{
+    CloudSorter& s = gCloudSorter;
+    if (s.thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.quit = true;
+        }
+        s.wake.notify_all();
+        s.thread.join();
+    }
+    s.pending.reset();
+    s.done.reset();
+    s.spare.clear();
+    if (s.ibo) glDeleteBuffers(1, &s.ibo);
+    s.ibo = 0;
+    s.drawCount = 0;
+    s.iboStore.reset();
+    s.submittedStore.reset();
+}
+
+static bool cloudSortPending()
+{
+    CloudSorter& s = gCloudSorter;
+    const bool shown = G.viewMode == ViewMode::ProbabilityCloud && !G.cloudVolume
+        && activeCloudBlend() == CloudBlend::Sorted;
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (!shown && s.done)
+    {
+        s.done->store.reset();
+        s.spare.push_back(std::move(s.done));
+        s.submittedStore.reset();
+    }
+    return s.busy || s.pending || s.done;
+}
+
+static bool sameCloudStore(const std::weak_ptr<const CloudStore>& a, const std::shared_ptr<CloudStore>& b)
+{
+    return !a.expired() && !a.owner_before(b) && !b.owner_before(a);
+}
+
+static void submitCloudSort(const CloudGpuBuffer& cloud, const std::vector<CloudDrawRange>& ranges, const Mat4& modelView)
+{
+    CloudSorter& s = gCloudSorter;
+    const float depthRow[4] = { modelView.m[2], modelView.m[6], modelView.m[10], modelView.m[14] };
+    const bool sameRanges = ranges.size() == s.submittedRanges.size() && std::equal(ranges.begin(), ranges.end(),
+        s.submittedRanges.begin(), [](const CloudDrawRange& a, const CloudDrawRange& b)
+        {
+            return a.first == b.first && a.count == b.count && a.shell == b.shell;
+        });
+    if (sameRanges && sameCloudStore(s.submittedStore, cloud.store)
+        && std::equal(std::begin(depthRow), std::end(depthRow), s.submittedDepthRow))
+        return;
+    s.submittedStore = cloud.store;
+    s.submittedRanges = ranges;
+    std::copy(std::begin(depthRow), std::end(depthRow), s.submittedDepthRow);
+    std::unique_ptr<CloudSortJob> job;
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (!s.spare.empty())
+        {
+            job = std::move(s.spare.back());
+            s.spare.pop_back();
+        }
+    }
+    if (!job) job.reset(new CloudSortJob());
+    job->store = cloud.store;
+    job->ranges = ranges;
+    std::copy(std::begin(cloud.shellScale), std::end(cloud.shellScale), job->shellScale);
+    std::copy(std::begin(depthRow), std::end(depthRow), job->depthRow);
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (s.pending)
+        {
+            s.pending->store.reset();
+            s.spare.push_back(std::move(s.pending));
+        }
+        s.pending = std::move(job);
+    }
+    s.wake.notify_one();
+}
+
+static void buildCloudShellVbo(CloudGpuBuffer& cloud)
+{
+    std::vector<uint8_t> shells(cloud.capacity, 0);
+    for (const CloudSegment& seg : cloud.segments)
+        std::fill(shells.begin() + seg.first, shells.begin() + seg.first + seg.filled,
+            static_cast<uint8_t>(std::max(0, seg.shell)));
+    glGenBuffers(1, &cloud.shellVbo);
+    glBindBuffer(GL_ARRAY_BUFFER, cloud.shellVbo);
+    glBufferData(GL_ARRAY_BUFFER, shells.size(), shells.data(), GL_STATIC_DRAW);
+}
+
+static int densityCell(int16_t q)
+{
+    return std::min(CLOUD_DENSITY_GRID - 1, (q + 32768) * CLOUD_DENSITY_GRID / 65536);
+}
+
+static void buildCloudDensityVbo(CloudGpuBuffer& cloud)
+{
+    const CloudStore& store = *cloud.store;
+    constexpr int cellsPerShell = CLOUD_DENSITY_GRID * CLOUD_DENSITY_GRID * CLOUD_DENSITY_GRID;
+    std::vector<uint32_t> counts(MAX_SHELLS * cellsPerShell, 0);
+    std::vector<uint32_t> cells(cloud.capacity, 0);
+    for (const CloudSegment& seg : cloud.segments)
+    {
+        if (seg.shell < 0 || seg.shell >= MAX_SHELLS) continue;
+        for (GLsizei i = 0; i < seg.filled; ++i)
+        {
+            const size_t p = seg.first + i;
+            const uint32_t cell = seg.shell * cellsPerShell
+                + (densityCell(store.axis(0)[p]) * CLOUD_DENSITY_GRID + densityCell(store.axis(1)[p])) * CLOUD_DENSITY_GRID
+                + densityCell(store.axis(2)[p]);
+            cells[p] = cell;
+            ++counts[cell];
+        }
+    }
+    for (int shell = 0; shell < MAX_SHELLS; ++shell)
+    {
+        const uint32_t* first = &counts[shell * cellsPerShell];
+        const uint32_t peak = std::max(1u, *std::max_element(first, first + cellsPerShell));
+        const float cellSize = 2.f * std::max(cloud.shellScale[shell], 1e-6f) / CLOUD_DENSITY_GRID;
+        const float logVolume = 3.f * std::log(cellSize);
+        cloud.densityRange[2 * shell] = -logVolume;
+        cloud.densityRange[2 * shell + 1] = std::log(static_cast<float>(peak)) - logVolume;
+    }
+    std::vector<uint8_t> density(cloud.capacity, 0);
+    for (const CloudSegment& seg : cloud.segments)
+    {
+        if (seg.shell < 0 || seg.shell >= MAX_SHELLS) continue;
+        const float logPeak = cloud.densityRange[2 * seg.shell + 1] - cloud.densityRange[2 * seg.shell];
+        for (GLsizei i = 0; i < seg.filled; ++i)
+        {
+            const size_t p = seg.first + i;
+            const float t = logPeak > 0.f ? std::log(static_cast<float>(counts[cells[p]])) / logPeak : 0.f;
+            density[p] = static_cast<uint8_t>(255.f * t + 0.5f);
+        }
+    }
+    glGenBuffers(1, &cloud.densityVbo);
+    glBindBuffer(GL_ARRAY_BUFFER, cloud.densityVbo);
+    glBufferData(GL_ARRAY_BUFFER, density.size(), density.data(), GL_STATIC_DRAW);
+}
+
+static void buildCloudPointVbo(CloudGpuBuffer& cloud)
+{
+    const CloudStore& store = *cloud.store;
+    std::vector<int16_t> points(3 * cloud.capacity, 0);
+    for (const CloudSegment& seg : cloud.segments)
+        for (GLsizei i = 0; i < seg.filled; ++i)
+        {
+            const size_t p = seg.first + i;
+            for (int a = 0; a < 3; ++a)
+                points[3 * p + a] = store.axis(a)[p];
+        }
+    glGenBuffers(1, &cloud.pointVbo);
+    glBindBuffer(GL_ARRAY_BUFFER, cloud.pointVbo);
+    glBufferData(GL_ARRAY_BUFFER, points.size() * sizeof(int16_t), points.data(), GL_STATIC_DRAW);
+}
+
+static void drawCloudFixedFunction(CloudGpuBuffer& cloud, int activeShells)
+{
+    if (!cloud.pointVbo)
+        buildCloudPointVbo(cloud);
+    glBindBuffer(GL_ARRAY_BUFFER, cloud.pointVbo);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_SHORT, 0, nullptr);
+    for (const CloudSegment& seg : cloud.segments)
+    {
+        if (seg.shell < 0 || seg.shell >= activeShells || seg.filled <= 0) continue;
+        GLfloat color[4];
+        shellCloudColor(seg.shell, color);
+        setColor(color[0], color[1], color[2], color[3]);
+        pushModel();
+        scaleModel(cloud.shellScale[seg.shell] / 32767.f);
+        glDrawArrays(GL_POINTS, seg.first, seg.filled);
+        popModel();
+        gCullStats.totalPoints += seg.filled;
+        gCullStats.drawnPoints += seg.filled;
+    }
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+static bool pullCloudSortResult(const CloudGpuBuffer& cloud)
+{
+    CloudSorter& s = gCloudSorter;
+    std::unique_ptr<CloudSortJob> done;
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        done = std::move(s.done);
+    }
+    if (done)
+    {
+        if (!s.ibo) glGenBuffers(1, &s.ibo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, s.ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, done->indices.size() * sizeof(uint32_t), done->indices.data(), GL_STREAM_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        s.drawCount = static_cast<GLsizei>(done->indices.size());
+        s.iboStore = done->store;
+        if (s.recordSamples)
+            s.sortSamples.push_back(done->sortMs);
+        done->store.reset();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.spare.push_back(std::move(done));
+    }
+    return s.ibo && s.drawCount && sameCloudStore(s.iboStore, cloud.store);
+}
+
+static void bindCloudPointAttrib(GLuint index, GLuint& vbo, CloudGpuBuffer& cloud, void (*build)(CloudGpuBuffer&))
+{
+    if (!vbo)
+        build(cloud);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glEnableVertexAttribArray(index);
+    glVertexAttribPointer(index, 1, GL_UNSIGNED_BYTE, index == CLOUD_DENSITY_ATTRIB, 0, nullptr);
+}
+
+static void beginCloudSplats(GLuint program, const CloudUniforms& u, const CloudGpuBuffer& cloud, const Mat4& modelView,
+    const float* alphaScale, const float* drawnFraction)
+{
+    useProgram(program);
+    applyModelUniform();
+    glUniform1fv(u.shellScale, MAX_SHELLS, cloud.shellScale);
+    glUniform1fv(u.alphaScale, MAX_SHELLS, alphaScale);
+    glUniform1fv(u.drawnFraction, MAX_SHELLS, drawnFraction);
+    glUniform2fv(u.densityRange, MAX_SHELLS, cloud.densityRange);
+    glUniform1f(u.pointScale, 2.f * pixelsPerUnitAtDepth(modelView, 1.f));
+    glBindTexture(GL_TEXTURE_2D, gCloudColormap);
+    glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+    if (!gCoreProfile)
+    {
+        glEnable(GL_POINT_SPRITE);
+        glTexEnvi(GL_POINT_SPRITE, GL_COORD_REPLACE, GL_TRUE);
+    }
+}
+
+static void endCloudSplats()
+{
+    if (!gCoreProfile)
+    {
+        glTexEnvi(GL_POINT_SPRITE, GL_COORD_REPLACE, GL_FALSE);
+        glDisable(GL_POINT_SPRITE);
+    }
+    glDisable(GL_VERTEX_PROGRAM_POINT_SIZE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+static void drawCloudPoints(const std::vector<CloudDrawRange>& ranges, bool sorted)
+{
+    setDepthMask(false);
+    if (sorted)
+    {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gCloudSorter.ibo);
+        glDrawElements(GL_POINTS, gCloudSorter.drawCount, GL_UNSIGNED_INT, nullptr);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+    else
+    {
+        std::vector<GLint> firsts;
+        std::vector<GLsizei> counts;
+        for (const CloudDrawRange& r : ranges)
+        {
+            firsts.push_back(r.first);
+            counts.push_back(r.count);
+        }
+        glMultiDrawArrays(GL_POINTS, firsts.data(), counts.data(), static_cast<GLsizei>(firsts.size()));
+    }
+    setDepthMask(true);
+}
+
+static void drawCloudShells(GLuint program, const CloudUniforms& u, const CloudGpuBuffer& cloud,
+    const std::vector<CloudDrawRange>& ranges, const float* alphaScale)
+{
+    useProgram(program);
+    applyModelUniform();
+    glUniform1fv(u.shellScale, MAX_SHELLS, cloud.shellScale);
+    std::vector<GLint> firsts;
+    std::vector<GLsizei> counts;
+    for (int shell = 0; shell < MAX_SHELLS; ++shell)
+    {
+        firsts.clear();
+        counts.clear();
+        for (const CloudDrawRange& r : ranges)
+        {
+            if (r.shell != shell) continue;
+            firsts.push_back(r.first);
+            counts.push_back(r.count);
+        }
+        if (firsts.empty()) continue;
+        glUniform1i(u.shell, shell);
+        glUniform1f(u.alphaScale, alphaScale[shell]);
+        glMultiDrawArrays(GL_POINTS, firsts.data(), counts.data(), static_cast<GLsizei>(firsts.size()));
+    }
+}
+
+static void rotateCloudModel()
+{
+    float baseYaw = 18.0f * (G.electronCount - 1);
+    float basePitch = 7.0f * (G.electronCount - 1);
+    float animAngle = 0.4f * G.electronAngleDeg;
+    rotateModel(baseYaw + animAngle, 0.f, 1.f, 0.f);
+    rotateModel(basePitch, 1.f, 0.f, 0.f);
+}
+
+static void drawAtomProbabilityCloud()
+{
+    pushModel();
+    {
+        setColor(1.0f, 0.3f, 0.3f);
+        const Mesh& nucleus = sphereLodMesh(0.25f, sphereLodAt(currentModelView(), 0.25f));
+        drawMesh(nucleus);
+        int activeShells = countActiveShells();
+        bool lighting = lightingEnabled();
+        GLuint prevProgram = currentProgram();
+        CloudGpuBuffer& cloud = gCloudBuffers[gCloudFront];
+        const CloudBlend blend = activeCloudBlend();
+        const bool oit = blend == CloudBlend::Oit && gCloudProgram && cloud.vbo && beginCloudOit(nucleus);
+        const GLuint splatProgram = oit ? gCloudSplatOitProgram : gCloudSplatProgram;
+        const bool splats = G.cloudSplats && splatProgram && cloud.store;
+        useProgram(0);
+        setLighting(false);
+        pushModel();
+        {
+            rotateCloudModel();
+            const Mat4 modelView = currentModelView();
+            const Frustum frustum = extractFrustum(mat4Multiply(gProjectionMatrix, modelView));
+            setPointSize(2.5f);
+            if (gCloudProgram && cloud.vbo)
+            {
+                const float pointsPerPixel = splats ? CLOUD_SPLAT_POINTS_PER_PIXEL : CLOUD_POINTS_PER_PIXEL;
+                std::vector<CloudDrawRange> ranges;
+                float alphaScale[MAX_SHELLS] = {};
+                float drawnFraction[MAX_SHELLS] = {};
+                size_t shellFilled[MAX_SHELLS] = {};
+                size_t shellDrawn[MAX_SHELLS] = {};
+                size_t totalDrawn = 0;
+                for (int shell = 0; shell < activeShells && shell < MAX_SHELLS; ++shell)
+                {
+                    for (const CloudSegment& seg : cloud.segments)
+                    {
+                        if (seg.shell != shell || seg.filled <= 0) continue;
+                        GLsizei drawn = visibleSegmentPoints(seg, cloud.shellScale[shell], modelView, frustum, pointsPerPixel);
+                        gCullStats.totalPoints += seg.filled;
+                        if (drawn <= 0) continue;
+                        shellFilled[shell] += seg.filled;
+                        totalDrawn += drawn;
+                        ranges.push_back({ seg.first, drawn, shell });
+                    }
+                }
+                if (splats && totalDrawn > CLOUD_SPLAT_MAX_POINTS)
+                {
+                    const double keep = static_cast<double>(CLOUD_SPLAT_MAX_POINTS) / totalDrawn;
+                    for (CloudDrawRange& r : ranges)
+                        r.count = std::max<GLsizei>(1, static_cast<GLsizei>(r.count * keep));
+                }
+                for (const CloudDrawRange& r : ranges)
+                    shellDrawn[r.shell] += r.count;
+                for (int shell = 0; shell < activeShells && shell < MAX_SHELLS; ++shell)
+                {
+                    gCullStats.drawnPoints += shellDrawn[shell];
+                    if (!shellDrawn[shell]) continue;
+                    const double thinning = static_cast<double>(shellFilled[shell]) / shellDrawn[shell];
+                    drawnFraction[shell] = static_cast<float>(1.0 / thinning);
+                    alphaScale[shell] = std::min(CLOUD_MAX_ALPHA_SCALE, static_cast<float>(std::sqrt(thinning)));
+                }
+                if (gCoreProfile)
+                    bindVertexArray(gCloudVao);
+                glBindBuffer(GL_ARRAY_BUFFER, cloud.vbo);
+                for (int a = 0; a < 3; ++a)
+                {
+                    glEnableVertexAttribArray(a);
+                    glVertexAttribPointer(a, 1, GL_SHORT, GL_TRUE, 0,
+                        reinterpret_cast<const void*>(a * cloud.capacity * sizeof(int16_t)));
+                }
+                const bool sorted = blend == CloudBlend::Sorted && cloud.store && pullCloudSortResult(cloud);
+                if (splats || sorted)
+                {
+                    bindCloudPointAttrib(CLOUD_SHELL_ATTRIB, cloud.shellVbo, cloud, buildCloudShellVbo);
+                    if (splats)
+                    {
+                        bindCloudPointAttrib(CLOUD_DENSITY_ATTRIB, cloud.densityVbo, cloud, buildCloudDensityVbo);
+                        beginCloudSplats(splatProgram, oit ? gCloudSplatOitUniforms : gCloudSplatUniforms,
+                            cloud, modelView, alphaScale, drawnFraction);
+                    }
+                    else
+                    {
+                        useProgram(gCloudSortedProgram);
+                        applyModelUniform();
+                        glUniform1fv(gCloudSortedUniforms.shellScale, MAX_SHELLS, cloud.shellScale);
+                        glUniform1fv(gCloudSortedUniforms.alphaScale, MAX_SHELLS, alphaScale);
+                    }
+                    drawCloudPoints(ranges, sorted);
+                    if (splats)
+                    {
+                        endCloudSplats();
+                        glDisableVertexAttribArray(CLOUD_DENSITY_ATTRIB);
+                    }
+                    glDisableVertexAttribArray(CLOUD_SHELL_ATTRIB);
+                }
+                else
+                {
+                    drawCloudShells(oit ? gCloudOitProgram : gCloudProgram, oit ? gCloudOitUniforms : gCloudUniforms,
+                        cloud, ranges, alphaScale);
+                }
+                if (blend == CloudBlend::Sorted && cloud.store)
+                    submitCloudSort(cloud, ranges, modelView);
+                for (int a = 0; a < 3; ++a)
+                    glDisableVertexAttribArray(a);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+            }
+            else if (!gCloudProgram && cloud.store)
+            {
+                drawCloudFixedFunction(cloud, activeShells);
+            }
+        }
+        popModel();
+        if (oit)
+            resolveCloudOit();
+        setLighting(lighting);
+        useProgram(prevProgram);
+    }
+    popModel();
+}
+
+static void buildVolumeRadialTable(const OrbitalJob& job, float extent, float* table)
+{
+    const int bins = 4096;
+    const double rMax = (4.0 * job.n * job.n + 10.0) / job.zEff;
+    double norm = 0.0;
+    for (int i = 0; i < bins; ++i)
+        norm += radialProbability(job.n, job.l, job.zEff, rMax * (i + 0.5) / bins);
+    norm *= rMax / bins;
+    const double scale = job.sceneScale;
+    const double step = static_cast<double>(extent) / (VOLUME_RADIAL_TABLE - 1);
+    for (int i = 0; i < VOLUME_RADIAL_TABLE; ++i)
+    {
+        const double r = std::max(i, 1) * step;
+        const double atomic = r / scale;
+        table[i] = atomic > rMax || norm <= 0.0 ? 0.f : static_cast<float>(
+            radialProbability(job.n, job.l, job.zEff, atomic) / (norm * scale * 4.0 * PI * r * r));
+    }
+}
+
+static void bakeVolumeGrid(VolumeGrid& grid, int Z, int size)
+{
+    sf::Clock timer;
+    const CloudPlan plan = planOrbitalCloud(Z, static_cast<size_t>(Z), gCloudSeed);
+    const size_t orbitals = plan.orbitals.size();
+    const float extent = std::max(1e-3f, *std::max_element(std::begin(plan.shellScale), std::end(plan.shellScale)));
+    std::vector<float> radial(orbitals * VOLUME_RADIAL_TABLE);
+    std::vector<float> weight(orbitals);
+    std::vector<float> color(orbitals * 3);
+    for (size_t o = 0; o < orbitals; ++o)
+    {
+        const OrbitalJob& job = plan.orbitals[o];
+        buildVolumeRadialTable(job, extent, &radial[o * VOLUME_RADIAL_TABLE]);
+        weight[o] = job.occupancy / angularDensityMean(job.l, job.m);
+        GLfloat shell[4];
+        shellCloudColor(job.n - 1, shell);
+        std::copy(shell, shell + 3, &color[o * 3]);
+    }
+    const int N = size;
+    const float voxel = 2.f * extent / (N - 1);
+    grid.Z = Z;
+    grid.size = N;
+    grid.extent = extent;
+    grid.extinction = VOLUME_OPACITY / Z;
+    grid.voxels.assign(static_cast<size_t>(N) * N * N * 4, 0.f);
+    parallelFor(static_cast<size_t>(N) * N, [&](size_t begin, size_t end)
+    {
+        std::vector<float> scratch(5 * static_cast<size_t>(N));
+        float* x = scratch.data();
+        float* y = x + N;
+        float* z = y + N;
+        float* r = z + N;
+        float* angular = r + N;
+        for (size_t row = begin; row < end; ++row)
+        {
+            const float py = -extent + voxel * static_cast<float>(row % N);
+            const float pz = -extent + voxel * static_cast<float>(row / N);
+            for (int i = 0; i < N; ++i)
+            {
+                const float px = -extent + voxel * i;
+                r[i] = std::sqrt(px * px + py * py + pz * pz);
+                const float inv = r[i] > 0.f ? 1.f / r[i] : 0.f;
+                x[i] = px * inv;
+                y[i] = py * inv;
+                z[i] = pz * inv;
+            }
+            float* out = &grid.voxels[row * N * 4];
+            for (size_t o = 0; o < orbitals; ++o)
+            {
+                const OrbitalJob& job = plan.orbitals[o];
+                const float* table = &radial[o * VOLUME_RADIAL_TABLE];
+                evalAngularDensityBatch(job.l, job.m, x, y, z, angular, N);
+                for (int i = 0; i < N; ++i)
+                {
+                    const float u = r[i] / extent * (VOLUME_RADIAL_TABLE - 1);
+                    if (u >= VOLUME_RADIAL_TABLE - 1) continue;
+                    const int k = static_cast<int>(u);
+                    const float rho = (table[k] + (u - k) * (table[k + 1] - table[k])) * angular[i] * weight[o];
+                    for (int c = 0; c < 3; ++c)
+                        out[i * 4 + c] += color[o * 3 + c] * rho;
+                    out[i * 4 + 3] += rho;
+                }
+            }
+        }
+    }, 8);
+    const float threshold = VOLUME_MIN_TRANSMITTANCE / (2.f * extent * grid.extinction);
+    float radius = NUCLEUS_RADIUS;
+    for (size_t i = 0; i < grid.voxels.size(); i += 4)
+    {
+        if (grid.voxels[i + 3] < threshold) continue;
+        const size_t cell = i / 4;
+        const float px = -extent + voxel * static_cast<float>(cell % N);
+        const float py = -extent + voxel * static_cast<float>(cell / N % N);
+        const float pz = -extent + voxel * static_cast<float>(cell / (N * N));
+        radius = std::max(radius, std::sqrt(px * px + py * py + pz * pz));
+    }
+    grid.radius = std::min(extent, radius + voxel);
+    std::cout << "Wolumen gestosci Z = " << Z << ": " << N << "^3 wokseli, " << orbitals << " orbitali w "
+        << timer.getElapsedTime().asMilliseconds() << " ms\n";
+}
+
+static void setupVolumeFrame(VolumeFrame& f, const Mat4& modelView, int width, int height)
+{
+    const float* m = modelView.m;
+    const float invScale2 = 1.f / (m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+    auto toModel = [m, invScale2](const float (&eye)[3], float* out)
+    {
+        for (int a = 0; a < 3; ++a)
+            out[a] = (m[a * 4] * eye[0] + m[a * 4 + 1] * eye[1] + m[a * 4 + 2] * eye[2]) * invScale2;
+    };
+    const float tanY = std::tan(deg2rad(G.fovDeg * 0.5f));
+    const float tanX = tanY * width / std::max(1, height);
+    toModel({ -m[12], -m[13], -m[14] }, f.origin);
+    toModel({ -tanX, tanY, -1.f }, f.dir00);
+    toModel({ 2.f * tanX / width, 0.f, 0.f }, f.dirDx);
+    toModel({ 0.f, -2.f * tanY / std::max(1, height), 0.f }, f.dirDy);
+    f.width = width;
+    f.height = height;
+    f.tilesX = (width + VOLUME_TILE - 1) / VOLUME_TILE;
+}
+
+static bool volumeRaySpan(const VolumeFrame& f, float radius, float x, float y, float dir[3], float& t0, float& t1)
+{
+    for (int a = 0; a < 3; ++a)
+        dir[a] = f.dir00[a] + x * f.dirDx[a] + y * f.dirDy[a];
+    const float inv = 1.f / std::sqrt(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+    for (int a = 0; a < 3; ++a)
+        dir[a] *= inv;
+    const float b = f.origin[0] * dir[0] + f.origin[1] * dir[1] + f.origin[2] * dir[2];
+    const float oo = f.origin[0] * f.origin[0] + f.origin[1] * f.origin[1] + f.origin[2] * f.origin[2];
+    const float disc = b * b - (oo - radius * radius);
+    if (disc <= 0.f)
+        return false;
+    t0 = std::max(0.f, -b - std::sqrt(disc));
+    t1 = -b + std::sqrt(disc);
+    const float nucleus = b * b - (oo - NUCLEUS_RADIUS * NUCLEUS_RADIUS);
+    if (nucleus > 0.f && -b - std::sqrt(nucleus) > 0.f)
+        t1 = std::min(t1, -b - std::sqrt(nucleus));
+    return t1 > t0;
+}
+
+static uint32_t packVolumePixel(float r, float g, float b, float transmittance)
+{
+    auto channel = [](float v) { return static_cast<uint32_t>(255.f * clampFloat(v, 0.f, 1.f) + 0.5f); };
+    return channel(r) | (channel(g) << 8) | (channel(b) << 16) | (channel(1.f - transmittance) << 24);
+}
+
+#if defined(G3D_SSE2)
+static __m128 expNegative(__m128 x)
+{
+    const __m128 t = _mm_mul_ps(_mm_max_ps(x, _mm_set1_ps(-80.f)), _mm_set1_ps(1.44269504f));
+    __m128 whole = _mm_cvtepi32_ps(_mm_cvttps_epi32(t));
+    whole = _mm_sub_ps(whole, _mm_and_ps(_mm_cmpgt_ps(whole, t), _mm_set1_ps(1.f)));
+    const __m128 f = _mm_sub_ps(t, whole);
+    __m128 p = _mm_set1_ps(1.3333558e-3f);
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.6181291e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.5504109e-2f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.4022651e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.9314718e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.f));
+    const __m128i bits = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(whole), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(bits));
+}
+
+static __m128 lerpVoxel(__m128 a, __m128 b, __m128 t)
+{
+    return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), t));
+}
+
+static __m128 sampleVoxelCell(const float* v, size_t SY, size_t SZ, float fx, float fy, float fz)
+{
+    constexpr size_t SX = 4;
+    const __m128 tx = _mm_set1_ps(fx), ty = _mm_set1_ps(fy);
+    const __m128 c00 = lerpVoxel(_mm_loadu_ps(v), _mm_loadu_ps(v + SX), tx);
+    const __m128 c10 = lerpVoxel(_mm_loadu_ps(v + SY), _mm_loadu_ps(v + SY + SX), tx);
+    const __m128 c01 = lerpVoxel(_mm_loadu_ps(v + SZ), _mm_loadu_ps(v + SZ + SX), tx);
+    const __m128 c11 = lerpVoxel(_mm_loadu_ps(v + SZ + SY), _mm_loadu_ps(v + SZ + SY + SX), tx);
+    return lerpVoxel(lerpVoxel(c00, c10, ty), lerpVoxel(c01, c11, ty), _mm_set1_ps(fz));
+}
+
+static void marchVolumePacket(const VolumeGrid& grid, const VolumeFrame& f, int px, int py, uint32_t out[4])
+{
+    const int N = grid.size;
+    const float gridScale = (N - 1) / (2.f * grid.extent);
+    const float gridCenter = 0.5f * (N - 1);
+    const float step = VOLUME_STEP_VOXELS / gridScale;
+    alignas(16) float o[3][4], d[3][4], t0[4], t1[4];
+    for (int k = 0; k < 4; ++k)
+    {
+        const int x = px + (k & 1), y = py + (k >> 1);
+        float dir[3];
+        if (!volumeRaySpan(f, grid.radius, x + 0.5f, y + 0.5f, dir, t0[k], t1[k]))
+            t0[k] = t1[k] = 0.f;
+        else
+            t0[k] += step * bitsToUnit(static_cast<uint32_t>(splitMix64((static_cast<uint64_t>(y) << 32) | x)));
+        for (int a = 0; a < 3; ++a)
+        {
+            o[a][k] = f.origin[a] * gridScale + gridCenter;
+            d[a][k] = dir[a] * gridScale;
+        }
+    }
+    const __m128 vStep = _mm_set1_ps(step);
+    const __m128 vDepth = _mm_set1_ps(step * grid.extinction);
+    const size_t SY = 4 * static_cast<size_t>(N), SZ = SY * N;
+    const __m128 vMax = _mm_set1_ps(N - 1.001f);
+    const __m128 vZero = _mm_setzero_ps();
+    const __m128 vOne = _mm_set1_ps(1.f);
+    const __m128 vMinT = _mm_set1_ps(VOLUME_MIN_TRANSMITTANCE);
+    const __m128 vEnd = _mm_load_ps(t1);
+    __m128 t = _mm_load_ps(t0);
+    __m128 transmittance = vOne;
+    __m128 r = vZero, g = vZero, b = vZero;
+    __m128 active = _mm_cmplt_ps(t, vEnd);
+    const float* voxels = grid.voxels.data();
+    while (int lanes = _mm_movemask_ps(active))
+    {
+        alignas(16) float frac[3][4];
+        alignas(16) int32_t cell[3][4];
+        for (int a = 0; a < 3; ++a)
+        {
+            const __m128 pos = _mm_min_ps(vMax, _mm_max_ps(vZero,
+                _mm_add_ps(_mm_load_ps(o[a]), _mm_mul_ps(_mm_load_ps(d[a]), t))));
+            const __m128i whole = _mm_cvttps_epi32(pos);
+            _mm_store_si128(reinterpret_cast<__m128i*>(cell[a]), whole);
+            _mm_store_ps(frac[a], _mm_sub_ps(pos, _mm_cvtepi32_ps(whole)));
+        }
+        __m128 s[4];
+        for (int k = 0; k < 4; ++k)
+        {
+            if (!(lanes & (1 << k)))
+            {
+                s[k] = vZero;
+                continue;
+            }
+            const size_t index = (static_cast<size_t>(cell[2][k]) * N + cell[1][k]) * N + cell[0][k];
+            s[k] = sampleVoxelCell(voxels + index * 4, SY, SZ, frac[0][k], frac[1][k], frac[2][k]);
+        }
+        _MM_TRANSPOSE4_PS(s[0], s[1], s[2], s[3]);
+        const __m128 alpha = _mm_sub_ps(vOne, expNegative(_mm_sub_ps(vZero, _mm_mul_ps(s[3], vDepth))));
+        const __m128 w = _mm_div_ps(_mm_mul_ps(transmittance, alpha), _mm_max_ps(s[3], _mm_set1_ps(1e-12f)));
+        r = _mm_add_ps(r, _mm_mul_ps(w, s[0]));
+        g = _mm_add_ps(g, _mm_mul_ps(w, s[1]));
+        b = _mm_add_ps(b, _mm_mul_ps(w, s[2]));
+        transmittance = _mm_sub_ps(transmittance, _mm_mul_ps(transmittance, alpha));
+        t = _mm_add_ps(t, vStep);
+        active = _mm_and_ps(_mm_cmplt_ps(t, vEnd), _mm_cmpgt_ps(transmittance, vMinT));
+    }
+    alignas(16) float rgbt[4][4];
+    _mm_store_ps(rgbt[0], r);
+    _mm_store_ps(rgbt[1], g);
+    _mm_store_ps(rgbt[2], b);
+    _mm_store_ps(rgbt[3], transmittance);
+    for (int k = 0; k < 4; ++k)
+        out[k] = packVolumePixel(rgbt[0][k], rgbt[1][k], rgbt[2][k], rgbt[3][k]);
+}
+#else
+static uint32_t marchVolumeRay(const VolumeGrid& grid, const VolumeFrame& f, int x, int y)
+{
+    const int N = grid.size;
+    const float gridScale = (N - 1) / (2.f * grid.extent);
+    const float gridCenter = 0.5f * (N - 1);
+    const float step = VOLUME_STEP_VOXELS / gridScale;
+    float dir[3], t, tEnd;
+    if (!volumeRaySpan(f, grid.radius, x + 0.5f, y + 0.5f, dir, t, tEnd))
+        return 0;
+    t += step * bitsToUnit(static_cast<uint32_t>(splitMix64((static_cast<uint64_t>(y) << 32) | x)));
+    float rgb[3] = {}, transmittance = 1.f;
+    for (; t < tEnd && transmittance > VOLUME_MIN_TRANSMITTANCE; t += step)
+    {
+        int cell[3];
+        float frac[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            const float pos = clampFloat((f.origin[a] + dir[a] * t) * gridScale + gridCenter, 0.f, N - 1.001f);
+            cell[a] = static_cast<int>(pos);
+            frac[a] = pos - cell[a];
+        }
+        const float* v = &grid.voxels[((static_cast<size_t>(cell[2]) * N + cell[1]) * N + cell[0]) * 4];
+        float s[4];
+        for (int c = 0; c < 4; ++c)
+        {
+            auto at = [v, c, N](int dx, int dy, int dz) { return v[((dz * N + dy) * N + dx) * 4 + c]; };
+            const float c00 = at(0, 0, 0) + frac[0] * (at(1, 0, 0) - at(0, 0, 0));
+            const float c10 = at(0, 1, 0) + frac[0] * (at(1, 1, 0) - at(0, 1, 0));
+            const float c01 = at(0, 0, 1) + frac[0] * (at(1, 0, 1) - at(0, 0, 1));
+            const float c11 = at(0, 1, 1) + frac[0] * (at(1, 1, 1) - at(0, 1, 1));
+            const float c0 = c00 + frac[1] * (c10 - c00);
+            s[c] = c0 + frac[2] * (c01 + frac[1] * (c11 - c01) - c0);
+        }
+        const float alpha = 1.f - std::exp(-s[3] * step * grid.extinction);
+        const float w = transmittance * alpha / std::max(s[3], 1e-12f);
+        for (int c = 0; c < 3; ++c)
+            rgb[c] += w * s[c];
+        transmittance -= transmittance * alpha;
+    }
+    return packVolumePixel(rgb[0], rgb[1], rgb[2], transmittance);
+}
+
+static void marchVolumePacket(const VolumeGrid& grid, const VolumeFrame& f, int px, int py, uint32_t out[4])
+{
+    for (int k = 0; k < 4; ++k)
+        out[k] = marchVolumeRay(grid, f, px + (k & 1), py + (k >> 1));
+}
+#endif
+
+static void renderVolumeTile(const VolumeGrid& grid, const VolumeFrame& f, uint32_t tile)
+{
+    const int x0 = static_cast<int>(tile % f.tilesX) * VOLUME_TILE;
+    const int y0 = static_cast<int>(tile / f.tilesX) * VOLUME_TILE;
+    const int x1 = std::min(x0 + VOLUME_TILE, f.width);
+    const int y1 = std::min(y0 + VOLUME_TILE, f.height);
+    for (int y = y0; y < y1; y += 2)
+    {
+        for (int x = x0; x < x1; x += 2)
+        {
+            uint32_t packet[4];
+            marchVolumePacket(grid, f, x, y, packet);
+            for (int k = 0; k < 4; ++k)
+            {
+                const int qx = x + (k & 1), qy = y + (k >> 1);
+                if (qx < x1 && qy < y1)
+                    f.pixels[static_cast<size_t>(qy) * f.width + qx] = packet[k];
+            }
+        }
+    }
+}
+
+static bool takeVolumeTile(VolumeTileQueue& queue, bool steal, uint32_t& tile)
+{
+    uint64_t range = queue.range.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        const uint32_t begin = static_cast<uint32_t>(range >> 32);
+        const uint32_t end = static_cast<uint32_t>(range);
+        if (begin >= end)
+            return false;
+        const uint64_t next = steal ? range - 1 : range + (uint64_t(1) << 32);
+        if (queue.range.compare_exchange_weak(range, next, std::memory_order_acq_rel, std::memory_order_relaxed))
+        {
+            tile = steal ? end - 1 : begin;
+            return true;
+        }
+    }
+}
+
+static void runVolumeTiles(unsigned self)
+{
+    VolumeRenderer& v = gVolume;
+    uint32_t tile;
+    for (;;)
+    {
+        if (takeVolumeTile(v.queues[self], false, tile))
+        {
+            renderVolumeTile(v.grid, v.frame, tile);
+            continue;
+        }
+        bool stolen = false;
+        for (unsigned k = 1; k < v.workers && !stolen; ++k)
+            stolen = takeVolumeTile(v.queues[(self + k) % v.workers], true, tile);
+        if (!stolen)
+            return;
+        renderVolumeTile(v.grid, v.frame, tile);
+    }
+}
+
+static void volumeWorkerLoop(unsigned self)
+{
+    VolumeRenderer& v = gVolume;
+    uint64_t seen = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(v.mutex);
+            v.wake.wait(lock, [&v, &seen, self]() { return v.quit || (v.generation != seen && self < v.workers); });
+            if (v.quit) return;
+            seen = v.generation;
+        }
+        runVolumeTiles(self);
+        std::lock_guard<std::mutex> lock(v.mutex);
+        if (--v.running == 0)
+            v.done.notify_one();
+    }
+}
+
+static void startVolumeRenderer()
+{
+    VolumeRenderer& v = gVolume;
+    const unsigned threads = gVolumeThreads ? gVolumeThreads : std::max(1u, std::thread::hardware_concurrency());
+    v.quit = false;
+    v.queues.reset(new VolumeTileQueue[threads]);
+    for (unsigned t = 1; t < threads; ++t)
+        v.threads.emplace_back(volumeWorkerLoop, t);
+}
+
+static void stopVolumeRenderer()
+{
+    VolumeRenderer& v = gVolume;
+    if (v.bakeThread.joinable())
+        v.bakeThread.join();
+    {
+        std::lock_guard<std::mutex> lock(v.mutex);
+        v.quit = true;
+    }
+    v.wake.notify_all();
+    for (std::thread& th : v.threads)
+        th.join();
+    v.threads.clear();
+    v.queues.reset();
+    if (v.texture) glDeleteTextures(1, &v.texture);
+    if (v.pbo) glDeleteBuffers(1, &v.pbo);
+    v.texture = 0;
+    v.pbo = 0;
+    v.texWidth = v.texHeight = 0;
+    v.grid = VolumeGrid();
+    v.baked = VolumeGrid();
+    v.pixels.clear();
+}
+
+static void pumpVolumeBake()
+{
+    VolumeRenderer& v = gVolume;
+    if (!v.bakeThread.joinable() || !v.bakeReady.load(std::memory_order_acquire))
+        return;
+    v.bakeThread.join();
+    std::swap(v.grid, v.baked);
+}
+
+static void requestVolumeBake(int Z)
+{
+    VolumeRenderer& v = gVolume;
+    pumpVolumeBake();
+    if (v.bakeThread.joinable() || v.grid.Z == Z)
+        return;
+    v.bakeReady.store(false, std::memory_order_relaxed);
+    v.bakeThread = std::thread([&v, Z]()
+    {
+        bakeVolumeGrid(v.baked, Z, VOLUME_GRID);
+        v.bakeReady.store(true, std::memory_order_release);
+    });
+}
+
+static bool volumeBakePending()
+{
+    return gVolume.bakeThread.joinable();
+}
+
+static void finishVolumeBake(int Z)
+{
+    requestVolumeBake(Z);
+    while (gVolume.grid.Z != Z)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        requestVolumeBake(Z);
+    }
+}
+
+static unsigned volumeThreadCount()
+{
+    return static_cast<unsigned>(gVolume.threads.size()) + 1;
+}
+
+static void renderVolumeImage(const Mat4& modelView, int width, int height, unsigned workers)
+{
+    VolumeRenderer& v = gVolume;
+    sf::Clock timer;
+    v.pixels.resize(static_cast<size_t>(width) * height);
+    setupVolumeFrame(v.frame, modelView, width, height);
+    v.frame.pixels = v.pixels.data();
+    const uint64_t tiles = static_cast<uint64_t>(v.frame.tilesX) * ((height + VOLUME_TILE - 1) / VOLUME_TILE);
+    const unsigned count = std::max(1u, std::min(workers, volumeThreadCount()));
+    for (unsigned w = 0; w < count; ++w)
+        v.queues[w].range.store((tiles * w / count) << 32 | (tiles * (w + 1) / count), std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(v.mutex);
+        v.workers = count;
+        v.running = count - 1;
+        ++v.generation;
+    }
+    v.wake.notify_all();
+    runVolumeTiles(0);
+    {
+        std::unique_lock<std::mutex> lock(v.mutex);
+        v.done.wait(lock, [&v]() { return v.running == 0; });
+    }
+    v.renderMs = timer.getElapsedTime().asMicroseconds() / 1000.0;
+}
+
+static void uploadVolumeImage(int width, int height)
+{
+    VolumeRenderer& v = gVolume;
+    if (!v.texture)
+    {
+        glGenTextures(1, &v.texture);
+        glBindTexture(GL_TEXTURE_2D, v.texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    else
+        glBindTexture(GL_TEXTURE_2D, v.texture);
+    if (!v.pbo) glGenBuffers(1, &v.pbo);
+    const size_t bytes = v.pixels.size() * sizeof(uint32_t);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, v.pbo);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+    uploadBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, v.pixels.data());
+    if (v.texWidth != width || v.texHeight != height)
+    {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        v.texWidth = width;
+        v.texHeight = height;
+    }
+    else
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+static void drawAtomVolume()
+{
+    setColor(1.0f, 0.3f, 0.3f);
+    drawMesh(sphereLodMesh(NUCLEUS_RADIUS, sphereLodAt(currentModelView(), NUCLEUS_RADIUS)));
+    const ElementInfo* el = getCurrentElement();
+    const int Z = el ? el->Z : 1;
+    requestVolumeBake(Z);
+    pushModel();
+    rotateCloudModel();
+    gVolume.modelView = currentModelView();
+    popModel();
+    if (gVolume.grid.Z != Z)
+        return;
+    const GLint* viewport = currentViewport();
+    const int width = std::max(1, static_cast<int>(viewport[2]));
+    const int height = std::max(1, static_cast<int>(viewport[3]));
+    renderVolumeImage(gVolume.modelView, width, height, volumeThreadCount());
+    uploadVolumeImage(width, height);
+    setBlending(true);
+    setBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    setDepthTest(false);
+    drawScreenTexture(gVolume.texture);
+    setDepthTest(true);
+    setBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+static MarchingCubesTable buildMarchingCubesTable()
+{
+    MarchingCubesTable t = {};
+    int edgeOf[8][8] = {};
+    int edges = 0;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        for (int a = 0; a < 8; ++a)
+        {
+            if (a >> axis & 1) continue;
+            t.edgeCorner[edges] = static_cast<int8_t>(a);
+            t.edgeAxis[edges] = static_cast<int8_t>(axis);
+            edgeOf[a][a | 1 << axis] = edgeOf[a | 1 << axis][a] = edges++;
+        }
+    }
+    int faces[6][4];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const int u = 1 << (axis + 1) % 3, v = 1 << (axis + 2) % 3;
+        for (int side = 0; side < 2; ++side)
+        {
+            int* f = faces[axis * 2 + side];
+            f[0] = side << axis;
+            f[1] = f[0] | (side ? u : v);
+            f[2] = f[0] | u | v;
+            f[3] = f[0] | (side ? v : u);
+        }
+    }
+    for (int mask = 0; mask < 256; ++mask)
+    {
+        auto inside = [mask](int corner) { return (mask >> corner & 1) != 0; };
+        int next[12];
+        std::fill(next, next + 12, -1);
+        for (const int* f : faces)
+        {
+            for (int k = 0; k < 4; ++k)
+            {
+                if (!inside(f[k]) || inside(f[(k + 1) % 4])) continue;
+                int j = (k + 3) % 4;
+                while (inside(f[j]) || !inside(f[(j + 1) % 4]))
+                    j = (j + 3) % 4;
+                next[edgeOf[f[k]][f[(k + 1) % 4]]] = edgeOf[f[j]][f[(j + 1) % 4]];
+            }
+        }
+        int count = 0;
+        bool visited[12] = {};
+        for (int start = 0; start < 12; ++start)
+        {
+            if (next[start] < 0 || visited[start]) continue;
+            int loop[12], length = 0;
+            for (int e = start; !visited[e]; e = next[e])
+            {
+                visited[e] = true;
+                loop[length++] = e;
+            }
+            for (int k = 1; k + 1 < length; ++k)
+            {
+                t.triangles[mask][count++] = static_cast<int8_t>(loop[0]);
+                t.triangles[mask][count++] = static_cast<int8_t>(loop[k + 1]);
+                t.triangles[mask][count++] = static_cast<int8_t>(loop[k]);
+            }
+        }
+        t.triangles[mask][count] = -1;
+    }
+    return t;
+}
+
+static const MarchingCubesTable& marchingCubesTable()
+{
+    static const MarchingCubesTable table = buildMarchingCubesTable();
+    return table;
+}
+
+static float isoDensity(int level)
+{
+    return std::pow(10.f, static_cast<float>(level) / ISO_LEVELS_PER_DECADE);
+}
+
+static void buildIsoPyramid(IsoField& field)
+{
+    const int size = field.grid.size;
+    const int cells = size - 1;
+    const int n = (cells + ISO_BRICK - 1) / ISO_BRICK;
+    const float* voxels = field.grid.voxels.data();
+    field.bricks = n;
+    field.levelSize.assign(1, n);
+    field.pyramid.assign(1, std::vector<float>(static_cast<size_t>(n) * n * n * 2));
+    float* bounds = field.pyramid[0].data();
+    parallelFor(static_cast<size_t>(n) * n * n, [&](size_t begin, size_t end)
+    {
+        for (size_t brick = begin; brick < end; ++brick)
+        {
+            const int x0 = static_cast<int>(brick % n) * ISO_BRICK;
+            const int y0 = static_cast<int>(brick / n % n) * ISO_BRICK;
+            const int z0 = static_cast<int>(brick / (static_cast<size_t>(n) * n)) * ISO_BRICK;
+            float lo = std::numeric_limits<float>::max(), hi = -lo;
+            for (int z = z0; z <= std::min(z0 + ISO_BRICK, cells); ++z)
+                for (int y = y0; y <= std::min(y0 + ISO_BRICK, cells); ++y)
+                    for (int x = x0; x <= std::min(x0 + ISO_BRICK, cells); ++x)
+                    {
+                        const float d = voxels[((static_cast<size_t>(z) * size + y) * size + x) * 4 + 3];
+                        lo = std::min(lo, d);
+                        hi = std::max(hi, d);
+                    }
+            bounds[brick * 2] = lo;
+            bounds[brick * 2 + 1] = hi;
+        }
+    }, 4);
+    while (field.levelSize.back() > 1)
+    {
+        const int below = field.levelSize.back();
+        const int m = (below + 1) / 2;
+        const std::vector<float>& child = field.pyramid.back();
+        std::vector<float> level(static_cast<size_t>(m) * m * m * 2);
+        for (int z = 0; z < m; ++z)
+            for (int y = 0; y < m; ++y)
+                for (int x = 0; x < m; ++x)
+                {
+                    float lo = std::numeric_limits<float>::max(), hi = -lo;
+                    for (int c = 0; c < 8; ++c)
+                    {
+                        const int cx = 2 * x + (c & 1), cy = 2 * y + (c >> 1 & 1), cz = 2 * z + (c >> 2);
+                        if (cx >= below || cy >= below || cz >= below) continue;
+                        const size_t k = ((static_cast<size_t>(cz) * below + cy) * below + cx) * 2;
+                        lo = std::min(lo, child[k]);
+                        hi = std::max(hi, child[k + 1]);
+                    }
+                    const size_t k = ((static_cast<size_t>(z) * m + y) * m + x) * 2;
+                    level[k] = lo;
+                    level[k + 1] = hi;
+                }
+        field.pyramid.push_back(std::move(level));
+        field.levelSize.push_back(m);
+    }
+}
+
+static void buildIsoField(IsoField& field, int Z, int size)
+{
+    bakeVolumeGrid(field.grid, Z, size);
+    buildIsoPyramid(field);
+}
+
+static void collectIsoBricks(const IsoField& field, int level, int x, int y, int z, float iso, std::vector<uint32_t>& out)
+{
+    const int n = field.levelSize[level];
+    const size_t node = (static_cast<size_t>(z) * n + y) * n + x;
+    const float* bounds = &field.pyramid[level][node * 2];
+    if (!(bounds[0] < iso && bounds[1] >= iso))
+        return;
+    if (level == 0)
+    {
+        out.push_back(static_cast<uint32_t>(node));
+        return;
+    }
+    const int below = field.levelSize[level - 1];
+    for (int c = 0; c < 8; ++c)
+    {
+        const int cx = 2 * x + (c & 1), cy = 2 * y + (c >> 1 & 1), cz = 2 * z + (c >> 2);
+        if (cx < below && cy < below && cz < below)
+            collectIsoBricks(field, level - 1, cx, cy, cz, iso, out);
+    }
+}
+
+static void isoGradient(const VolumeGrid& grid, const int p[3], float g[3])
+{
+    const int N = grid.size;
+    for (int a = 0; a < 3; ++a)
+    {
+        int lo[3] = { p[0], p[1], p[2] }, hi[3] = { p[0], p[1], p[2] };
+        lo[a] = std::max(p[a] - 1, 0);
+        hi[a] = std::min(p[a] + 1, N - 1);
+        auto density = [&grid, N](const int (&q)[3])
+        {
+            return grid.voxels[((static_cast<size_t>(q[2]) * N + q[1]) * N + q[0]) * 4 + 3];
+        };
+        g[a] = (density(hi) - density(lo)) / (hi[a] - lo[a]);
+    }
+}
+
+static void extractIsoBrick(const IsoField& field, const MarchingCubesTable& table, float iso, uint32_t brick,
+    IsoBrickMesh& out)
+{
+    constexpr int S = ISO_BRICK + 1;
+    const VolumeGrid& grid = field.grid;
+    const int N = grid.size;
+    const int n = field.bricks;
+    const int lo[3] = { static_cast<int>(brick % n) * ISO_BRICK, static_cast<int>(brick / n % n) * ISO_BRICK,
+        static_cast<int>(brick / (static_cast<uint32_t>(n) * n)) * ISO_BRICK };
+    const int hi[3] = { std::min(lo[0] + ISO_BRICK, N - 1), std::min(lo[1] + ISO_BRICK, N - 1),
+        std::min(lo[2] + ISO_BRICK, N - 1) };
+    const float voxel = 2.f * grid.extent / (N - 1);
+    const float* voxels = grid.voxels.data();
+    int32_t slots[S * S * S * 3];
+    std::fill(std::begin(slots), std::end(slots), -1);
+    out.vertices.clear();
+    out.indices.clear();
+    out.seams.clear();
+    auto vertexAt = [&](const int (&p)[3], int axis) -> uint32_t
+    {
+        int32_t& slot = slots[(((p[2] - lo[2]) * S + (p[1] - lo[1])) * S + (p[0] - lo[0])) * 3 + axis];
+        if (slot >= 0)
+            return static_cast<uint32_t>(slot);
+        int q[3] = { p[0], p[1], p[2] };
+        ++q[axis];
+        const size_t index = (static_cast<size_t>(p[2]) * N + p[1]) * N + p[0];
+        const float* a = &voxels[index * 4];
+        const float* b = &voxels[((static_cast<size_t>(q[2]) * N + q[1]) * N + q[0]) * 4];
+        const float t = (iso - a[3]) / (b[3] - a[3]);
+        float ga[3], gb[3], normal[3];
+        isoGradient(grid, p, ga);
+        isoGradient(grid, q, gb);
+        for (int c = 0; c < 3; ++c)
+            normal[c] = -(ga[c] + t * (gb[c] - ga[c]));
+        const float len = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        const float inv = len > 0.f ? 1.f / len : 0.f;
+        slot = static_cast<int32_t>(out.vertices.size() / ISO_VERTEX_FLOATS);
+        for (int c = 0; c < 3; ++c)
+            out.vertices.push_back(-grid.extent + voxel * (p[c] + (c == axis ? t : 0.f)));
+        for (int c = 0; c < 3; ++c)
+            out.vertices.push_back(normal[c] * inv);
+        for (int c = 0; c < 3; ++c)
+            out.vertices.push_back(std::min(1.f, (a[c] + t * (b[c] - a[c])) / iso));
+        for (int c = 0; c < 3; ++c)
+        {
+            if (c != axis && (p[c] == lo[c] || p[c] == hi[c]))
+            {
+                out.seams.emplace_back(index * 3 + axis, static_cast<uint32_t>(slot));
+                break;
+            }
+        }
+        return static_cast<uint32_t>(slot);
+    };
+    for (int z = lo[2]; z < hi[2]; ++z)
+        for (int y = lo[1]; y < hi[1]; ++y)
+            for (int x = lo[0]; x < hi[0]; ++x)
+            {
+                int mask = 0;
+                for (int c = 0; c < 8; ++c)
+                {
+                    const size_t k = (static_cast<size_t>(z + (c >> 2)) * N + y + (c >> 1 & 1)) * N + x + (c & 1);
+                    if (voxels[k * 4 + 3] >= iso)
+                        mask |= 1 << c;
+                }
+                if (mask == 0 || mask == 255) continue;
+                for (const int8_t* e = table.triangles[mask]; *e >= 0; ++e)
+                {
+                    const int corner = table.edgeCorner[*e];
+                    const int p[3] = { x + (corner & 1), y + (corner >> 1 & 1), z + (corner >> 2) };
+                    out.indices.push_back(vertexAt(p, table.edgeAxis[*e]));
+                }
+            }
+}
+
+static void mergeIsoBricks(IsoScratch& c)
+{
+    size_t vertexFloats = 0, indexCount = 0, seamCount = 0;
+    for (size_t i = 0; i < c.active.size(); ++i)
+    {
+        vertexFloats += c.bricks[i].vertices.size();
+        indexCount += c.bricks[i].indices.size();
+        seamCount += c.bricks[i].seams.size();
+    }
+    c.vertices.clear();
+    c.indices.clear();
+    c.vertices.reserve(vertexFloats);
+    c.indices.reserve(indexCount);
+    size_t tableSize = 16;
+    while (tableSize < seamCount * 2)
+        tableSize *= 2;
+    if (c.seamKeys.size() < tableSize)
+    {
+        c.seamKeys.resize(tableSize);
+        c.seamSlots.resize(tableSize);
+    }
+    std::fill(c.seamKeys.begin(), c.seamKeys.begin() + tableSize, ISO_SEAM_EMPTY);
+    const size_t mask = tableSize - 1;
+    for (size_t i = 0; i < c.active.size(); ++i)
+    {
+        const IsoBrickMesh& b = c.bricks[i];
+        const uint32_t count = static_cast<uint32_t>(b.vertices.size() / ISO_VERTEX_FLOATS);
+        auto append = [&c, &b](uint32_t local)
+        {
+            const uint32_t index = static_cast<uint32_t>(c.vertices.size() / ISO_VERTEX_FLOATS);
+            const auto first = b.vertices.begin() + static_cast<size_t>(local) * ISO_VERTEX_FLOATS;
+            c.vertices.insert(c.vertices.end(), first, first + ISO_VERTEX_FLOATS);
+            return index;
+        };
+        c.remap.assign(count, UINT32_MAX);
+        for (const auto& seam : b.seams)
+        {
+            size_t h = static_cast<size_t>((seam.first * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+            while (c.seamKeys[h] != ISO_SEAM_EMPTY && c.seamKeys[h] != seam.first)
+                h = (h + 1) & mask;
+            if (c.seamKeys[h] == ISO_SEAM_EMPTY)
+            {
+                c.seamKeys[h] = seam.first;
+                c.seamSlots[h] = append(seam.second);
+            }
+            c.remap[seam.second] = c.seamSlots[h];
+        }
+        for (uint32_t k = 0; k < count; ++k)
+            if (c.remap[k] == UINT32_MAX)
+                c.remap[k] = append(k);
+        for (uint32_t index : b.indices)
+            c.indices.push_back(c.remap[index]);
+    }
+}
+
+static void extractIsoSurface(const IsoField& field, float iso, IsoScratch& s)
+{
+    const MarchingCubesTable& table = marchingCubesTable();
+    const int top = static_cast<int>(field.levelSize.size()) - 1;
+    s.active.clear();
+    collectIsoBricks(field, top, 0, 0, 0, iso, s.active);
+    if (s.bricks.size() < s.active.size())
+        s.bricks.resize(s.active.size());
+    parallelFor(s.active.size(), [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+            extractIsoBrick(field, table, iso, s.active[i], s.bricks[i]);
+    }, 4);
+    mergeIsoBricks(s);
+}
+
+static IsoEntry buildIsoEntry(IsoCache& c, int level)
+{
+    sf::Clock timer;
+    const float iso = isoDensity(level);
+    const IsoScratch& s = c.scratch;
+    extractIsoSurface(c.field, iso, c.scratch);
+    IsoEntry entry;
+    entry.mesh = uploadMesh(GL_TRIANGLES, s.vertices, ISO_VERTEX_FLOATS, s.indices.data(), s.indices.size(),
+        GL_UNSIGNED_INT);
+    entry.mesh.normalOffset = 3 * sizeof(float);
+    entry.mesh.colorOffset = 6 * sizeof(float);
+    if (gCoreProfile)
+        buildMeshVao(entry.mesh);
+    entry.triangles = s.indices.size() / 3;
+    entry.bytes = s.vertices.size() * sizeof(float) + s.indices.size() * sizeof(uint32_t);
+    entry.buildMs = timer.getElapsedTime().asMicroseconds() / 1000.0;
+    const size_t bricks = static_cast<size_t>(c.field.bricks) * c.field.bricks * c.field.bricks;
+    std::cout << "Izopowierzchnia Z = " << c.field.grid.Z << ", gestosc " << iso << ": " << entry.triangles
+        << " trojkatow, " << s.active.size() << "/" << bricks << " blokow w " << entry.buildMs << " ms\n";
+    return entry;
+}
+
+static const IsoEntry& isoMesh(int Z, int level, int size)
+{
+    IsoCache& c = gIso;
+    const IsoKey key{ Z, level, size };
+    auto it = c.meshes.find(key);
+    if (it != c.meshes.end())
+    {
+        ++c.hits;
+        c.lru.splice(c.lru.begin(), c.lru, it->second.lru);
+        return it->second;
+    }
+    ++c.misses;
+    if (c.field.grid.Z != Z || c.field.grid.size != size)
+        buildIsoField(c.field, Z, size);
+    IsoEntry& entry = c.meshes.emplace(key, buildIsoEntry(c, level)).first->second;
+    entry.lru = c.lru.insert(c.lru.begin(), key);
+    c.bytes += entry.bytes;
+    while (c.bytes > ISO_CACHE_BYTES && c.lru.size() > 1)
+    {
+        auto victim = c.meshes.find(c.lru.back());
+        c.bytes -= victim->second.bytes;
+        freeMesh(victim->second.mesh);
+        c.meshes.erase(victim);
+        c.lru.pop_back();
+    }
+    return entry;
+}
+
+static void freeIsoMeshes()
+{
+    IsoCache& c = gIso;
+    for (auto& entry : c.meshes)
+        freeMesh(entry.second.mesh);
+    c = IsoCache();
+}
+
+static int nextIsoGridSize(int size)
+{
+    for (int candidate : ISO_GRID_SIZES)
+        if (candidate > size)
+            return candidate;
+    return ISO_GRID_SIZES[0];
+}
+
+static void drawAtomIsosurface()
+{
+    setColor(1.0f, 0.3f, 0.3f);
+    drawMesh(sphereLodMesh(NUCLEUS_RADIUS, sphereLodAt(currentModelView(), NUCLEUS_RADIUS)));
+    const ElementInfo* el = getCurrentElement();
+    const IsoEntry& entry = isoMesh(el ? el->Z : 1, G.isoLevel, gIsoGridSize);
+    if (!entry.mesh.indexCount)
+        return;
+    pushModel();
+    rotateCloudModel();
+    drawMesh(entry.mesh);
+    popModel();
+}
+
+static void buildWaveFftPlan(WaveFftPlan& plan, int n)
+{
+    int bits = 0;
+    while ((1 << bits) < n)
+        ++bits;
+    plan.size = n;
+    plan.cosTable.resize(n / 2);
+    plan.sinTable.resize(n / 2);
+    for (int k = 0; k < n / 2; ++k)
+    {
+        const double angle = 2.0 * PI * k / n;
+        plan.cosTable[k] = static_cast<float>(std::cos(angle));
+        plan.sinTable[k] = static_cast<float>(std::sin(angle));
+    }
+    plan.bitReverse.resize(n);
+    for (int i = 0; i < n; ++i)
+    {
+        uint32_t r = 0;
+        for (int b = 0; b < bits; ++b)
+            if (i >> b & 1)
+                r |= 1u << (bits - 1 - b);
+        plan.bitReverse[i] = r;
+    }
+}
+
+#if defined(G3D_SSE2)
+static void butterflyWaveLanes(float* ar, float* ai, float* br, float* bi, float wr, float wi)
+{
+    const __m128 vr = _mm_set1_ps(wr), vi = _mm_set1_ps(wi);
+    for (int l = 0; l < WAVE_LANES; l += 4)
+    {
+        const __m128 xr = _mm_loadu_ps(br + l), xi = _mm_loadu_ps(bi + l);
+        const __m128 tr = _mm_sub_ps(_mm_mul_ps(vr, xr), _mm_mul_ps(vi, xi));
+        const __m128 ti = _mm_add_ps(_mm_mul_ps(vr, xi), _mm_mul_ps(vi, xr));
+        const __m128 yr = _mm_loadu_ps(ar + l), yi = _mm_loadu_ps(ai + l);
+        _mm_storeu_ps(br + l, _mm_sub_ps(yr, tr));
+        _mm_storeu_ps(bi + l, _mm_sub_ps(yi, ti));
+        _mm_storeu_ps(ar + l, _mm_add_ps(yr, tr));
+        _mm_storeu_ps(ai + l, _mm_add_ps(yi, ti));
+    }
+}
+#else
+static void butterflyWaveLanes(float* ar, float* ai, float* br, float* bi, float wr, float wi)
+{
+    for (int l = 0; l < WAVE_LANES; ++l)
+    {
+        const float tr = wr * br[l] - wi * bi[l];
+        const float ti = wr * bi[l] + wi * br[l];
+        br[l] = ar[l] - tr;
+        bi[l] = ai[l] - ti;
+        ar[l] += tr;
+        ai[l] += ti;
+    }
+}
+#endif
+
+static void fftWaveLines(const WaveFftPlan& plan, float* re, float* im, bool inverse)
+{
+    constexpr int L = WAVE_LANES;
+    const int n = plan.size;
+    for (int i = 0; i < n; ++i)
+    {
+        const int j = static_cast<int>(plan.bitReverse[i]);
+        if (j <= i) continue;
+        std::swap_ranges(re + i * L, re + i * L + L, re + j * L);
+        std::swap_ranges(im + i * L, im + i * L + L, im + j * L);
+    }
+    const float sign = inverse ? 1.f : -1.f;
+    for (int half = 1; half < n; half <<= 1)
+    {
+        const int stride = n / (2 * half);
+        for (int start = 0; start < n; start += 2 * half)
+        {
+            for (int j = 0; j < half; ++j)
+            {
+                const int a = (start + j) * L, b = a + half * L;
+                butterflyWaveLanes(re + a, im + a, re + b, im + b,
+                    plan.cosTable[j * stride], sign * plan.sinTable[j * stride]);
+            }
+        }
+    }
+}
+
+static void gatherWaveLines(const float* psi, const float* factor, size_t base, size_t laneStride, size_t stride,
+    int n, float* re, float* im)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        for (int l = 0; l < WAVE_LANES; ++l)
+        {
+            const size_t k = (base + l * laneStride + i * stride) * 2;
+            float r = psi[k], m = psi[k + 1];
+            if (factor)
+            {
+                const float t = r * factor[k] - m * factor[k + 1];
+                m = r * factor[k + 1] + m * factor[k];
+                r = t;
+            }
+            re[i * WAVE_LANES + l] = r;
+            im[i * WAVE_LANES + l] = m;
+        }
+    }
+}
+
+static void scatterWaveLines(float* psi, const float* factor, size_t base, size_t laneStride, size_t stride,
+    int n, const float* re, const float* im)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        for (int l = 0; l < WAVE_LANES; ++l)
+        {
+            const size_t k = (base + l * laneStride + i * stride) * 2;
+            float r = re[i * WAVE_LANES + l], m = im[i * WAVE_LANES + l];
+            if (factor)
+            {
+                const float t = r * factor[k] - m * factor[k + 1];
+                m = r * factor[k + 1] + m * factor[k];
+                r = t;
+            }
+            psi[k] = r;
+            psi[k + 1] = m;
+        }
+    }
+}
+
+static float waveCoordinate(const WaveSolver& w, int i)
+{
+    return (i + 0.5f) * w.spacing - WAVE_BOX_BOHR;
+}
+
+static void initWaveSolver(WaveSolver& w, int size)
+{
+    const size_t voxels = static_cast<size_t>(size) * size * size;
+    w.size = size;
+    w.spacing = 2.f * WAVE_BOX_BOHR / size;
+    buildWaveFftPlan(w.fft, size);
+    w.psi.assign(voxels * 2, 0.f);
+    w.potential.assign(voxels * 2, 0.f);
+    w.pending.assign(voxels * 4, 0.f);
+    w.ready.assign(voxels * 4, 0.f);
+    std::vector<float> absorber(size);
+    const float margin = WAVE_ABSORBER * size;
+    for (int i = 0; i < size; ++i)
+    {
+        const float depth = std::min(1.f, (std::min(i, size - 1 - i) + 0.5f) / margin);
+        absorber[i] = std::pow(std::sin(0.5f * PI * depth), 0.125f);
+    }
+    parallelFor(static_cast<size_t>(size) * size, [&](size_t begin, size_t end)
+    {
+        for (size_t row = begin; row < end; ++row)
+        {
+            const int y = static_cast<int>(row % size), z = static_cast<int>(row / size);
+            const float py = waveCoordinate(w, y), pz = waveCoordinate(w, z);
+            for (int x = 0; x < size; ++x)
+            {
+                const float px = waveCoordinate(w, x);
+                const float v = -1.f / std::sqrt(px * px + py * py + pz * pz + WAVE_SOFTENING * WAVE_SOFTENING);
+                const float mask = absorber[x] * absorber[y] * absorber[z];
+                const size_t k = (row * size + x) * 2;
+                w.potential[k] = mask * std::cos(-0.5f * v * WAVE_DT);
+                w.potential[k + 1] = mask * std::sin(-0.5f * v * WAVE_DT);
+            }
+        }
+    }, 64);
+    w.kinetic.resize(size * 2);
+    const float dk = 2.f * PI / (size * w.spacing);
+    for (int i = 0; i < size; ++i)
+    {
+        const float k = dk * (i < size / 2 ? i : i - size);
+        const float phase = -0.5f * k * k * WAVE_DT;
+        w.kinetic[i * 2] = std::cos(phase) / size;
+        w.kinetic[i * 2 + 1] = std::sin(phase) / size;
+    }
+}
+
+static double publishWaveSlab(WaveSolver& w, size_t z)
+{
+    const size_t plane = static_cast<size_t>(w.size) * w.size;
+    const float* psi = &w.psi[z * plane * 2];
+    float* out = &w.pending[z * plane * 4];
+    double sum = 0.0;
+    for (size_t i = 0; i < plane; ++i)
+    {
+        const float re = psi[i * 2], im = psi[i * 2 + 1];
+        const float rho = re * re + im * im;
+        const float inv = rho > 0.f ? 1.f / std::sqrt(rho) : 0.f;
+        const float c = re * inv, s = im * inv;
+        out[i * 4] = rho * (0.5f + 0.5f * c);
+        out[i * 4 + 1] = rho * (0.5f - 0.25f * c + 0.4330127f * s);
+        out[i * 4 + 2] = rho * (0.5f - 0.25f * c - 0.4330127f * s);
+        out[i * 4 + 3] = rho;
+        sum += rho;
+    }
+    return sum;
+}
+
+static void publishWavePacket(WaveSolver& w)
+{
+    std::lock_guard<std::mutex> lock(w.mutex);
+    w.pending.swap(w.ready);
+    w.published = w.stats;
+    w.fresh = true;
+}
+
+static void resetWavePacket(WaveSolver& w)
+{
+    const int N = w.size;
+    const float width2 = 4.f * WAVE_PACKET_WIDTH * WAVE_PACKET_WIDTH;
+    parallelFor(static_cast<size_t>(N) * N, [&](size_t begin, size_t end)
+    {
+        for (size_t row = begin; row < end; ++row)
+        {
+            const float py = waveCoordinate(w, static_cast<int>(row % N));
+            const float pz = waveCoordinate(w, static_cast<int>(row / N));
+            for (int x = 0; x < N; ++x)
+            {
+                const float dx = waveCoordinate(w, x) - WAVE_PACKET_OFFSET;
+                const float envelope = std::exp(-(dx * dx + py * py + pz * pz) / width2);
+                w.psi[(row * N + x) * 2] = envelope * std::cos(WAVE_PACKET_MOMENTUM * py);
+                w.psi[(row * N + x) * 2 + 1] = envelope * std::sin(WAVE_PACKET_MOMENTUM * py);
+            }
+        }
+    }, 64);
+    double sum = 0.0;
+    for (size_t z = 0; z < static_cast<size_t>(N); ++z)
+        sum += publishWaveSlab(w, z);
+    const double cell = static_cast<double>(w.spacing) * w.spacing * w.spacing;
+    const float scale = static_cast<float>(1.0 / std::sqrt(sum * cell));
+    for (float& v : w.psi)
+        v *= scale;
+    for (float& v : w.pending)
+        v *= scale * scale;
+    w.stats = WaveStats();
+    w.stats.norm = 1.0;
+    publishWavePacket(w);
+}
+
+static void stepWavePacket(WaveSolver& w)
+{
+    constexpr int L = WAVE_LANES;
+    const int N = w.size;
+    const size_t plane = static_cast<size_t>(N) * N;
+    float* psi = w.psi.data();
+    const float* potential = w.potential.data();
+    const float* kinetic = w.kinetic.data();
+    const WaveFftPlan& fft = w.fft;
+    parallelFor(N, [&](size_t begin, size_t end)
+    {
+        std::vector<float> block(2 * static_cast<size_t>(N) * L);
+        float* re = block.data();
+        float* im = re + N * L;
+        for (size_t z = begin; z < end; ++z)
+        {
+            for (int y = 0; y < N; y += L)
+            {
+                gatherWaveLines(psi, potential, (z * N + y) * N, N, 1, N, re, im);
+                fftWaveLines(fft, re, im, false);
+                scatterWaveLines(psi, nullptr, (z * N + y) * N, N, 1, N, re, im);
+            }
+            for (int x = 0; x < N; x += L)
+            {
+                gatherWaveLines(psi, nullptr, z * plane + x, 1, N, N, re, im);
+                fftWaveLines(fft, re, im, false);
+                scatterWaveLines(psi, nullptr, z * plane + x, 1, N, N, re, im);
+            }
+        }
+    }, 1);
+    parallelFor(N, [&](size_t begin, size_t end)
+    {
+        std::vector<float> block(2 * static_cast<size_t>(N) * L);
+        float* re = block.data();
+        float* im = re + N * L;
+        for (size_t y = begin; y < end; ++y)
+        {
+            for (int x = 0; x < N; x += L)
+            {
+                gatherWaveLines(psi, nullptr, y * N + x, 1, plane, N, re, im);
+                fftWaveLines(fft, re, im, false);
+                float kr[L], ki[L];
+                for (int l = 0; l < L; ++l)
+                {
+                    const float* a = &kinetic[(x + l) * 2];
+                    const float* b = &kinetic[y * 2];
+                    kr[l] = a[0] * b[0] - a[1] * b[1];
+                    ki[l] = a[0] * b[1] + a[1] * b[0];
+                }
+                for (int i = 0; i < N; ++i)
+                {
+                    const float cr = kinetic[i * 2], ci = kinetic[i * 2 + 1];
+                    for (int l = 0; l < L; ++l)
+                    {
+                        const float fr = kr[l] * cr - ki[l] * ci, fi = kr[l] * ci + ki[l] * cr;
+                        const float r = re[i * L + l], m = im[i * L + l];
+                        re[i * L + l] = r * fr - m * fi;
+                        im[i * L + l] = r * fi + m * fr;
+                    }
+                }
+                fftWaveLines(fft, re, im, true);
+                scatterWaveLines(psi, nullptr, y * N + x, 1, plane, N, re, im);
+            }
+        }
+    }, 1);
+    double norm = 0.0;
+    std::mutex normMutex;
+    parallelFor(N, [&](size_t begin, size_t end)
+    {
+        std::vector<float> block(2 * static_cast<size_t>(N) * L);
+        float* re = block.data();
+        float* im = re + N * L;
+        double sum = 0.0;
+        for (size_t z = begin; z < end; ++z)
+        {
+            for (int x = 0; x < N; x += L)
+            {
+                gatherWaveLines(psi, nullptr, z * plane + x, 1, N, N, re, im);
+                fftWaveLines(fft, re, im, true);
+                scatterWaveLines(psi, nullptr, z * plane + x, 1, N, N, re, im);
+            }
+            for (int y = 0; y < N; y += L)
+            {
+                gatherWaveLines(psi, nullptr, (z * N + y) * N, N, 1, N, re, im);
+                fftWaveLines(fft, re, im, true);
+                scatterWaveLines(psi, potential, (z * N + y) * N, N, 1, N, re, im);
+            }
+            sum += publishWaveSlab(w, z);
+        }
+        std::lock_guard<std::mutex> lock(normMutex);
+        norm += sum;
+    }, 1);
+    w.stats.norm = norm * w.spacing * w.spacing * w.spacing;
+    w.stats.time += WAVE_DT;
+    ++w.stats.steps;
+}
+
+static void advanceWavePacket(WaveSolver& w)
+{
+    sf::Clock timer;
+    stepWavePacket(w);
+    const double ms = timer.getElapsedTime().asMicroseconds() / 1000.0;
+    w.stats.stepMs = w.stats.steps > 1 ? w.stats.stepMs + (ms - w.stats.stepMs) * 0.1 : ms;
+    publishWavePacket(w);
+}
+
+static void waveSolverLoop()
+{
+    WaveSolver& w = gWave;
+    for (;;)
+    {
+        bool reset = false;
+        {
+            std::unique_lock<std::mutex> lock(w.mutex);
+            w.wake.wait(lock, [&w]() { return w.quit || w.active || w.reset; });
+            if (w.quit) return;
+            std::swap(reset, w.reset);
+        }
+        if (reset)
+            resetWavePacket(w);
+        else
+            advanceWavePacket(w);
+    }
+}
+
+static void startWaveSolver(bool threaded)
+{
+    WaveSolver& w = gWave;
+    sf::Clock timer;
+    initWaveSolver(w, gWaveGridSize);
+    resetWavePacket(w);
+    w.field.grid.size = w.size;
+    w.field.grid.extent = WAVE_SCENE_EXTENT;
+    w.field.grid.voxels.assign(w.ready.size(), 0.f);
+    w.shownLevel = G.isoLevel - 1;
+    w.quit = false;
+    if (threaded)
+        w.thread = std::thread(waveSolverLoop);
+    std::cout << "Pakiet falowy: siatka " << w.size << "^3, krok " << WAVE_DT << " j.a., przygotowanie w "
+        << timer.getElapsedTime().asMilliseconds() << " ms\n";
+}
+
+static void stopWaveSolver()
+{
+    WaveSolver& w = gWave;
+    if (w.thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(w.mutex);
+            w.quit = true;
+        }
+        w.wake.notify_all();
+        w.thread.join();
+    }
+    freeMesh(w.mesh);
+    w.size = 0;
+    w.fft = WaveFftPlan();
+    for (std::vector<float>* buffer : { &w.psi, &w.potential, &w.kinetic, &w.pending, &w.ready })
+        std::vector<float>().swap(*buffer);
+    w.field = IsoField();
+    w.scratch = IsoScratch();
+    w.fresh = w.active = w.reset = false;
+    w.triangles = 0;
+}
+
+static void syncWaveSolver()
+{
+    WaveSolver& w = gWave;
+    const bool active = G.viewMode == ViewMode::WavePacket && G.animateElectrons;
+    if (!w.thread.joinable() || w.active == active) return;
+    {
+        std::lock_guard<std::mutex> lock(w.mutex);
+        w.active = active;
+    }
+    w.wake.notify_one();
+}
+
+static void requestWaveReset()
+{
+    WaveSolver& w = gWave;
+    if (!w.size) return;
+    if (!w.thread.joinable())
+    {
+        resetWavePacket(w);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(w.mutex);
+        w.reset = true;
+    }
+    w.wake.notify_one();
+}
+
+static bool wavePending()
+{
+    return gWave.size && G.viewMode == ViewMode::WavePacket && G.animateElectrons;
+}
+
+static void streamIsoMesh(Mesh& mesh, const IsoScratch& s)
+{
+    if (gCoreProfile)
+        bindVertexArray(0);
+    const bool created = !mesh.vbo;
+    if (created)
+    {
+        glGenBuffers(1, &mesh.vbo);
+        glGenBuffers(1, &mesh.ibo);
+        mesh.primitive = GL_TRIANGLES;
+        mesh.stride = ISO_VERTEX_FLOATS * sizeof(float);
+        mesh.normalOffset = 3 * sizeof(float);
+        mesh.colorOffset = 6 * sizeof(float);
+        mesh.indexType = GL_UNSIGNED_INT;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    glBufferData(GL_ARRAY_BUFFER, s.vertices.size() * sizeof(float), s.vertices.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, s.indices.size() * sizeof(uint32_t), s.indices.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    mesh.vertexCount = static_cast<GLsizei>(s.vertices.size() / ISO_VERTEX_FLOATS);
+    mesh.indexCount = static_cast<GLsizei>(s.indices.size());
+    if (created && gCoreProfile)
+        buildMeshVao(mesh);
+}
+
+static void drawWavePacket()
+{
+    WaveSolver& w = gWave;
+    if (!w.size)
+        startWaveSolver(gSim.thread.joinable());
+    if (!w.thread.joinable() && G.animateElectrons)
+        advanceWavePacket(w);
+    bool fresh = false;
+    {
+        std::lock_guard<std::mutex> lock(w.mutex);
+        std::swap(fresh, w.fresh);
+        if (fresh)
+        {
+            w.ready.swap(w.field.grid.voxels);
+            w.shown = w.published;
+        }
+    }
+    if (fresh)
+        buildIsoPyramid(w.field);
+    if (fresh || w.shownLevel != G.isoLevel)
+    {
+        const float peak = w.field.pyramid.back()[1];
+        extractIsoSurface(w.field, peak * std::min(WAVE_MAX_ISO_FRACTION, isoDensity(G.isoLevel)), w.scratch);
+        streamIsoMesh(w.mesh, w.scratch);
+        w.triangles = w.scratch.indices.size() / 3;
+        w.shownLevel = G.isoLevel;
+    }
+    useProgram(gAtomProgram);
+    setColor(1.0f, 0.3f, 0.3f);
+    drawMesh(sphereLodMesh(NUCLEUS_RADIUS, sphereLodAt(currentModelView(), NUCLEUS_RADIUS)));
+    if (w.mesh.indexCount)
+        drawMesh(w.mesh);
+    useProgram(0);
+}
+
+static double elapsedMs(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+static void initProfiler()
+{
+    Profiler& p = gProfiler;
+    p.enabled = p.hudVisible || p.csv.is_open();
+    p.gpuTimers = gCoreProfile || GLEW_ARB_timer_query != 0;
+    if (p.gpuTimers)
+        glGenQueries(PROFILE_RING * PROFILE_STAGE_COUNT, &p.queries[0][0]);
+    if (p.csv.is_open())
+    {
+        p.csv << "frame,frame_cpu_ms";
+        for (const char* suffix : { "_cpu_ms", "_gpu_ms" })
+            for (int s = 0; s < PROFILE_STAGE_COUNT; ++s)
+                p.csv << "," << PROFILE_STAGE_NAMES[s] << suffix;
+        p.csv << ",gl_changes,gl_redundant,gl_queries,gl_elided_queries"
+            << ",visible_nodes,culled_nodes,drawn_atoms,drawn_points,total_points\n";
+    }
+}
+
+static void finishProfileFrame(ProfileFrame& frame)
+{
+    Profiler& p = gProfiler;
+    const double k = 1.0 / 30.0;
+    p.avgFrameMs += (frame.frameMs - p.avgFrameMs) * k;
+    for (int s = 0; s < PROFILE_STAGE_COUNT; ++s)
+    {
+        p.avgCpuMs[s] += (frame.cpuMs[s] - p.avgCpuMs[s]) * k;
+        if (frame.gpuUsed[s] && frame.gpuMs[s] >= 0.0)
+            p.avgGpuMs[s] += (frame.gpuMs[s] - p.avgGpuMs[s]) * k;
+    }
+    if (p.csv.is_open())
+    {
+        p.csv << frame.index << "," << frame.frameMs;
+        for (int s = 0; s < PROFILE_STAGE_COUNT; ++s)
+            p.csv << "," << frame.cpuMs[s];
+        for (int s = 0; s < PROFILE_STAGE_COUNT; ++s)
+        {
+            p.csv << ",";
+            if (frame.gpuUsed[s] && frame.gpuMs[s] >= 0.0)
+                p.csv << frame.gpuMs[s];
+        }
+        const GlStats& gl = frame.glStats;
+        const CullStats& cull = frame.cullStats;
+        p.csv << "," << gl.changes << "," << gl.redundant << "," << gl.queries << "," << gl.elided
+            << "," << cull.visibleNodes << "," << cull.culledNodes << "," << cull.drawnAtoms
+            << "," << cull.drawnPoints << "," << cull.totalPoints << "\n";
+    }
+    frame.pending = false;
+}
+
+static bool collectProfileFrame(int slot, bool force)
+{
+    Profiler& p = gProfiler;
+    ProfileFrame& frame = p.frames[slot];
+    if (!frame.pending)
+        return true;
+    if (p.gpuTimers)
+    {
+        for (int s = PROFILE_STAGE_COUNT - 1; s >= 0; --s)
+        {
+            if (!frame.gpuUsed[s]) continue;
+            GLint available = 0;
+            glGetQueryObjectiv(p.queries[slot][s], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available && !force)
+                return false;
+            if (!available)
+            {
+                std::fill(std::begin(frame.gpuMs), std::end(frame.gpuMs), -1.0);
+                finishProfileFrame(frame);
+                return true;
+            }
+            break;
+        }
+        for (int s = 0; s < PROFILE_STAGE_COUNT; ++s)
+        {
+            if (!frame.gpuUsed[s]) continue;
+            GLuint64 ns = 0;
+            glGetQueryObjectui64v(p.queries[slot][s], GL_QUERY_RESULT, &ns);
+            frame.gpuMs[s] = ns / 1.0e6;
+        }
+    }
+    finishProfileFrame(frame);
+    return true;
+}
+
+static void profilerBeginFrame()
+{
+    Profiler& p = gProfiler;
+    if (!p.enabled) return;
+    for (int i = 1; i < PROFILE_RING; ++i)
+    {
+        int slot = static_cast<int>((p.frameIndex + i) % PROFILE_RING);
+        collectProfileFrame(slot, false);
+    }
+    p.slot = static_cast<int>(p.frameIndex % PROFILE_RING);
+    collectProfileFrame(p.slot, true);
+    ProfileFrame& frame = p.frames[p.slot];
+    frame = ProfileFrame();
+    frame.index = p.frameIndex;
+    p.frameStart = std::chrono::steady_clock::now();
+}
+
+static void profilerEndFrame()
+{
+    Profiler& p = gProfiler;
+    if (!p.enabled) return;
+    ProfileFrame& frame = p.frames[p.slot];
+    frame.frameMs = elapsedMs(p.frameStart);
+    frame.glStats = gGlState.lastFrame;
+    frame.cullStats = gCullStats;
+    frame.pending = true;
+    ++p.frameIndex;
+}
+
+static void shutdownProfiler()
+{
+    Profiler& p = gProfiler;
+    if (p.enabled)
+    {
+        for (int i = 0; i < PROFILE_RING; ++i)
+            collectProfileFrame(static_cast<int>((p.frameIndex + i) % PROFILE_RING), true);
+    }
+    if (p.gpuTimers)
+        glDeleteQueries(PROFILE_RING * PROFILE_STAGE_COUNT, &p.queries[0][0]);
+    p.gpuTimers = false;
+    if (p.csv.is_open())
+        p.csv.close();
+}
+
+static void toggleProfilerHud()
+{
+    Profiler& p = gProfiler;
+    p.hudVisible = !p.hudVisible;
+    p.enabled = p.hudVisible || p.csv.is_open();
+}
+
+class ProfileScope
+{
+public:
+    ProfileScope(ProfileStage stage, bool gpu = true)
+        : mStage(static_cast<int>(stage))
+        , mActive(gProfiler.enabled)
+        , mGpu(mActive && gpu && gProfiler.gpuTimers)
+    {
+        if (!mActive) return;
+        mStart = std::chrono::steady_clock::now();
+        if (mGpu)
+            glBeginQuery(GL_TIME_ELAPSED, gProfiler.queries[gProfiler.slot][mStage]);
+    }
+
+    ~ProfileScope()
+    {
+        if (!mActive) return;
+        ProfileFrame& frame = gProfiler.frames[gProfiler.slot];
+        if (mGpu)
+        {
+            glEndQuery(GL_TIME_ELAPSED);
+            frame.gpuUsed[mStage] = true;
+        }
+        frame.cpuMs[mStage] += elapsedMs(mStart);
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    int mStage;
+    bool mActive;
+    bool mGpu;
+    std::chrono::steady_clock::time_point mStart;
+};
+
+static int frameCap()
+{
+    const FramePacer& p = gFramePacer;
+    if (p.fpsCap > 0) return p.fpsCap;
+    return p.mode == PacingMode::Latency ? p.refreshHz : 0;
+}
+
+static std::string profilerHudText()
+{
+    const Profiler& p = gProfiler;
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(2);
+    oss << "Profil [ms]  CPU / GPU\n";
+    for (int s = 0; s < PROFILE_STAGE_COUNT; ++s)
+    {
+        oss << PROFILE_STAGE_NAMES[s] << ": " << p.avgCpuMs[s];
+        if (p.gpuTimers) oss << " / " << p.avgGpuMs[s];
+        oss << "\n";
+    }
+    oss << "klatka: " << p.avgFrameMs << ", odstep: " << gFramePacer.avgIntervalMs
+        << (gFramePacer.mode == PacingMode::Latency ? " (opoznienie" : " (oszczedny");
+    if (frameCap() > 0)
+        oss << ", limit " << frameCap() << " fps";
+    oss << ")\n";
+    const GlStats& gl = gGlState.lastFrame;
+    oss << "stan GL: " << gl.changes << " zmian, " << gl.redundant << " zbednych\n"
+        << "zapytania GL: " << gl.queries << ", z cache: " << gl.elided << "\n";
+    const CullStats& cull = gCullStats;
+    oss << "wezly: " << cull.visibleNodes << " widoczne, " << cull.culledNodes << " odrzucone\n";
+    if (G.viewMode == ViewMode::Molecule)
+        oss << "atomy: " << cull.drawnAtoms << " / " << gMolecule.elements.size();
+    else
+        oss << "punkty: " << cull.drawnPoints << " / " << cull.totalPoints;
+    return oss.str();
+}
+
+static bool isLineSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char* skipSpaces(const char* p, const char* end)
+{
+    while (p < end && isLineSpace(*p)) ++p;
+    return p;
+}
+
+static const char* parseFloat(const char* p, const char* end, float& out)
+{
+    static const double POW10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18 };
+    p = skipSpaces(p, end);
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int fraction = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        if (digits < 18) { mantissa = mantissa * 10 + (*p - '0'); ++digits; }
+        else --fraction;
+        ++p;
+    }
+    if (p < end && *p == '.')
+    {
+        ++p;
+        while (p < end && *p >= '0' && *p <= '9')
+        {
+            if (digits < 18) { mantissa = mantissa * 10 + (*p - '0'); ++digits; ++fraction; }
+            ++p;
+        }
+    }
+    if (!digits) return nullptr;
+    double value = static_cast<double>(mantissa);
+    if (fraction > 0) value /= POW10[fraction];
+    else if (fraction < 0) value *= POW10[-fraction];
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        const char* q = p + 1;
+        bool negativeExp = false;
+        if (q < end && (*q == '-' || *q == '+'))
+            negativeExp = *q++ == '-';
+        int exponent = 0;
+        bool any = false;
+        while (q < end && *q >= '0' && *q <= '9')
+        {
+            exponent = std::min(exponent * 10 + (*q++ - '0'), 400);
+            any = true;
+        }
+        if (any)
+        {
+            value *= std::pow(10.0, negativeExp ? -exponent : exponent);
+            p = q;
+        }
+    }
+    out = static_cast<float>(negative ? -value : value);
+    return p;
+}
+
+static int elementFromSymbol(const char* s, size_t len)
+{
+    static const std::vector<uint8_t> lookup = []()
+    {
+        std::vector<uint8_t> table(26 * 27, 0);
+        for (const ElementInfo& e : ELEMENTS)
+        {
+            int second = e.symbol[1] ? e.symbol[1] - 'a' + 1 : 0;
+            table[(e.symbol[0] - 'A') * 27 + second] = static_cast<uint8_t>(e.Z);
+        }
+        return table;
+    }();
+    if (len == 0) return 0;
+    if (s[0] >= '0' && s[0] <= '9')
+    {
+        int Z = 0;
+        for (size_t i = 0; i < len && s[i] >= '0' && s[i] <= '9'; ++i)
+            Z = Z * 10 + (s[i] - '0');
+        return Z <= MAX_ELECTRONS ? Z : 0;
+    }
+    int first = (s[0] | 0x20) - 'a';
+    if (first < 0 || first >= 26) return 0;
+    int second = 0;
+    if (len > 1)
+    {
+        second = (s[1] | 0x20) - 'a' + 1;
+        if (second < 1 || second > 26) second = 0;
+    }
+    int Z = lookup[first * 27 + second];
+    return Z ? Z : lookup[first * 27];
+}
+
+static size_t nextLine(const char* data, size_t pos, size_t size)
+{
+    const void* nl = std::memchr(data + pos, '\n', size - pos);
+    return nl ? static_cast<size_t>(static_cast<const char*>(nl) - data) + 1 : size;
+}
+
+static std::vector<size_t> lineAlignedChunks(const char* data, size_t begin, size_t size)
+{
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t chunks = std::max<size_t>(1, std::min<size_t>(threads * 4, (size - begin) / MOLECULE_MIN_CHUNK_BYTES));
+    std::vector<size_t> bounds(chunks + 1, size);
+    bounds[0] = begin;
+    for (size_t c = 1; c < chunks; ++c)
+    {
+        size_t pos = begin + (size - begin) * c / chunks;
+        bounds[c] = std::max(bounds[c - 1], nextLine(data, pos, size));
+    }
+    return bounds;
+}
+
+template <typename LineFn>
+static void forEachLine(const char* data, size_t begin, size_t end, LineFn fn)
+{
+    while (begin < end)
+    {
+        size_t next = nextLine(data, begin, end);
+        size_t lineEnd = next;
+        while (lineEnd > begin && (data[lineEnd - 1] == '\n' || data[lineEnd - 1] == '\r')) --lineEnd;
+        if (!fn(data + begin, data + lineEnd))
+            break;
+        begin = next;
+    }
+}
+
+static bool parseXyzAtom(const char* p, const char* end, float* pos, uint8_t& element)
+{
+    p = skipSpaces(p, end);
+    const char* symbol = p;
+    while (p < end && !isLineSpace(*p)) ++p;
+    int Z = elementFromSymbol(symbol, static_cast<size_t>(p - symbol));
+    for (int a = 0; a < 3 && p; ++a)
+        p = parseFloat(p, end, pos[a]);
+    if (!p || !Z) return false;
+    element = static_cast<uint8_t>(Z);
+    return true;
+}
+
+static size_t parseXyzHeader(const char* data, size_t pos, size_t size, size_t& atoms)
+{
+    size_t secondLine = nextLine(data, pos, size);
+    const char* p = skipSpaces(data + pos, data + secondLine);
+    atoms = 0;
+    while (p < data + secondLine && *p >= '0' && *p <= '9')
+    {
+        const size_t digit = static_cast<size_t>(*p++ - '0');
+        if (atoms > (std::numeric_limits<size_t>::max() - digit) / 10)
+        {
+            atoms = std::numeric_limits<size_t>::max();
+            break;
+        }
+        atoms = atoms * 10 + digit;
+    }
+    return nextLine(data, secondLine, size);
+}
+
+static size_t skipLines(const char* data, size_t pos, size_t size, size_t lines)
+{
+    for (size_t i = 0; i < lines && pos < size; ++i)
+        pos = nextLine(data, pos, size);
+    return pos;
+}
+
+static bool parseXyzAtoms(const char* data, size_t begin, size_t end, size_t atoms,
+    float* positions, uint8_t* elements, std::string& error)
+{
+    const std::vector<size_t> bounds = lineAlignedChunks(data, begin, end);
+    const size_t chunks = bounds.size() - 1;
+    std::vector<size_t> firstLine(chunks + 1, 0);
+    parallelFor(chunks, [&](size_t first, size_t last)
+    {
+        for (size_t c = first; c < last; ++c)
+        {
+            size_t lines = 0;
+            forEachLine(data, bounds[c], bounds[c + 1], [&](const char*, const char*) { ++lines; return true; });
+            firstLine[c + 1] = lines;
+        }
+    }, 1);
+    for (size_t c = 0; c < chunks; ++c)
+        firstLine[c + 1] += firstLine[c];
+    if (firstLine[chunks] < atoms)
+    {
+        error = "ramka zawiera mniej linii niz zadeklarowano atomow";
+        return false;
+    }
+
+    std::atomic<size_t> badLine{ SIZE_MAX };
+    parallelFor(chunks, [&](size_t first, size_t last)
+    {
+        for (size_t c = first; c < last; ++c)
+        {
+            size_t index = firstLine[c];
+            if (index >= atoms) continue;
+            forEachLine(data, bounds[c], bounds[c + 1], [&](const char* p, const char* lineEnd)
+            {
+                if (!parseXyzAtom(p, lineEnd, &positions[index * 3], elements[index]))
+                {
+                    size_t expected = SIZE_MAX;
+                    while (index < expected && !badLine.compare_exchange_weak(expected, index)) {}
+                }
+                return ++index < atoms;
+            });
+        }
+    }, 1);
+    if (badLine != SIZE_MAX)
+    {
+        error = "niepoprawny atom nr " + std::to_string(badLine + 1);
+        return false;
+    }
+    return true;
+}
+
+static bool parseXyzMolecule(const MappedFile& file, MoleculeData& mol, std::string& error)
+{
+    const char* data = reinterpret_cast<const char*>(file.data);
+    size_t atoms = 0;
+    const size_t dataStart = parseXyzHeader(data, 0, file.size, atoms);
+    if (!atoms || dataStart >= file.size)
+    {
+        error = "brak liczby atomow w naglowku XYZ";
+        return false;
+    }
+    if (atoms > (file.size - dataStart) / XYZ_MIN_ATOM_LINE_BYTES)
+    {
+        error = "liczba atomow w naglowku XYZ przekracza rozmiar pliku";
+        return false;
+    }
+    mol.positions.resize(atoms * 3);
+    mol.elements.resize(atoms);
+    const size_t frameEnd = skipLines(data, dataStart, file.size, atoms);
+    return parseXyzAtoms(data, dataStart, frameEnd, atoms, mol.positions.data(), mol.elements.data(), error);
+}
+
+static bool isPdbAtomRecord(const char* p, const char* end)
+{
+    return end - p >= 54 && (std::memcmp(p, "ATOM  ", 6) == 0 || std::memcmp(p, "HETATM", 6) == 0);
+}
+
+static bool isPdbModelEnd(const char* p, const char* end)
+{
+    return end - p >= 6 && std::memcmp(p, "ENDMDL", 6) == 0;
+}
+
+static bool parsePdbAtom(const char* p, const char* end, float* pos, uint8_t& element)
+{
+    for (int a = 0; a < 3; ++a)
+    {
+        const char* field = p + 30 + 8 * a;
+        if (!parseFloat(field, field + 8, pos[a])) return false;
+    }
+    int Z = 0;
+    if (end - p >= 78)
+    {
+        const char* sym = skipSpaces(p + 76, p + 78);
+        Z = elementFromSymbol(sym, static_cast<size_t>(p + 78 - sym));
+    }
+    if (!Z)
+        Z = p[12] == ' ' || (p[12] >= '0' && p[12] <= '9') ? elementFromSymbol(p + 13, 1) : elementFromSymbol(p + 12, 2);
+    if (!Z) return false;
+    element = static_cast<uint8_t>(Z);
+    return true;
+}
+
+static bool parsePdbMolecule(const MappedFile& file, MoleculeData& mol, std::string& error)
+{
+    const char* data = reinterpret_cast<const char*>(file.data);
+    const std::vector<size_t> bounds = lineAlignedChunks(data, 0, file.size);
+    const size_t chunks = bounds.size() - 1;
+    std::vector<size_t> firstAtom(chunks + 1, 0);
+    std::vector<uint8_t> modelEnds(chunks, 0);
+    parallelFor(chunks, [&](size_t begin, size_t end)
+    {
+        for (size_t c = begin; c < end; ++c)
+        {
+            size_t atoms = 0;
+            forEachLine(data, bounds[c], bounds[c + 1], [&](const char* p, const char* lineEnd)
+            {
+                if (isPdbModelEnd(p, lineEnd)) { modelEnds[c] = 1; return false; }
+                if (isPdbAtomRecord(p, lineEnd)) ++atoms;
+                return true;
+            });
+            firstAtom[c + 1] = atoms;
+        }
+    }, 1);
+    size_t usedChunks = chunks;
+    for (size_t c = 0; c < chunks; ++c)
+    {
+        if (c >= usedChunks) firstAtom[c + 1] = 0;
+        else if (modelEnds[c]) usedChunks = c + 1;
+        firstAtom[c + 1] += firstAtom[c];
+    }
+    const size_t atoms = firstAtom[usedChunks];
+    if (!atoms)
+    {
+        error = "brak rekordow ATOM/HETATM";
+        return false;
+    }
+
+    mol.positions.resize(atoms * 3);
+    mol.elements.resize(atoms);
+    std::atomic<size_t> badAtoms{ 0 };
+    parallelFor(usedChunks, [&](size_t begin, size_t end)
+    {
+        for (size_t c = begin; c < end; ++c)
+        {
+            size_t index = firstAtom[c];
+            forEachLine(data, bounds[c], bounds[c + 1], [&](const char* p, const char* lineEnd)
+            {
+                if (isPdbModelEnd(p, lineEnd)) return false;
+                if (!isPdbAtomRecord(p, lineEnd)) return true;
+                if (!parsePdbAtom(p, lineEnd, &mol.positions[index * 3], mol.elements[index]))
+                {
+                    mol.positions[index * 3] = mol.positions[index * 3 + 1] = mol.positions[index * 3 + 2] = 0.f;
+                    mol.elements[index] = 0;
+                    ++badAtoms;
+                }
+                ++index;
+                return true;
+            });
+        }
+    }, 1);
+    if (badAtoms)
+    {
+        error = std::to_string(badAtoms.load()) + " niepoprawnych rekordow ATOM/HETATM";
+        return false;
+    }
+    return true;
+}
+
+static void elementStyle(int Z, uint8_t color[4], float& radius)
+{
+    struct Style { int Z; uint8_t r, g, b; };
+    static const Style CPK[] =
+    {
+        { 1, 235, 235, 235 }, { 6, 90, 90, 90 }, { 7, 48, 80, 248 }, { 8, 255, 13, 13 },
+        { 9, 144, 224, 80 }, { 15, 255, 128, 0 }, { 16, 255, 200, 50 }, { 17, 31, 240, 31 },
+        { 26, 224, 102, 51 }, { 29, 200, 128, 51 }, { 35, 166, 41, 41 }, { 47, 192, 192, 192 },
+        { 53, 148, 0, 148 }, { 79, 255, 209, 35 },
+    };
+    const ElectronConfig& config = ELECTRON_CONFIGS.element[Z >= 1 && Z <= MAX_ELECTRONS ? Z : 1];
+    const int valence = config.shellElectrons[config.shellCount - 1];
+    uint8_t r = 255, g = 20, b = 147;
+    if ((Z >= 21 && Z <= 30) || (Z >= 39 && Z <= 48) || (Z >= 72 && Z <= 80) || (Z >= 104 && Z <= 112))
+        r = 160, g = 165, b = 185;
+    else if ((Z >= 57 && Z <= 71) || (Z >= 89 && Z <= 103))
+        r = 60, g = 190, b = 170;
+    else if (Z > 2 && valence == 1)
+        r = 143, g = 64, b = 212;
+    else if (Z > 2 && valence == 2)
+        r = 0, g = 200, b = 0;
+    else if (Z == 2 || valence == 8)
+        r = 80, g = 200, b = 230;
+    for (const Style& s : CPK)
+        if (s.Z == Z) { r = s.r; g = s.g; b = s.b; }
+    color[0] = r;
+    color[1] = g;
+    color[2] = b;
+    color[3] = 255;
+    radius = 0.15f + 0.1f * config.shellCount;
+}
+
+static void computeMoleculeBounds(MoleculeData& mol)
+{
+    const size_t n = mol.elements.size();
+    float lo[3] = { std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+    float hi[3] = { -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max() };
+    for (size_t i = 0; i < n; ++i)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            lo[a] = std::min(lo[a], mol.positions[i * 3 + a]);
+            hi[a] = std::max(hi[a], mol.positions[i * 3 + a]);
+        }
+    }
+    float radius2 = 0.f;
+    for (int a = 0; a < 3; ++a)
+        mol.center[a] = 0.5f * (lo[a] + hi[a]);
+    for (size_t i = 0; i < n; ++i)
+    {
+        float dx = mol.positions[i * 3] - mol.center[0];
+        float dy = mol.positions[i * 3 + 1] - mol.center[1];
+        float dz = mol.positions[i * 3 + 2] - mol.center[2];
+        radius2 = std::max(radius2, dx * dx + dy * dy + dz * dz);
+    }
+    mol.radius = std::max(1.0f, std::sqrt(radius2) + 0.5f);
+}
+
+static void buildOctreeNode(MoleculeOctree& tree, const float* positions, uint32_t* idx, uint32_t* scratch,
+    int node, const float center[3], float half, int depth)
+{
+    const uint32_t first = tree.nodes[node].first;
+    const uint32_t count = tree.nodes[node].count;
+    if (count <= OCTREE_LEAF_SIZE || depth >= OCTREE_MAX_DEPTH)
+        return;
+    uint32_t octantCount[8] = {};
+    for (uint32_t i = first; i < first + count; ++i)
+    {
+        const float* p = &positions[idx[i] * 3];
+        int octant = (p[0] >= center[0] ? 1 : 0) | (p[1] >= center[1] ? 2 : 0) | (p[2] >= center[2] ? 4 : 0);
+        scratch[i] = static_cast<uint32_t>(octant);
+        ++octantCount[octant];
+    }
+    uint32_t octantStart[8];
+    uint32_t cursor[8];
+    uint32_t offset = first;
+    for (int o = 0; o < 8; ++o)
+    {
+        octantStart[o] = cursor[o] = offset;
+        offset += octantCount[o];
+    }
+    std::vector<uint32_t> sorted(count);
+    for (uint32_t i = first; i < first + count; ++i)
+        sorted[cursor[scratch[i]]++ - first] = idx[i];
+    std::copy(sorted.begin(), sorted.end(), idx + first);
+
+    tree.nodes[node].firstChild = static_cast<int32_t>(tree.nodes.size());
+    int children[8];
+    int childCount = 0;
+    for (int o = 0; o < 8; ++o)
+    {
+        if (!octantCount[o]) continue;
+        OctreeNode child;
+        child.first = octantStart[o];
+        child.count = octantCount[o];
+        children[childCount++] = o;
+        tree.nodes.push_back(child);
+    }
+    tree.nodes[node].childCount = childCount;
+    const int firstChild = tree.nodes[node].firstChild;
+    for (int c = 0; c < childCount; ++c)
+    {
+        const int o = children[c];
+        const float quarter = half * 0.5f;
+        const float childCenter[3] =
+        {
+            center[0] + ((o & 1) ? quarter : -quarter),
+            center[1] + ((o & 2) ? quarter : -quarter),
+            center[2] + ((o & 4) ? quarter : -quarter),
+        };
+        buildOctreeNode(tree, positions, idx, scratch, firstChild + c, childCenter, quarter, depth + 1);
+    }
+}
+
+static void buildMoleculeOctree(MoleculeData& mol)
+{
+    const uint32_t n = static_cast<uint32_t>(mol.elements.size());
+    MoleculeOctree& tree = mol.octree;
+    tree.nodes.clear();
+    tree.order.resize(n);
+    for (uint32_t i = 0; i < n; ++i)
+        tree.order[i] = i;
+    OctreeNode root;
+    root.first = 0;
+    root.count = n;
+    tree.nodes.push_back(root);
+    std::vector<uint32_t> scratch(n);
+    buildOctreeNode(tree, mol.positions.data(), tree.order.data(), scratch.data(), 0, mol.center, mol.radius, 0);
+
+    std::vector<float> positions(mol.positions.size());
+    std::vector<uint8_t> elements(n);
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        const uint32_t src = tree.order[i];
+        std::copy(&mol.positions[src * 3], &mol.positions[src * 3] + 3, &positions[i * 3]);
+        elements[i] = mol.elements[src];
+    }
+    mol.positions.swap(positions);
+    mol.elements.swap(elements);
+}
+
+static void refitOctree(const MoleculeOctree& tree, const MoleculeInstance* instances, std::vector<NodeBounds>& bounds)
+{
+    bounds.resize(tree.nodes.size());
+    for (size_t k = tree.nodes.size(); k-- > 0;)
+    {
+        const OctreeNode& node = tree.nodes[k];
+        NodeBounds b;
+        for (int a = 0; a < 3; ++a)
+        {
+            b.lo[a] = std::numeric_limits<float>::max();
+            b.hi[a] = -std::numeric_limits<float>::max();
+        }
+        b.maxRadius = 0.f;
+        if (node.childCount == 0)
+        {
+            for (uint32_t i = node.first; i < node.first + node.count; ++i)
+            {
+                const MoleculeInstance& inst = instances[i];
+                for (int a = 0; a < 3; ++a)
+                {
+                    b.lo[a] = std::min(b.lo[a], inst.position[a] - inst.radius);
+                    b.hi[a] = std::max(b.hi[a], inst.position[a] + inst.radius);
+                }
+                b.maxRadius = std::max(b.maxRadius, inst.radius);
+            }
+        }
+        else
+        {
+            for (int c = 0; c < node.childCount; ++c)
+            {
+                const NodeBounds& cb = bounds[node.firstChild + c];
+                for (int a = 0; a < 3; ++a)
+                {
+                    b.lo[a] = std::min(b.lo[a], cb.lo[a]);
+                    b.hi[a] = std::max(b.hi[a], cb.hi[a]);
+                }
+                b.maxRadius = std::max(b.maxRadius, cb.maxRadius);
+            }
+        }
+        bounds[k] = b;
+    }
+}
+
+static void collectVisibleRuns(const MoleculeOctree& tree, const std::vector<NodeBounds>& bounds,
+    const Mat4& modelView, std::vector<InstanceRun>& runs)
+{
+    runs.clear();
+    if (tree.nodes.empty() || bounds.size() != tree.nodes.size()) return;
+    const Frustum frustum = extractFrustum(mat4Multiply(gProjectionMatrix, modelView));
+    std::vector<std::pair<int, bool>> stack;
+    stack.emplace_back(0, false);
+    while (!stack.empty())
+    {
+        const int k = stack.back().first;
+        bool inside = stack.back().second;
+        stack.pop_back();
+        const OctreeNode& node = tree.nodes[k];
+        const NodeBounds& b = bounds[k];
+        if (!inside)
+        {
+            int c = classifyBox(frustum, b.lo, b.hi);
+            if (c == FRUSTUM_OUTSIDE)
+            {
+                ++gCullStats.culledNodes;
+                continue;
+            }
+            inside = c == FRUSTUM_INSIDE;
+        }
+        if (node.childCount > 0)
+        {
+            for (int c = node.childCount - 1; c >= 0; --c)
+                stack.emplace_back(node.firstChild + c, inside);
+            continue;
+        }
+        ++gCullStats.visibleNodes;
+        gCullStats.drawnAtoms += node.count;
+        const float depth = nearestBoxDepth(modelView, b.lo, b.hi);
+        const int lod = sphereLodForPixels(b.maxRadius * pixelsPerUnitAtDepth(modelView, depth));
+        if (!runs.empty() && runs.back().lod == lod && runs.back().first + runs.back().count == node.first)
+            runs.back().count += node.count;
+        else
+            runs.push_back({ node.first, node.count, lod });
+    }
+}
+
+static void fillMoleculeInstances(const float* positions, const uint8_t* elements, size_t n,
+    const float center[3], MoleculeInstance* out, const uint32_t* order = nullptr)
+{
+    static const std::vector<MoleculeInstance> styles = []()
+    {
+        std::vector<MoleculeInstance> table(MAX_ELECTRONS + 1);
+        for (int Z = 0; Z <= MAX_ELECTRONS; ++Z)
+            elementStyle(Z, table[Z].color, table[Z].radius);
+        return table;
+    }();
+    parallelFor(n, [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            const size_t src = order ? order[i] : i;
+            MoleculeInstance& inst = out[i];
+            inst = styles[elements[src]];
+            for (int a = 0; a < 3; ++a)
+                inst.position[a] = positions[src * 3 + a] - center[a];
+        }
+    });
+}
+
+static void uploadMoleculeInstances(MoleculeData& mol)
+{
+    const size_t n = mol.elements.size();
+    std::vector<MoleculeInstance> instances(n);
+    fillMoleculeInstances(mol.positions.data(), mol.elements.data(), n, mol.center, instances.data());
+    refitOctree(mol.octree, instances.data(), mol.bounds);
+    if (!mol.instanceVbo)
+        glGenBuffers(1, &mol.instanceVbo);
+    glBindBuffer(GL_ARRAY_BUFFER, mol.instanceVbo);
+    glBufferData(GL_ARRAY_BUFFER, n * sizeof(MoleculeInstance), instances.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+static std::string trajectoryIndexPath(const std::string& path)
+{
+    return path + ".idx";
+}
+
+static void adviseMappedRange(const MappedFile& file, size_t begin, size_t end, bool willNeed)
+{
+    if (begin >= end || !file.data) return;
+#ifdef _WIN32
+    if (!willNeed)
+        VirtualUnlock(const_cast<uint8_t*>(file.data) + begin, end - begin);
+#else
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t first = begin / page * page;
+    if (!willNeed)
+    {
+        first = (begin + page - 1) / page * page;
+        end = end / page * page;
+        if (first >= end) return;
+    }
+    madvise(const_cast<uint8_t*>(file.data) + first, end - first, willNeed ? MADV_WILLNEED : MADV_DONTNEED);
+#endif
+}
+
+static bool loadTrajectoryIndex(const std::string& path, const MappedFile& file, size_t atoms, std::vector<uint64_t>& offsets)
+{
+    std::ifstream in(trajectoryIndexPath(path), std::ios::binary);
+    TrajectoryIndexHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        return false;
+    if (std::memcmp(header.magic, TRAJECTORY_INDEX_MAGIC, sizeof(header.magic)) != 0
+        || header.version != TRAJECTORY_INDEX_VERSION
+        || header.fileSize != file.size
+        || header.fileTime != fileTimeStamp(path)
+        || header.atomCount != atoms
+        || header.frameCount < 1 || header.frameCount > file.size)
+        return false;
+    offsets.resize(header.frameCount + 1);
+    if (!in.read(reinterpret_cast<char*>(offsets.data()), offsets.size() * sizeof(uint64_t)))
+        return false;
+    if (offsets[0] != 0)
+        return false;
+    for (size_t f = 1; f < offsets.size(); ++f)
+        if (offsets[f] < offsets[f - 1] || offsets[f] > file.size)
+            return false;
+    return true;
+}
+
+static void writeTrajectoryIndex(const std::string& path, const MappedFile& file, size_t atoms, const std::vector<uint64_t>& offsets)
+{
+    const std::string indexPath = trajectoryIndexPath(path);
+    const std::string tmpPath = indexPath + ".tmp";
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!out)
+    {
+        std::cerr << "Nie udalo sie zapisac indeksu trajektorii: " << indexPath << "\n";
+        return;
+    }
+    TrajectoryIndexHeader header;
+    std::memcpy(header.magic, TRAJECTORY_INDEX_MAGIC, sizeof(header.magic));
+    header.version = TRAJECTORY_INDEX_VERSION;
+    header.reserved = 0;
+    header.fileSize = file.size;
+    header.fileTime = fileTimeStamp(path);
+    header.atomCount = atoms;
+    header.frameCount = offsets.size() - 1;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+    out.close();
+    std::error_code ec;
+    if (!out)
+    {
+        std::filesystem::remove(tmpPath, ec);
+        return;
+    }
+    std::filesystem::rename(tmpPath, indexPath, ec);
+    if (ec)
+        std::filesystem::remove(tmpPath, ec);
+}
+
+static void buildTrajectoryIndex(const MappedFile& file, size_t atoms, std::vector<uint64_t>& offsets)
+{
+    const char* data = reinterpret_cast<const char*>(file.data);
+    const size_t size = file.size;
+    const size_t releaseStep = size_t(256) << 20;
+    size_t released = 0;
+    size_t pos = 0;
+    offsets.clear();
+    while (true)
+    {
+        size_t start = pos;
+        while (start < size && (isLineSpace(data[start]) || data[start] == '\n')) ++start;
+        if (start >= size) break;
+        size_t frameAtoms = 0;
+        size_t end = parseXyzHeader(data, start, size, frameAtoms);
+        if (frameAtoms != atoms)
+        {
+            std::cerr << "Trajektoria: ramka " << offsets.size() << " ma inna liczbe atomow, dalsze ramki pominiete.\n";
+            break;
+        }
+        size_t lines = 0;
+        while (lines < atoms && end < size)
+        {
+            end = nextLine(data, end, size);
+            ++lines;
+        }
+        if (lines < atoms) break;
+        offsets.push_back(pos);
+        pos = end;
+        if (pos - released >= releaseStep)
+        {
+            adviseMappedRange(file, released, pos, false);
+            released = pos;
+        }
+    }
+    offsets.push_back(pos);
+    adviseMappedRange(file, released, pos, false);
+}
+
+static bool decodeTrajectoryFrame(TrajectorySlot& slot, int frame)
+{
+    Trajectory& t = gTrajectory;
+    const char* data = reinterpret_cast<const char*>(t.file.data);
+    const size_t begin = t.frameOffsets[frame];
+    const size_t end = t.frameOffsets[frame + 1];
+    adviseMappedRange(t.file, begin, end, true);
+    size_t atoms = 0;
+    const size_t dataStart = parseXyzHeader(data, begin, end, atoms);
+    std::string error;
+    slot.positions.resize(t.atoms * 3);
+    slot.elements.resize(t.atoms);
+    slot.instances.resize(t.atoms);
+    bool ok = atoms == t.atoms
+        && parseXyzAtoms(data, dataStart, end, atoms, slot.positions.data(), slot.elements.data(), error);
+    if (ok)
+    {
+        fillMoleculeInstances(slot.positions.data(), slot.elements.data(), t.atoms, t.center, slot.instances.data(),
+            t.octree.order.data());
+        refitOctree(t.octree, slot.instances.data(), slot.bounds);
+    }
+    else
+        std::cerr << "Trajektoria: blad ramki " << frame << ": " << error << "\n";
+    adviseMappedRange(t.file, begin, end, false);
+    return ok;
+}
+
+static int trajectoryWindowFrame(const Trajectory& t, int base, int i)
+{
+    int frame = base + i;
+    if (frame < t.frameCount) return frame;
+    return t.loop ? frame % t.frameCount : -1;
+}
+
+static TrajectorySlot* nextTrajectoryDecode(Trajectory& t, int& frame)
+{
+    bool claimed[TRAJECTORY_RING] = {};
+    for (int i = 0; i < TRAJECTORY_RING; ++i)
+    {
+        int f = trajectoryWindowFrame(t, t.wantFrame, i);
+        if (f < 0) break;
+        int s = f % TRAJECTORY_RING;
+        if (claimed[s]) break;
+        claimed[s] = true;
+        TrajectorySlot& slot = t.slots[s];
+        if (slot.frame != f && !slot.uploading)
+        {
+            frame = f;
+            return &slot;
+        }
+    }
+    return nullptr;
+}
+
+static void trajectoryWorkerLoop()
+{
+    Trajectory& t = gTrajectory;
+    std::unique_lock<std::mutex> lock(t.mutex);
+    while (true)
+    {
+        int frame = -1;
+        TrajectorySlot* slot = nullptr;
+        t.wake.wait(lock, [&]() { return t.quit || (slot = nextTrajectoryDecode(t, frame)) != nullptr; });
+        if (t.quit) return;
+        slot->frame = frame;
+        slot->ready = false;
+        lock.unlock();
+        bool ok = decodeTrajectoryFrame(*slot, frame);
+        lock.lock();
+        if (slot->frame == frame)
+            slot->ready = ok;
+    }
+}
+
+static bool openTrajectory(const std::string& path, const MoleculeData& mol)
+{
+    Trajectory& t = gTrajectory;
+    if (!openMappedFile(path, t.file))
+        return false;
+    const size_t atoms = mol.elements.size();
+    auto start = std::chrono::steady_clock::now();
+    bool cached = loadTrajectoryIndex(path, t.file, atoms, t.frameOffsets);
+    if (!cached)
+    {
+        buildTrajectoryIndex(t.file, atoms, t.frameOffsets);
+        if (t.frameOffsets.size() > 2)
+            writeTrajectoryIndex(path, t.file, atoms, t.frameOffsets);
+    }
+    if (t.frameOffsets.size() <= 2)
+    {
+        closeMappedFile(t.file);
+        t.frameOffsets.clear();
+        return false;
+    }
+    t.atoms = atoms;
+    t.frameCount = static_cast<int>(t.frameOffsets.size() - 1);
+    std::copy(std::begin(mol.center), std::end(mol.center), t.center);
+    t.octree = mol.octree;
+    t.fps = gTrajectoryFps;
+    t.position = 0.0;
+    t.currentFrame = 0;
+    t.wantFrame = 0;
+    t.shownSlot = -1;
+    t.quit = false;
+    for (TrajectorySlot& slot : t.slots)
+    {
+        glGenBuffers(1, &slot.vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, slot.vbo);
+        glBufferData(GL_ARRAY_BUFFER, atoms * sizeof(MoleculeInstance), nullptr, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    t.thread = std::thread(trajectoryWorkerLoop);
+    std::cout << "Trajektoria: " << t.frameCount << " ramek, indeks "
+        << (cached ? "wczytany" : "zbudowany") << " w " << static_cast<int>(elapsedMs(start)) << " ms\n";
+    return true;
+}
+
+static void closeTrajectory()
+{
+    Trajectory& t = gTrajectory;
+    if (t.thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(t.mutex);
+            t.quit = true;
+        }
+        t.wake.notify_all();
+        t.thread.join();
+    }
+    for (TrajectorySlot& slot : t.slots)
+    {
+        if (slot.vbo) glDeleteBuffers(1, &slot.vbo);
+        slot = TrajectorySlot();
+    }
+    closeMappedFile(t.file);
+    t.frameOffsets.clear();
+    t.frameCount = 0;
+    t.shownSlot = -1;
+}
+
+static double wrapTrajectoryPosition(const Trajectory& t, double position, bool loop)
+{
+    if (loop)
+    {
+        position = std::fmod(position, static_cast<double>(t.frameCount));
+        if (position < 0.0) position += t.frameCount;
+    }
+    else
+    {
+        position = std::min(std::max(position, 0.0), t.frameCount - 1.0);
+    }
+    return position;
+}
+
+static void seekTrajectory(double position)
+{
+    Trajectory& t = gTrajectory;
+    if (!t.frameCount) return;
+    t.position = wrapTrajectoryPosition(t, position, t.loop);
+    t.currentFrame = static_cast<int>(t.position);
+}
+
+static void stepSimulation(SimState& state, double dt, bool animate, bool trajectoryActive, bool loop)
+{
+    if (!animate) return;
+    state.electronAngleDeg += static_cast<float>(40.0 * dt);
+    if (state.electronAngleDeg >= 360.f) state.electronAngleDeg -= 360.f;
+    if (trajectoryActive)
+        state.trajectoryPosition = wrapTrajectoryPosition(gTrajectory, state.trajectoryPosition + dt * gTrajectory.fps, loop);
+}
+
+static void publishSnapshot(const SimSnapshot& snap)
+{
+    Simulation& sim = gSim;
+    sim.slots[sim.back] = snap;
+    sim.back = sim.middle.exchange(sim.back | SIM_SLOT_FRESH, std::memory_order_acq_rel) & 3;
+}
+
+static const SimSnapshot& latestSnapshot()
+{
+    Simulation& sim = gSim;
+    if (sim.middle.load(std::memory_order_acquire) & SIM_SLOT_FRESH)
+        sim.front = sim.middle.exchange(sim.front, std::memory_order_acq_rel) & 3;
+    return sim.slots[sim.front];
+}
+
+static void simulationLoop(SimState state)
+{
+    using Clock = std::chrono::steady_clock;
+    Simulation& sim = gSim;
+    const auto step = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(SIM_STEP_S));
+    SimSnapshot snap;
+    snap.prev = snap.curr = state;
+    snap.time = Clock::now();
+    publishSnapshot(snap);
+    Clock::time_point next = snap.time + step;
+    std::unique_lock<std::mutex> lock(sim.mutex);
+    while (!sim.quit)
+    {
+        const bool commands = sim.resetAngle || sim.seekPending;
+        if (!sim.animate.load() && !commands)
+        {
+            sim.wake.wait(lock);
+            next = Clock::now();
+            continue;
+        }
+        if (!commands && sim.wake.wait_until(lock, next, [&]() { return sim.quit || sim.resetAngle || sim.seekPending; }))
+            continue;
+        const bool jump = sim.resetAngle || sim.seekPending;
+        if (sim.resetAngle)
+            state.electronAngleDeg = 0.f;
+        if (sim.seekPending)
+            state.trajectoryPosition = sim.seekPosition;
+        sim.resetAngle = sim.seekPending = false;
+        snap.commandSeq = sim.commandSeq;
+        lock.unlock();
+
+        const SimState prev = state;
+        if (!jump)
+        {
+            stepSimulation(state, SIM_STEP_S, sim.animate.load(), sim.trajectoryActive.load(), sim.trajectoryLoop.load());
+            next += step;
+        }
+        snap.prev = jump ? state : prev;
+        snap.curr = state;
+        snap.time = jump ? Clock::now() : next - step;
+        ++snap.step;
+        publishSnapshot(snap);
+        if (Clock::now() - next > step * SIM_MAX_CATCHUP_STEPS)
+            next = Clock::now();
+        lock.lock();
+    }
+}
+
+static void syncSimulationControls()
+{
+    Simulation& sim = gSim;
+    const bool animate = G.animateElectrons;
+    const bool trajectory = G.viewMode == ViewMode::Molecule && gTrajectory.frameCount > 0;
+    bool changed = sim.animate.exchange(animate) != animate;
+    changed = sim.trajectoryActive.exchange(trajectory) != trajectory || changed;
+    sim.trajectoryLoop.store(gTrajectory.loop);
+    if (!changed || !sim.thread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(sim.mutex);
+    }
+    sim.wake.notify_one();
+}
+
+static void startSimulation()
+{
+    Simulation& sim = gSim;
+    SimState state;
+    state.electronAngleDeg = G.electronAngleDeg;
+    state.trajectoryPosition = gTrajectory.position;
+    sim.quit = false;
+    syncSimulationControls();
+    sim.thread = std::thread(simulationLoop, state);
+}
+
+static void stopSimulation()
+{
+    Simulation& sim = gSim;
+    if (!sim.thread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(sim.mutex);
+        sim.quit = true;
+    }
+    sim.wake.notify_all();
+    sim.thread.join();
+}
+
+static bool simulationPending()
+{
+    return gSim.thread.joinable() && latestSnapshot().commandSeq != gSim.commandSeq;
+}
+
+static void requestTrajectorySeek(double position)
+{
+    Simulation& sim = gSim;
+    if (!sim.thread.joinable() || !gTrajectory.frameCount)
+    {
+        seekTrajectory(position);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sim.mutex);
+        sim.seekPending = true;
+        sim.seekPosition = wrapTrajectoryPosition(gTrajectory, position, gTrajectory.loop);
+        ++sim.commandSeq;
+    }
+    sim.wake.notify_one();
+}
+
+static void toggleTrajectoryLoop()
+{
+    Trajectory& t = gTrajectory;
+    {
+        std::lock_guard<std::mutex> lock(t.mutex);
+        t.loop = !t.loop;
+    }
+    t.wake.notify_one();
+}
+
+static void requestAnimationReset()
+{
+    Simulation& sim = gSim;
+    if (!sim.thread.joinable())
+    {
+        G.electronAngleDeg = 0.f;
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sim.mutex);
+        sim.resetAngle = true;
+        ++sim.commandSeq;
+    }
+    sim.wake.notify_one();
+}
+
+static void advanceAnimation(float dt)
+{
+    const bool trajectory = G.viewMode == ViewMode::Molecule && gTrajectory.frameCount > 0;
+    if (!gSim.thread.joinable())
+    {
+        SimState state;
+        state.electronAngleDeg = G.electronAngleDeg;
+        state.trajectoryPosition = gTrajectory.position;
+        stepSimulation(state, dt, G.animateElectrons, trajectory, gTrajectory.loop);
+        G.electronAngleDeg = state.electronAngleDeg;
+        seekTrajectory(state.trajectoryPosition);
+        return;
+    }
+    syncSimulationControls();
+    const SimSnapshot& snap = latestSnapshot();
+    const double alpha = std::min(1.0, std::max(0.0,
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - snap.time).count() / SIM_STEP_S));
+    float angle = snap.curr.electronAngleDeg - snap.prev.electronAngleDeg;
+    if (angle < -180.f) angle += 360.f;
+    G.electronAngleDeg = snap.prev.electronAngleDeg + angle * static_cast<float>(alpha);
+    if (G.electronAngleDeg >= 360.f) G.electronAngleDeg -= 360.f;
+    if (gTrajectory.frameCount)
+    {
+        double frames = snap.curr.trajectoryPosition - snap.prev.trajectoryPosition;
+        if (frames < -0.5 * gTrajectory.frameCount) frames += gTrajectory.frameCount;
+        seekTrajectory(snap.prev.trajectoryPosition + frames * alpha);
+    }
+}
+
+static void pumpTrajectoryUploads()
+{
+    Trajectory& t = gTrajectory;
+    if (!t.frameCount) return;
+    TrajectorySlot* upload = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(t.mutex);
+        if (t.wantFrame != t.currentFrame)
+        {
+            t.wantFrame = t.currentFrame;
+            t.wake.notify_one();
+        }
+        for (int i = 0; i < TRAJECTORY_RING && !upload; ++i)
+        {
+            int f = trajectoryWindowFrame(t, t.currentFrame, i);
+            if (f < 0) break;
+            int s = f % TRAJECTORY_RING;
+            TrajectorySlot& slot = t.slots[s];
+            if (slot.frame != f || !slot.ready || slot.gpuFrame == f) continue;
+            if (s == t.shownSlot && f != t.currentFrame) break;
+            slot.uploading = true;
+            upload = &slot;
+        }
+    }
+    if (upload)
+    {
+        const GLsizeiptr bytes = static_cast<GLsizeiptr>(t.atoms * sizeof(MoleculeInstance));
+        glBindBuffer(GL_ARRAY_BUFFER, upload->vbo);
+        glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, upload->instances.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        upload->gpuBounds = upload->bounds;
+        {
+            std::lock_guard<std::mutex> lock(t.mutex);
+            upload->gpuFrame = upload->frame;
+            upload->uploading = false;
+        }
+        t.wake.notify_one();
+    }
+    const int current = t.currentFrame % TRAJECTORY_RING;
+    if (t.slots[current].gpuFrame == t.currentFrame)
+        t.shownSlot = current;
+}
+
+static GLuint moleculeInstanceVbo()
+{
+    const Trajectory& t = gTrajectory;
+    if (t.frameCount && t.shownSlot >= 0)
+        return t.slots[t.shownSlot].vbo;
+    return gMolecule.instanceVbo;
+}
+
+static const std::vector<NodeBounds>& moleculeNodeBounds()
+{
+    const Trajectory& t = gTrajectory;
+    if (t.frameCount && t.shownSlot >= 0)
+        return t.slots[t.shownSlot].gpuBounds;
+    return gMolecule.bounds;
+}
+
+static bool loadMolecule(const std::string& path)
+{
+    auto start = std::chrono::steady_clock::now();
+    MappedFile file;
+    if (!openMappedFile(path, file))
+    {
+        std::cerr << "Nie udalo sie otworzyc struktury: " << path << "\n";
+        return false;
+    }
+    std::string ext = std::filesystem::path(path).extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) { return static_cast<char>(c | 0x20); });
+    MoleculeData mol;
+    std::string error;
+    const bool pdb = ext == ".pdb" || ext == ".ent";
+    bool ok = pdb ? parsePdbMolecule(file, mol, error) : parseXyzMolecule(file, mol, error);
+    closeMappedFile(file);
+    if (!ok)
+    {
+        std::cerr << "Blad wczytywania " << path << ": " << error << "\n";
+        return false;
+    }
+    const double parseMs = elapsedMs(start);
+    computeMoleculeBounds(mol);
+    buildMoleculeOctree(mol);
+    mol.instanceVbo = gMolecule.instanceVbo;
+    uploadMoleculeInstances(mol);
+    mol.name = std::filesystem::path(path).filename().string();
+    gMolecule = std::move(mol);
+    gGuiOverlay.statusKey = GuiStatusKey();
+    std::cout << "Wczytano " << gMolecule.elements.size() << " atomow z " << gMolecule.name
+        << " (parsowanie " << std::fixed << std::setprecision(1) << parseMs << " ms, razem "
+        << elapsedMs(start) << " ms)\n" << std::defaultfloat;
+    closeTrajectory();
+    if (!pdb)
+        openTrajectory(path, gMolecule);
+    return true;
+}
+
+static void freeMolecule()
+{
+    closeTrajectory();
+    if (gMolecule.instanceVbo)
+        glDeleteBuffers(1, &gMolecule.instanceVbo);
+    gMolecule = MoleculeData();
+}
+
+static void drawMolecule()
+{
+    const size_t count = gMolecule.elements.size();
+    if (!count) return;
+    pushModel();
+    scaleModel(SHELL_RADII.radius[2] / gMolecule.radius);
+    std::vector<InstanceRun>& runs = gMoleculeRuns;
+    collectVisibleRuns(gMolecule.octree, gMoleculeProgram ? moleculeNodeBounds() : gMolecule.bounds,
+        currentModelView(), runs);
+    if (gMoleculeProgram)
+    {
+        useProgram(gMoleculeProgram);
+        const GLuint instanceVbo = moleculeInstanceVbo();
+        for (const InstanceRun& run : runs)
+        {
+            const Mesh& sphere = sphereLodMesh(1.0f, run.lod);
+            const size_t base = run.first * sizeof(MoleculeInstance);
+            bindMesh(sphere);
+            glBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+            enableInstanceAttrib(MOLECULE_INSTANCE_ATTRIB, 4, GL_FLOAT, GL_FALSE, sizeof(MoleculeInstance),
+                base + offsetof(MoleculeInstance, position));
+            enableInstanceAttrib(MOLECULE_COLOR_ATTRIB, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(MoleculeInstance),
+                base + offsetof(MoleculeInstance, color));
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            drawMesh(sphere, static_cast<GLsizei>(run.count));
+            disableInstanceAttrib(MOLECULE_INSTANCE_ATTRIB);
+            disableInstanceAttrib(MOLECULE_COLOR_ATTRIB);
+        }
+    }
+    else
+    {
+        useProgram(gAtomProgram);
+        for (const InstanceRun& run : runs)
+        {
+            const Mesh& sphere = sphereLodMesh(1.0f, run.lod);
+            for (size_t i = run.first; i < run.first + run.count; ++i)
+            {
+                uint8_t color[4];
+                float radius = 1.f;
+                elementStyle(gMolecule.elements[i], color, radius);
+                setColor(color[0] / 255.f, color[1] / 255.f, color[2] / 255.f);
+                pushModel();
+                translateModel(gMolecule.positions[i * 3] - gMolecule.center[0],
+                    gMolecule.positions[i * 3 + 1] - gMolecule.center[1],
+                    gMolecule.positions[i * 3 + 2] - gMolecule.center[2]);
+                scaleModel(radius);
+                drawMesh(sphere);
+                popModel();
+            }
+        }
+    }
+    useProgram(0);
+    popModel();
+}
+
+static void drawAtom()
+{
+    syncWaveSolver();
+    if (G.viewMode == ViewMode::Molecule)
+    {
+        drawMolecule();
+        return;
+    }
+    if (G.viewMode == ViewMode::WavePacket)
+    {
+        drawWavePacket();
+        return;
+    }
+    pushModel();
+    scaleModel(sceneFitScale(countActiveShells()));
+    if (G.showLocalAxes)
+        drawAxes(0.5f);
+    useProgram(gAtomProgram);
+    if (G.viewMode == ViewMode::BohrOrbits)
+        drawAtomBohrModel();
+    else if (G.viewMode == ViewMode::Isosurface)
+        drawAtomIsosurface();
+    else if (G.cloudVolume)
+        drawAtomVolume();
+    else
+        drawAtomProbabilityCloud();
+    useProgram(0);
+    popModel();
+}
+
+static void drawGuiOverlay(sf::RenderTarget& win);
+
+static void drawScene(float dt)
+{
+    {
+        ProfileScope scope(ProfileStage::Animation, false);
+        advanceAnimation(dt);
+    }
+    {
+        ProfileScope scope(ProfileStage::Background);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        drawBackgroundQuad();
+    }
+    {
+        ProfileScope scope(ProfileStage::View);
+        setupView();
+        if (!gCoreProfile)
+        {
+            GLfloat lightPos[] = { 2.0f, 3.0f, 4.0f, 1.0f };
+            glLightfv(GL_LIGHT0, GL_POSITION, lightPos);
+        }
+        rotateModel(G.rotX, 1.f, 0.f, 0.f);
+        rotateModel(G.rotY, 0.f, 1.f, 0.f);
+        gCullStats = CullStats();
+    }
+    {
+        ProfileScope scope(ProfileStage::Atom);
+        drawAtom();
+    }
+}
+
+static void renderFrame(sf::RenderTarget& target, float dt)
+{
+    profilerBeginFrame();
+    {
+        ProfileScope scope(ProfileStage::Uploads);
+        pumpCloudUploads();
+        pumpTrajectoryUploads();
+        pumpAssetUploads();
+        pumpVolumeBake();
+    }
+    drawScene(dt);
+    {
+        ProfileScope scope(ProfileStage::Gui);
+        drawGuiOverlay(target);
+    }
+    endGlStateFrame();
+    profilerEndFrame();
+}
+
+static std::string guiStatusText()
+{
+    const ElementInfo* el = getCurrentElement();
+    std::ostringstream oss;
+    if (G.viewMode == ViewMode::Molecule)
+    {
+        oss << "Struktura: " << gMolecule.name << "   atomow: " << gMolecule.elements.size();
+        if (gTrajectory.frameCount)
+            oss << "   ramka: " << gTrajectory.currentFrame + 1 << " / " << gTrajectory.frameCount
+                << (gTrajectory.loop ? " (petla)" : "");
+    }
+    else if (el)
+    {
+        oss << "Atom: Z = " << el->Z << "   "
+            << el->symbol << " (" << el->name << ")";
+    }
+    else
+    {
+        oss << "Atom: (nieznany), e- = " << G.electronCount;
+    }
+    oss << "\nTryb widoku: ";
+    if (G.viewMode == ViewMode::BohrOrbits)
+        oss << "orbity kolowe (Bohr)";
+    else if (G.viewMode == ViewMode::ProbabilityCloud && G.cloudVolume)
+        oss << "chmury prawdopodobienstwa (wolumetria CPU, " << volumeThreadCount() << " watkow)";
+    else if (G.viewMode == ViewMode::ProbabilityCloud)
+        oss << "chmury prawdopodobienstwa (mieszanie: " << cloudBlendName(activeCloudBlend())
+            << (G.cloudSplats && gCloudSplatProgram ? ", splaty" : ", punkty") << ")";
+    else if (G.viewMode == ViewMode::Isosurface)
+    {
+        oss << "izopowierzchnia gestosci " << std::setprecision(3) << isoDensity(G.isoLevel)
+            << " e/j^3 (siatka " << gIsoGridSize << "^3";
+        auto it = gIso.meshes.find(IsoKey{ el ? el->Z : 1, G.isoLevel, gIsoGridSize });
+        if (it != gIso.meshes.end())
+            oss << ", " << it->second.triangles << " trojkatow";
+        oss << ")";
+    }
+    else if (G.viewMode == ViewMode::WavePacket)
+    {
+        const WaveStats& st = gWave.shown;
+        oss << "pakiet falowy (siatka " << gWaveGridSize << "^3, t = " << std::fixed << std::setprecision(2) << st.time
+            << " j.a., " << std::setprecision(1) << (st.stepMs > 0.0 ? 1000.0 / st.stepMs : 0.0) << " krokow/s, norma "
+            << std::setprecision(3) << st.norm << ")";
+    }
+    else
+        oss << "struktura (czasteczka/krysztal)";
+    return oss.str();
+}
+
+static const char* GUI_HELP_TEXT =
+    "Sterowanie:\n"
+    "Strzalki: obrot sceny\n"
+    "1 / 2 / 4 / 5: orbity / chmury / izopow. / pakiet\n"
+    "3: wczytana struktura\n"
+    ", / . PgUp/PgDn Home/End L: trajektoria\n"
+    "Num+/-: liczba elektronow (1..118)\n"
+    "Spacja: animacja ON/OFF\n"
+    "A: lokalne osie ON/OFF\n"
+    "P: profiler ON/OFF\n"
+    "M: tryb oszczedny / opoznienie\n"
+    "O: mieszanie chmury alfa / OIT / sort.\n"
+    "S: splaty Gaussa / punkty\n"
+    "V: wolumetria CPU ON/OFF\n"
+    "[ / ] G: poziom / siatka izopowierzchni\n"
+    "R: reset widoku\n"
+    "Esc: wyjscie";
+
+static void appendGlyphQuad(std::vector<float>& v, const sf::Glyph& glyph, float x, float y)
+{
+    const float padding = 1.0f;
+    const float left = x + glyph.bounds.left - padding;
+    const float top = y + glyph.bounds.top - padding;
+    const float right = x + glyph.bounds.left + glyph.bounds.width + padding;
+    const float bottom = y + glyph.bounds.top + glyph.bounds.height + padding;
+    const float u1 = glyph.textureRect.left - padding;
+    const float v1 = glyph.textureRect.top - padding;
+    const float u2 = glyph.textureRect.left + glyph.textureRect.width + padding;
+    const float v2 = glyph.textureRect.top + glyph.textureRect.height + padding;
+    v.insert(v.end(),
+    {
+        left, top, u1, v1,   right, top, u2, v1,   right, bottom, u2, v2,
+        left, top, u1, v1,   right, bottom, u2, v2,   left, bottom, u1, v2,
+    });
 }
 
-static GLuint compileShader(GLenum type, const char* src)
+static void appendTextQuads(std::vector<float>& v, const std::string& str, unsigned size, float x, float y)
 {
-    GLuint shader = glCreateShader(type);
-    if (!shader) return 0;
-    glShaderSource(shader, 1, &src, nullptr);
-    glCompileShader(shader);
-    GLint status = GL_FALSE;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
-    if (status != GL_TRUE)
+    const float lineSpacing = gFont.getLineSpacing(size);
+    float penX = x;
+    float penY = y + static_cast<float>(size);
+    sf::Uint32 prev = 0;
+    for (unsigned char c : str)
     {
-        GLint logLength = 0;
-        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
-        if (logLength > 0)
+        if (c == '\n')
         {
-            std::string log(logLength, '\0');
-            glGetShaderInfoLog(shader, logLength, nullptr, &log[0]);
-            std::cerr << "Błąd kompilacji shadera: " << log << std::endl;
+            penX = x;
+            penY += lineSpacing;
+            prev = 0;
+            continue;
         }
-        glDeleteShader(shader);
-        return 0;
+        penX += gFont.getKerning(prev, c, size);
+        prev = c;
+        const sf::Glyph& glyph = gFont.getGlyph(c, size, false);
+        appendGlyphQuad(v, glyph, std::floor(penX), std::floor(penY));
+        penX += glyph.advance;
     }
-    return shader;
 }
 
-static void initAtomShader()
+static GuiStatusKey currentGuiStatusKey()
 {
-    const char* vsSrc = R"(
-        varying vec3 vNormal;
-        varying vec3 vPosEye;
-        varying vec4 vColor;
-
-        void main()
-        {
-            vec4 posEye = gl_ModelViewMatrix * gl_Vertex;
-            vPosEye = posEye.xyz;
-            vNormal = normalize(gl_NormalMatrix * gl_Normal);
-            vColor = gl_Color;
-            gl_Position = gl_ProjectionMatrix * posEye;
-        }
-    )";
-
-    const char* fsSrc = R"(
-        varying vec3 vNormal;
-        varying vec3 vPosEye;
-        varying vec4 vColor;
-
-        void main()
-        {
-            vec3 N = normalize(vNormal);
-            vec3 V = normalize(-vPosEye);
-            vec3 lightPos = vec3(2.0, 3.0, 4.0);
-            vec3 L = normalize(lightPos - vPosEye);
-            float NdotL = max(dot(N, L), 0.0);
-            vec3 baseColor = vColor.rgb;
-            vec3 ambient = 0.15 * baseColor;
-            vec3 diffuse = 0.75 * baseColor * NdotL;
-            vec3 specular = vec3(0.0);
-            if (NdotL > 0.0)
-            {
-                vec3 R = reflect(-L, N);
-                float RdotV = max(dot(R, V), 0.0);
-                specular = vec3(0.8) * pow(RdotV, 32.0);
-            }
-            vec3 color = ambient + diffuse + specular;
-            float rim = 1.0 - max(dot(N, V), 0.0);
-            float rimFactor = pow(rim, 3.0);
-            vec3 rimColor = vec3(0.2, 0.4, 1.0);
-            color += rimColor * rimFactor;
-            gl_FragColor = vec4(color, vColor.a);
-        }
-    )";
-
-    GLuint vs = compileShader(GL_VERTEX_SHADER, vsSrc);
-    GLuint fs = compileShader(GL_FRAGMENT_SHADER, fsSrc);
-    if (!vs || !fs)
+    GuiStatusKey key;
+    key.electronCount = G.electronCount;
+    key.viewMode = G.viewMode;
+    key.cloudBlend = activeCloudBlend();
+    key.cloudSplats = G.cloudSplats;
+    key.cloudVolume = G.cloudVolume;
+    key.isoLevel = G.isoLevel;
+    key.isoGrid = gIsoGridSize;
+    key.waveSteps = gWave.shown.steps;
+    key.atoms = gMolecule.elements.size();
+    key.frame = gTrajectory.currentFrame;
+    key.frameCount = gTrajectory.frameCount;
+    key.loop = gTrajectory.loop;
+    return key;
+}
+
+static bool sameGuiStatus(const GuiStatusKey& a, const GuiStatusKey& b)
+{
+    return a.electronCount == b.electronCount && a.viewMode == b.viewMode
+        && a.cloudBlend == b.cloudBlend && a.cloudSplats == b.cloudSplats && a.cloudVolume == b.cloudVolume
+        && a.isoLevel == b.isoLevel && a.isoGrid == b.isoGrid && a.waveSteps == b.waveSteps && a.atoms == b.atoms
+        && a.frame == b.frame && a.frameCount == b.frameCount && a.loop == b.loop;
+}
+
+static void initGuiOverlay()
+{
+    GuiOverlay& o = gGuiOverlay;
+    o.blocks[static_cast<int>(GuiBlock::Status)] = { std::string(), 18, 10.f, 10.f, true };
+    o.blocks[static_cast<int>(GuiBlock::Help)] = { GUI_HELP_TEXT, 18, 10.f, 70.f, true };
+    o.blocks[static_cast<int>(GuiBlock::Profiler)] = { std::string(), 14, 10.f, 434.f, false };
+    o.initialized = true;
+    o.dirty = true;
+}
+
+static void rebuildGuiOverlay()
+{
+    GuiOverlay& o = gGuiOverlay;
+    o.vertices.clear();
+    o.ranges.clear();
+    for (const GuiTextBlock& block : o.blocks)
     {
-        std::cerr << "Nie udało się skompilować shaderów atomu, używam tylko potoku stałego.\n";
-        if (vs) glDeleteShader(vs);
-        if (fs) glDeleteShader(fs);
-        return;
+        if (!block.visible || block.text.empty()) continue;
+        const GLint first = static_cast<GLint>(o.vertices.size() / 4);
+        appendTextQuads(o.vertices, block.text, block.size, block.x, block.y);
+        const GLsizei count = static_cast<GLsizei>(o.vertices.size() / 4) - first;
+        if (!o.ranges.empty() && o.ranges.back().size == block.size)
+            o.ranges.back().count += count;
+        else if (count > 0)
+            o.ranges.push_back({ block.size, 0, first, count });
     }
-    gAtomProgram = glCreateProgram();
-    glAttachShader(gAtomProgram, vs);
-    glAttachShader(gAtomProgram, fs);
-    glLinkProgram(gAtomProgram);
-    GLint linkStatus = GL_FALSE;
-    glGetProgramiv(gAtomProgram, GL_LINK_STATUS, &linkStatus);
-    if (linkStatus != GL_TRUE)
+    for (GuiDrawRange& range : o.ranges)
     {
-        GLint logLength = 0;
-        glGetProgramiv(gAtomProgram, GL_INFO_LOG_LENGTH, &logLength);
-        if (logLength > 0)
+        const sf::Texture& texture = gFont.getTexture(range.size);
+        range.texture = texture.getNativeHandle();
+        const float invW = 1.f / texture.getSize().x;
+        const float invH = 1.f / texture.getSize().y;
+        for (size_t i = size_t(range.first) * 4; i < size_t(range.first + range.count) * 4; i += 4)
         {
-            std::string log(logLength, '\0');
-            glGetProgramInfoLog(gAtomProgram, logLength, nullptr, &log[0]);
-            std::cerr << "Błąd linkowania programu shaderów: " << log << std::endl;
+            o.vertices[i + 2] *= invW;
+            o.vertices[i + 3] *= invH;
         }
-        glDeleteProgram(gAtomProgram);
-        gAtomProgram = 0;
     }
-    glDeleteShader(vs);
-    glDeleteShader(fs);
-    if (gAtomProgram)
-        std::cout << "Shadery atomu (Phong + rim lighting) zainicjalizowane.\n";
+    if (!gTextVbo)
+        glGenBuffers(1, &gTextVbo);
+    glBindBuffer(GL_ARRAY_BUFFER, gTextVbo);
+    glBufferData(GL_ARRAY_BUFFER, o.vertices.size() * sizeof(float), o.vertices.data(), GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    o.dirty = false;
 }
 
-
-static bool loadBackgroundTexture(const std::string& path)
+static void updateGuiOverlay()
 {
-    sf::Image img;
-    if (!img.loadFromFile(path))
+    GuiOverlay& o = gGuiOverlay;
+    if (!o.initialized)
+        initGuiOverlay();
+    const GuiStatusKey key = currentGuiStatusKey();
+    if (!sameGuiStatus(key, o.statusKey))
     {
-        std::cerr << "Nie udalo sie wczytac tekstury tla: " << path << "\n";
-        return false;
+        o.statusKey = key;
+        o.blocks[static_cast<int>(GuiBlock::Status)].text = guiStatusText();
+        o.dirty = true;
     }
-    img.flipVertically();
-    if (gBackgroundTex == 0)
-        glGenTextures(1, &gBackgroundTex);
-    glBindTexture(GL_TEXTURE_2D, gBackgroundTex);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexImage2D(
-        GL_TEXTURE_2D, 0, GL_RGBA,
-        img.getSize().x, img.getSize().y, 0,
-        GL_RGBA, GL_UNSIGNED_BYTE, img.getPixelsPtr()
-    );
-    glBindTexture(GL_TEXTURE_2D, 0);
-    std::cout << "Tekstura tla zaladowana: " << path << "\n";
-    return true;
+    GuiTextBlock& hud = o.blocks[static_cast<int>(GuiBlock::Profiler)];
+    if (hud.visible != gProfiler.hudVisible)
+    {
+        hud.visible = gProfiler.hudVisible;
+        o.hudUpdated = std::chrono::steady_clock::time_point();
+        o.dirty = true;
+    }
+    if (hud.visible)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        if (now - o.hudUpdated >= std::chrono::milliseconds(GUI_HUD_REFRESH_MS))
+        {
+            hud.text = profilerHudText();
+            o.hudUpdated = now;
+            o.dirty = true;
+        }
+    }
+    if (o.dirty)
+        rebuildGuiOverlay();
 }
 
-static void drawBackgroundQuad()
+static void drawGuiOverlay(sf::RenderTarget& win)
 {
-    if (!gBackgroundTexLoaded || gBackgroundTex == 0)
-        return;
-    GLboolean lighting = glIsEnabled(GL_LIGHTING);
-    if (lighting) glDisable(GL_LIGHTING);
-    GLfloat prevColor[4];
-    glGetFloatv(GL_CURRENT_COLOR, prevColor);
-    glUseProgram(0);
-    GLint viewport[4];
-    glGetIntegerv(GL_VIEWPORT, viewport);
-    float w = static_cast<float>(viewport[2]);
-    float h = static_cast<float>(viewport[3]);
-    if (h == 0.f) h = 1.f;
-    float aspect = w / h;
-    const float depth = 10.f;
-    float halfHeight = depth * std::tan(deg2rad(G.fovDeg * 0.5f));
-    float halfWidth = halfHeight * aspect;
-    glMatrixMode(GL_MODELVIEW);
-    glPushMatrix();
+    if (!gFontLoaded) return;
+    updateGuiOverlay();
+    const GuiOverlay& o = gGuiOverlay;
+    if (o.ranges.empty()) return;
+    const sf::View& view = gGuiViewInitialized ? gGuiView : win.getDefaultView();
+    const float w = view.getSize().x;
+    const float h = view.getSize().y;
+    setDepthTest(false);
+    setBlending(true);
+    setColor(1.f, 1.f, 1.f);
+    bool lighting = false;
+    GLuint prevProgram = 0;
+    if (gCoreProfile)
+    {
+        useProgram(gTextProgram);
+        glUniform2f(gTextScreenLoc, w, h);
+        bindVertexArray(gTextVao);
+    }
+    else
     {
+        lighting = lightingEnabled();
+        prevProgram = currentProgram();
+        setLighting(false);
+        useProgram(0);
+        glMatrixMode(GL_PROJECTION);
+        glPushMatrix();
+        glLoadIdentity();
+        glOrtho(0.0, w, h, 0.0, -1.0, 1.0);
+        glMatrixMode(GL_MODELVIEW);
+        glPushMatrix();
         glLoadIdentity();
-        glTranslatef(0.f, 0.f, -depth);
         glEnable(GL_TEXTURE_2D);
-        glBindTexture(GL_TEXTURE_2D, gBackgroundTex);
-        glColor4f(1.f, 1.f, 1.f, 1.f);
-        glBegin(GL_QUADS);
-        glTexCoord2f(0.f, 0.f); glVertex3f(-halfWidth, -halfHeight, 0.f);
-        glTexCoord2f(1.f, 0.f); glVertex3f(halfWidth, -halfHeight, 0.f);
-        glTexCoord2f(1.f, 1.f); glVertex3f(halfWidth, halfHeight, 0.f);
-        glTexCoord2f(0.f, 1.f); glVertex3f(-halfWidth, halfHeight, 0.f);
-        glEnd();
-        glBindTexture(GL_TEXTURE_2D, 0);
+        glBindBuffer(GL_ARRAY_BUFFER, gTextVbo);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glVertexPointer(2, GL_FLOAT, 4 * sizeof(float), nullptr);
+        glTexCoordPointer(2, GL_FLOAT, 4 * sizeof(float), reinterpret_cast<const void*>(2 * sizeof(float)));
+    }
+    for (const GuiDrawRange& range : o.ranges)
+    {
+        glBindTexture(GL_TEXTURE_2D, range.texture);
+        glDrawArrays(GL_TRIANGLES, range.first, range.count);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    if (!gCoreProfile)
+    {
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
         glDisable(GL_TEXTURE_2D);
+        glPopMatrix();
+        glMatrixMode(GL_PROJECTION);
+        glPopMatrix();
+        glMatrixMode(GL_MODELVIEW);
+        setLighting(lighting);
+        useProgram(prevProgram);
     }
-    glPopMatrix();
-    glColor4fv(prevColor);
-    if (lighting) glEnable(GL_LIGHTING);
+    setDepthTest(true);
 }
 
-static void setupProjection(sf::Vector2u s)
+static sf::ContextSettings makeContextSettings()
 {
-    if (!s.y) s.y = 1;
-    const double aspect = s.x / static_cast<double>(s.y);
-    glViewport(0, 0, (GLsizei)s.x, (GLsizei)s.y);
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluPerspective(G.fovDeg, aspect, G.nearP, G.farP);
-    glMatrixMode(GL_MODELVIEW);
+    sf::ContextSettings cs;
+    cs.depthBits = 24;
+    cs.stencilBits = 8;
+    cs.majorVersion = 2;
+    cs.minorVersion = 1;
+    if (gCoreProfile)
+    {
+        cs.majorVersion = 3;
+        cs.minorVersion = 3;
+        cs.attributeFlags = sf::ContextSettings::Core;
+    }
+    return cs;
 }
 
-static void setupView()
+static void shaderWatcherLoop(std::vector<ShaderProgram> programs)
 {
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
-    gluLookAt(G.eye.x, G.eye.y, G.eye.z,
-        G.center.x, G.center.y, G.center.z,
-        G.up.x, G.up.y, G.up.z);
+    sf::Context context(makeContextSettings(), 1, 1);
+    ShaderWatcher& w = gShaderWatcher;
+    std::unique_lock<std::mutex> lock(w.mutex);
+    while (!w.wake.wait_for(lock, std::chrono::milliseconds(SHADER_WATCH_INTERVAL_MS), [&]() { return w.quit; }))
+    {
+        lock.unlock();
+        for (size_t i = 0; i < programs.size(); ++i)
+        {
+            ShaderProgram& p = programs[i];
+            bool changed = false;
+            for (const auto& file : p.files)
+                changed = changed || fileTimeStamp(file.first) != file.second;
+            if (!changed) continue;
+            ShaderSource src;
+            const bool ok = readShaderSource(p, src);
+            p.files = src.files;
+            if (!ok || src.key == p.key) continue;
+            p.key = src.key;
+            bool cached = false;
+            GLuint program = buildProgram(p, src, cached);
+            if (!program) continue;
+            glFinish();
+            std::lock_guard<std::mutex> readyLock(w.mutex);
+            w.ready.push_back({ i, program, src.key });
+        }
+        lock.lock();
+    }
 }
 
-static void drawAxes(float len = 0.4f)
+static void startShaderWatcher()
 {
-    GLboolean lighting = glIsEnabled(GL_LIGHTING);
-    GLint prevProgram = 0;
-    glGetIntegerv(GL_CURRENT_PROGRAM, &prevProgram);
-    GLfloat prevColor[4];
-    glGetFloatv(GL_CURRENT_COLOR, prevColor);
-    GLfloat prevLineWidth = 1.0f;
-    glGetFloatv(GL_LINE_WIDTH, &prevLineWidth);
-    glUseProgram(0);
-    if (lighting) glDisable(GL_LIGHTING);
-    glLineWidth(2.0f);
-    glBegin(GL_LINES);
-    glColor3f(1, 0, 0); glVertex3f(0, 0, 0); glVertex3f(+len, 0, 0);
-    glColor3f(0, 1, 0); glVertex3f(0, 0, 0); glVertex3f(0, +len, 0);
-    glColor3f(0, 0, 1); glVertex3f(0, 0, 0); glVertex3f(0, 0, +len);
-    glEnd();
-    glLineWidth(prevLineWidth);
-    glColor4fv(prevColor);
-    if (lighting) glEnable(GL_LIGHTING);
-    glUseProgram(prevProgram);
+    if (!gShaderWatchEnabled || gShaderPrograms.empty())
+        return;
+    gShaderWatcher.quit = false;
+    gShaderWatcher.thread = std::thread(shaderWatcherLoop, gShaderPrograms);
+    std::cout << "Obserwowanie shaderow w " << gShaderDir << " - zmiany przeladowywane w tle.\n";
 }
 
+static void stopShaderWatcher()
+{
+    ShaderWatcher& w = gShaderWatcher;
+    if (!w.thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(w.mutex);
+        w.quit = true;
+    }
+    w.wake.notify_all();
+    w.thread.join();
+    for (const ShaderReload& reload : w.ready)
+        glDeleteProgram(reload.program);
+    w.ready.clear();
+}
 
-static void initQuadric()
+static bool applyShaderReloads()
 {
-    gQuad = gluNewQuadric();
-    if (gQuad)
-        gluQuadricNormals(gQuad, GLU_SMOOTH);
+    if (!gShaderWatcher.thread.joinable())
+        return false;
+    std::vector<ShaderReload> ready;
+    {
+        std::lock_guard<std::mutex> lock(gShaderWatcher.mutex);
+        ready.swap(gShaderWatcher.ready);
+    }
+    for (const ShaderReload& reload : ready)
+    {
+        ShaderProgram& p = gShaderPrograms[reload.index];
+        installProgram(p, reload.program);
+        p.key = reload.key;
+        std::cout << "Przeladowano shader: " << p.name << "\n";
+    }
+    return !ready.empty();
 }
 
-static void freeQuadric()
+static bool initRenderer(sf::Vector2u size)
 {
-    if (gQuad)
+    if (gCoreProfile)
+        glewExperimental = GL_TRUE;
+    GLenum err = glewInit();
+    if (err != GLEW_OK)
+    {
+        std::cerr << "Blad inicjalizacji GLEW: " << glewGetErrorString(err) << "\n";
+        return false;
+    }
+    std::cout << "OpenGL: " << glGetString(GL_VERSION)
+        << " (" << glGetString(GL_RENDERER) << ")"
+        << (gCoreProfile ? ", profil core" : "") << "\n";
+    gShaderDriverId = std::string(reinterpret_cast<const char*>(glGetString(GL_VENDOR))) + "|"
+        + reinterpret_cast<const char*>(glGetString(GL_RENDERER)) + "|"
+        + reinterpret_cast<const char*>(glGetString(GL_VERSION));
+    GLint binaryFormats = 0;
+    if (GLEW_ARB_get_program_binary)
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binaryFormats);
+    gProgramBinarySupported = binaryFormats > 0;
+    sf::Clock shaderTimer;
+    if (gCoreProfile)
     {
-        gluDeleteQuadric(gQuad);
-        gQuad = nullptr;
+        glGetError();
+        if (!GLEW_VERSION_3_3)
+        {
+            std::cerr << "Kontekst OpenGL 3.3 core jest niedostepny.\n";
+            return false;
+        }
+        if (!initCoreResources())
+            return false;
+    }
+    initOpenGL();
+    setupProjection(size);
+    initMeshCache();
+    if (!gCoreProfile)
+        initLighting();
+    initAtomShader();
+    initCloudShader();
+    initCloudColormap();
+    initElectronShaders();
+    initMoleculeShader();
+    std::cout << "Shadery: " << gShaderLoadStats.linked + gShaderLoadStats.cached << " programow ("
+        << gShaderLoadStats.cached << " z cache binarnego) w " << shaderTimer.getElapsedTime().asMilliseconds() << " ms\n";
+    if (gCoreProfile && (!gAtomProgram || !gCloudProgram || !gElectronProgram || !gMoleculeProgram))
+        return false;
+    if (!gMoleculePath.empty())
+    {
+        if (!loadMolecule(gMoleculePath))
+            return false;
+        G.viewMode = ViewMode::Molecule;
     }
+    startWorkerPool();
+    startCloudWorker();
+    startCloudSorter();
+    startVolumeRenderer();
+    requestCloudBuild(G.electronCount);
+    initProfiler();
+    startAssetLoader();
+    requestAsset(AssetKind::Texture, "resources/stars.png", &gBackgroundTex);
+    requestAsset(AssetKind::Font, "resources/fonts/arial.ttf");
+    return true;
 }
 
-static void drawSphere(float radius, int slices = 32, int stacks = 16)
+static void shutdownRenderer()
 {
-    gluSphere(gQuad, radius, slices, stacks);
+    stopSimulation();
+    stopShaderWatcher();
+    freeMeshCache();
+    freeShaderPrograms();
+    if (gElectronInstanceVbo) glDeleteBuffers(1, &gElectronInstanceVbo);
+    gElectronInstanceVbo = 0;
+    gElectronInstancesFor = 0;
+    freeMolecule();
+    stopCloudWorker();
+    stopCloudSorter();
+    stopVolumeRenderer();
+    stopWaveSolver();
+    freeIsoMeshes();
+    freeCloudBuffers();
+    freeOitTargets();
+    if (gCloudColormap) glDeleteTextures(1, &gCloudColormap);
+    gCloudColormap = 0;
+    shutdownProfiler();
+    stopAssetLoader();
+    stopWorkerPool();
+    if (gBackgroundTex) glDeleteTextures(1, &gBackgroundTex);
+    gBackgroundTex = 0;
+    freeCoreResources();
+    gGuiOverlay = GuiOverlay();
 }
 
-static void initCloudPoints()
+static void printUsage(const char* exe)
 {
-    gCloudPoints.clear();
-    std::srand(0);
-    const int pointsPerShell = 1500;
+    std::cout
+        << "Uzycie: " << exe << " [opcje]\n"
+        << "  --benchmark          tryb bez okna: render offscreen i pomiar czasu klatek\n"
+        << "  --frames N           liczba mierzonych klatek na przebieg (domyslnie 300)\n"
+        << "  --warmup N           liczba klatek rozgrzewkowych (domyslnie 10)\n"
+        << "  --dt S               staly krok animacji w sekundach (domyslnie 1/60)\n"
+        << "  --size WxH           rozdzielczosc bufora offscreen (domyslnie 1024x768)\n"
+        << "  --dump-dir DIR       zapis wybranych klatek do PNG w katalogu DIR\n"
+        << "  --dump-frame N       numer klatki do zapisu (mozna podac wielokrotnie)\n"
+        << "  --cloud-points N     liczba probek chmury elektronowej (domyslnie 200000)\n"
+        << "  --cloud-seed N       ziarno generatora chmury\n"
+        << "  --cloud-blend MODE   mieszanie chmury: oit (domyslnie), alpha lub sorted (sortowanie CPU)\n"
+        << "  --no-splats          chmura z punktow stalej wielkosci zamiast splatow Gaussa\n"
+        << "  --volume             chmura jako wolumetria liczona na CPU (ray marching gestosci)\n"
+        << "  --volume-threads N   liczba watkow wolumetrii (domyslnie liczba rdzeni)\n"
+        << "  --iso-grid N         rozdzielczosc siatki izopowierzchni (domyslnie 96)\n"
+        << "  --wave-grid N        rozmiar siatki pakietu falowego, potega 2 od 32 do 256 (domyslnie 128)\n"
+        << "  --cloud-cache DIR    katalog cache wygenerowanych chmur (domyslnie cache)\n"
+        << "  --no-cloud-cache     wylaczenie cache chmur na dysku\n"
+        << "  --load FILE          wczytanie struktury XYZ/PDB (tryb 3); wieloramkowy XYZ = trajektoria\n"
+        << "  --traj-fps N         tempo odtwarzania trajektorii w ramkach/s (domyslnie 30)\n"
+        << "  --profile-out FILE   zapis czasow etapow kazdej klatki (CPU/GPU) do pliku CSV\n"
+        << "  --core               renderer OpenGL 3.3 core (VAO, bufor uniformow, shadery GLSL 330)\n"
+        << "  --no-shader-cache    wylaczenie cache binarnego programow shaderow (cache/shaders)\n"
+        << "  --watch-shaders      przeladowanie shaderow z resources/shaders po zapisie pliku\n"
+        << "  --no-texture-cache   wylaczenie cache tekstur skompresowanych DXT1 (cache/textures)\n"
+        << "  --fps N              limit klatek na sekunde podczas animacji (0 = synchronizacja pionowa)\n"
+        << "  --pacing MODE        power (domyslnie: vsync, czysty sen) lub latency (bez vsync, sen + aktywne czekanie)\n";
+}
 
-    for (int s = 0; s < MAX_SHELLS; ++s)
+static bool parseCommandLine(int argc, char** argv, BenchmarkOptions& bench)
+{
+    for (int i = 1; i < argc; ++i)
     {
-        float R = shellRadius(s);
-        for (int i = 0; i < pointsPerShell; ++i)
+        const char* arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (std::strcmp(arg, "--benchmark") == 0)
+            bench.enabled = true;
+        else if (std::strcmp(arg, "--frames") == 0 && hasValue)
+            bench.frames = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(arg, "--warmup") == 0 && hasValue)
+            bench.warmupFrames = std::max(0, std::atoi(argv[++i]));
+        else if (std::strcmp(arg, "--dt") == 0 && hasValue)
+            bench.dt = static_cast<float>(std::atof(argv[++i]));
+        else if (std::strcmp(arg, "--size") == 0 && hasValue)
+        {
+            unsigned w = 0, h = 0;
+            std::istringstream iss(argv[++i]);
+            char sep = 0;
+            if (!(iss >> w >> sep >> h) || sep != 'x' || !w || !h)
+            {
+                std::cerr << "Niepoprawny rozmiar: " << argv[i] << "\n";
+                return false;
+            }
+            bench.width = w;
+            bench.height = h;
+        }
+        else if (std::strcmp(arg, "--cloud-points") == 0 && hasValue)
+            gCloudSampleCount = static_cast<size_t>(std::max(1LL, std::atoll(argv[++i])));
+        else if (std::strcmp(arg, "--cloud-seed") == 0 && hasValue)
+            gCloudSeed = static_cast<uint64_t>(std::strtoull(argv[++i], nullptr, 0));
+        else if (std::strcmp(arg, "--cloud-blend") == 0 && hasValue)
         {
-            float u = rand01();
-            float v = rand01();
-            float theta = 2.f * PI * u;
-            float phi = std::acos(2.f * v - 1.f);
-            float sinPhi = std::sin(phi);
-            float dirX = sinPhi * std::cos(theta);
-            float dirY = std::cos(phi);
-            float dirZ = sinPhi * std::sin(theta);
-            float rFactor;
-            if (s == 0)
+            const char* mode = argv[++i];
+            if (std::strcmp(mode, "alpha") == 0)
+                G.cloudBlend = CloudBlend::Alpha;
+            else if (std::strcmp(mode, "oit") == 0)
+                G.cloudBlend = CloudBlend::Oit;
+            else if (std::strcmp(mode, "sorted") == 0)
+                G.cloudBlend = CloudBlend::Sorted;
+            else
+            {
+                std::cerr << "Nieznany tryb mieszania chmury: " << mode << "\n";
+                return false;
+            }
+        }
+        else if (std::strcmp(arg, "--no-splats") == 0)
+            G.cloudSplats = false;
+        else if (std::strcmp(arg, "--volume") == 0)
+            G.cloudVolume = true;
+        else if (std::strcmp(arg, "--volume-threads") == 0 && hasValue)
+            gVolumeThreads = static_cast<unsigned>(std::max(1, std::atoi(argv[++i])));
+        else if (std::strcmp(arg, "--iso-grid") == 0 && hasValue)
+            gIsoGridSize = std::max(16, std::min(256, std::atoi(argv[++i])));
+        else if (std::strcmp(arg, "--wave-grid") == 0 && hasValue)
+        {
+            const int requested = std::atoi(argv[++i]);
+            gWaveGridSize = 32;
+            while (gWaveGridSize * 2 <= requested && gWaveGridSize < 256)
+                gWaveGridSize *= 2;
+        }
+        else if (std::strcmp(arg, "--cloud-cache") == 0 && hasValue)
+            gCloudCacheDir = argv[++i];
+        else if (std::strcmp(arg, "--no-cloud-cache") == 0)
+            gCloudCacheEnabled = false;
+        else if (std::strcmp(arg, "--load") == 0 && hasValue)
+            gMoleculePath = argv[++i];
+        else if (std::strcmp(arg, "--traj-fps") == 0 && hasValue)
+            gTrajectoryFps = std::max(0.f, static_cast<float>(std::atof(argv[++i])));
+        else if (std::strcmp(arg, "--profile-out") == 0 && hasValue)
+        {
+            gProfiler.csv.open(argv[++i], std::ios::trunc);
+            if (!gProfiler.csv)
             {
-                rFactor = rand01();
+                std::cerr << "Nie udalo sie otworzyc pliku profilu: " << argv[i] << "\n";
+                return false;
             }
+        }
+        else if (std::strcmp(arg, "--core") == 0)
+            gCoreProfile = true;
+        else if (std::strcmp(arg, "--no-shader-cache") == 0)
+            gShaderCacheEnabled = false;
+        else if (std::strcmp(arg, "--watch-shaders") == 0)
+            gShaderWatchEnabled = true;
+        else if (std::strcmp(arg, "--no-texture-cache") == 0)
+            gTextureCacheEnabled = false;
+        else if (std::strcmp(arg, "--fps") == 0 && hasValue)
+            gFramePacer.fpsCap = std::max(0, std::atoi(argv[++i]));
+        else if (std::strcmp(arg, "--pacing") == 0 && hasValue)
+        {
+            const char* mode = argv[++i];
+            if (std::strcmp(mode, "power") == 0)
+                gFramePacer.mode = PacingMode::Power;
+            else if (std::strcmp(mode, "latency") == 0)
+                gFramePacer.mode = PacingMode::Latency;
             else
             {
-                rFactor = 0.8f + 0.4f * rand01();
+                std::cerr << "Nieznany tryb tempa klatek: " << mode << "\n";
+                return false;
             }
-            float r = R * rFactor;
-            CloudPoint cp;
-            cp.x = dirX * r;
-            cp.y = dirY * r;
-            cp.z = dirZ * r;
-            cp.shell = s;
-            gCloudPoints.push_back(cp);
+        }
+        else if (std::strcmp(arg, "--dump-dir") == 0 && hasValue)
+            bench.dumpDir = argv[++i];
+        else if (std::strcmp(arg, "--dump-frame") == 0 && hasValue)
+            bench.dumpFrames.push_back(std::atoi(argv[++i]));
+        else
+        {
+            printUsage(argv[0]);
+            return false;
         }
     }
+    if (!bench.dumpDir.empty() && bench.dumpFrames.empty())
+        bench.dumpFrames.push_back(bench.frames - 1);
+    return true;
 }
 
-static int countActiveShells()
+static FrameStats computeFrameStats(std::vector<double> samplesMs)
 {
-    int e = G.electronCount;
-    int shells = 0;
-    for (int s = 0; s < MAX_SHELLS; ++s)
+    FrameStats st;
+    if (samplesMs.empty()) return st;
+    std::sort(samplesMs.begin(), samplesMs.end());
+    const size_t n = samplesMs.size();
+    st.minMs = samplesMs.front();
+    st.medianMs = (n % 2) ? samplesMs[n / 2]
+        : 0.5 * (samplesMs[n / 2 - 1] + samplesMs[n / 2]);
+    size_t p99 = static_cast<size_t>(std::ceil(0.99 * n));
+    st.p99Ms = samplesMs[std::min(n, std::max<size_t>(p99, 1)) - 1];
+    return st;
+}
+
+static const char* viewModeName(ViewMode mode, CloudBlend blend, bool splats, bool volume)
+{
+    if (mode == ViewMode::Molecule) return "mol";
+    if (mode == ViewMode::BohrOrbits) return "bohr";
+    if (mode == ViewMode::Isosurface) return "iso";
+    if (mode == ViewMode::WavePacket) return "wave";
+    if (volume) return "vol";
+    if (blend == CloudBlend::Oit) return splats ? "oit" : "pts-oit";
+    if (blend == CloudBlend::Sorted) return splats ? "sort" : "pts-sort";
+    return splats ? "cloud" : "pts";
+}
+
+static void runVolumeScaling(const BenchmarkOptions& opt)
+{
+    G = AppState();
+    G.viewMode = ViewMode::ProbabilityCloud;
+    G.cloudVolume = true;
+    finishVolumeBake(G.electronCount);
+    drawScene(opt.dt);
+    const unsigned maxThreads = volumeThreadCount();
+    std::vector<unsigned> counts;
+    for (unsigned t = 1; t < maxThreads; t *= 2)
+        counts.push_back(t);
+    counts.push_back(maxThreads);
+    std::cout << "\nWolumetria CPU (Z = " << gVolume.grid.Z << ", " << opt.width << "x" << opt.height
+        << ", kafelki " << VOLUME_TILE << "x" << VOLUME_TILE << ")\n";
+    std::cout << std::left << std::setw(13) << "watki"
+        << std::right << std::setw(10) << "min[ms]" << std::setw(10) << "med[ms]" << std::setw(10) << "p99[ms]"
+        << std::setw(10) << "przysp." << std::setw(10) << "efekt." << "\n";
+    double serialMs = 0.0;
+    std::vector<double> samples;
+    for (unsigned threads : counts)
     {
-        if (e <= 0) break;
-        ++shells;
-        e -= SHELL_CAPACITY[s];
+        samples.clear();
+        for (int frame = 0; frame < opt.warmupFrames + opt.frames; ++frame)
+        {
+            renderVolumeImage(gVolume.modelView, static_cast<int>(opt.width), static_cast<int>(opt.height), threads);
+            if (frame >= opt.warmupFrames)
+                samples.push_back(gVolume.renderMs);
+        }
+        FrameStats st = computeFrameStats(samples);
+        if (threads == 1)
+            serialMs = st.medianMs;
+        const double speedup = st.medianMs > 0.0 ? serialMs / st.medianMs : 0.0;
+        std::cout << std::left << std::setw(13) << threads
+            << std::right << std::setw(10) << st.minMs << std::setw(10) << st.medianMs << std::setw(10) << st.p99Ms
+            << std::setw(10) << speedup << std::setw(10) << speedup / threads << "\n";
     }
-    return shells;
 }
 
-static void drawOrbitCircle(float radius)
+static void runIsoCacheSweep(sf::RenderTarget& target, const BenchmarkOptions& opt)
 {
-    const int segments = 64;
-    glBegin(GL_LINE_LOOP);
-    for (int i = 0; i < segments; ++i)
+    freeIsoMeshes();
+    constexpr int SWEEP_ELEMENTS = 18;
+    std::cout << "\nIzopowierzchnie: przejscie Num+ po Z = 1.." << SWEEP_ELEMENTS
+        << " (siatka " << gIsoGridSize << "^3)\n";
+    std::cout << std::left << std::setw(13) << "przejscie"
+        << std::right << std::setw(10) << "min[ms]" << std::setw(10) << "med[ms]" << std::setw(10) << "p99[ms]" << "\n";
+    std::vector<double> samples;
+    for (const char* pass : { "pierwsze", "z cache" })
     {
-        float angle = 2.f * PI * i / segments;
-        float x = radius * std::cos(angle);
-        float z = radius * std::sin(angle);
-        glVertex3f(x, 0.f, z);
+        samples.clear();
+        for (int Z = 1; Z <= SWEEP_ELEMENTS; ++Z)
+        {
+            G = AppState();
+            G.viewMode = ViewMode::Isosurface;
+            G.electronCount = Z;
+            sf::Clock frameClock;
+            renderFrame(target, opt.dt);
+            glFinish();
+            samples.push_back(frameClock.getElapsedTime().asMicroseconds() / 1000.0);
+        }
+        FrameStats st = computeFrameStats(samples);
+        std::cout << std::left << std::setw(13) << pass
+            << std::right << std::setw(10) << st.minMs << std::setw(10) << st.medianMs << std::setw(10) << st.p99Ms << "\n";
     }
-    glEnd();
+    std::cout << "cache siatek: " << gIso.hits << " trafien, " << gIso.misses << " chybien, "
+        << gIso.bytes / (1024 * 1024) << " MB\n";
 }
 
-static void drawAtomBohrModel()
+static void runWaveBenchmark()
 {
-    glPushMatrix();
+    stopWaveSolver();
+    std::vector<int> sizes = { 64, 128 };
+    if (std::find(sizes.begin(), sizes.end(), gWaveGridSize) == sizes.end())
+        sizes.push_back(gWaveGridSize);
+    std::cout << "\nPakiet falowy: split-operator FFT (" << std::max(1u, std::thread::hardware_concurrency())
+        << " watkow)\n";
+    std::cout << std::left << std::setw(13) << "siatka"
+        << std::right << std::setw(10) << "ms/krok" << std::setw(10) << "kroki/s" << std::setw(10) << "GFLOP/s"
+        << std::setw(10) << "norma" << "\n";
+    for (int size : sizes)
     {
-        glColor3f(1.0f, 0.3f, 0.3f);
-        drawSphere(0.25f);
-        int remaining = G.electronCount;
-        for (int shell = 0; shell < MAX_SHELLS; ++shell)
+        WaveSolver w;
+        initWaveSolver(w, size);
+        resetWavePacket(w);
+        stepWavePacket(w);
+        const double budgetMs = 2000.0;
+        int steps = 0;
+        sf::Clock timer;
+        while (steps < 3 || (timer.getElapsedTime().asMicroseconds() / 1000.0 < budgetMs && steps < 100))
         {
-            if (remaining <= 0) break;
-            int capacity = SHELL_CAPACITY[shell];
-            int electronsInShell = std::min(remaining, capacity);
-            float R = shellRadius(shell);
-            {
-                GLboolean lighting = glIsEnabled(GL_LIGHTING);
-                if (lighting) glDisable(GL_LIGHTING);
-                glUseProgram(0);
-                glColor3f(0.9f, 0.9f, 0.9f);
-                drawOrbitCircle(R);
-                if (lighting) glEnable(GL_LIGHTING);
-                if (gAtomProgram) glUseProgram(gAtomProgram);
-            }
-            for (int e = 0; e < electronsInShell; ++e)
-            {
-                float baseAngle = 360.f * e / electronsInShell;
-                float speed = 1.0f + 0.3f * shell;
-                float angle = baseAngle + G.electronAngleDeg * speed;
-                glPushMatrix();
-                glRotatef(angle, 0.f, 1.f, 0.f);
-                glTranslatef(R, 0.f, 0.f);
-                glColor3f(0.2f, 0.6f, 1.0f);
-                if (G.showLocalAxes) drawAxes(0.15f);
-                drawSphere(0.08f);
-                glPopMatrix();
-            }
-            remaining -= electronsInShell;
+            stepWavePacket(w);
+            ++steps;
         }
+        const double ms = timer.getElapsedTime().asMicroseconds() / 1000.0 / steps;
+        const double points = static_cast<double>(size) * size * size;
+        const double flops = 2.0 * 5.0 * points * std::log2(points);
+        std::ostringstream grid;
+        grid << size << "^3";
+        std::cout << std::left << std::setw(13) << grid.str()
+            << std::right << std::setw(10) << ms << std::setw(10) << 1000.0 / ms
+            << std::setw(10) << flops / (ms * 1e6) << std::setw(10) << w.stats.norm << "\n";
     }
-    glPopMatrix();
 }
 
-static void drawAtomProbabilityCloud()
+static int runBenchmark(const BenchmarkOptions& opt)
 {
-    glPushMatrix();
+    sf::RenderTexture target;
+    if (!target.create(opt.width, opt.height, makeContextSettings()))
     {
-        glColor3f(1.0f, 0.3f, 0.3f);
-        drawSphere(0.25f);
-        int activeShells = countActiveShells();
-        GLboolean lighting = glIsEnabled(GL_LIGHTING);
-        GLint prevProgram = 0;
-        glGetIntegerv(GL_CURRENT_PROGRAM, &prevProgram);
-        GLfloat prevColor[4];
-        glGetFloatv(GL_CURRENT_COLOR, prevColor);
-        GLfloat prevPointSize = 1.0f;
-        glGetFloatv(GL_POINT_SIZE, &prevPointSize);
-        glUseProgram(0);
-        if (lighting) glDisable(GL_LIGHTING);
-        glPushMatrix();
+        std::cerr << "Nie udalo sie utworzyc bufora offscreen "
+            << opt.width << "x" << opt.height << "\n";
+        return 1;
+    }
+    target.setActive(true);
+    gGuiView = target.getDefaultView();
+    gGuiViewInitialized = true;
+    if (!initRenderer(target.getSize()))
+        return 1;
+    finishAssetLoads();
+
+    std::vector<ViewMode> modes = { ViewMode::BohrOrbits, ViewMode::ProbabilityCloud, ViewMode::Isosurface,
+        ViewMode::WavePacket };
+    if (!gMolecule.elements.empty())
+        modes.push_back(ViewMode::Molecule);
+    std::vector<int> elements;
+    for (int Z = 1; Z <= 18; ++Z)
+        elements.push_back(Z);
+    elements.insert(elements.end(), { 26, 36, 54, 79, 92, MAX_ELECTRONS });
+    std::vector<double> samples;
+    std::vector<double> allSamples;
+    samples.reserve(opt.frames);
+    allSamples.reserve(opt.frames * modes.size() * elements.size());
+
+    std::cout << "Benchmark: " << opt.width << "x" << opt.height
+        << ", klatek: " << opt.frames << ", dt = " << opt.dt << " s\n";
+    std::cout << std::left << std::setw(9) << "tryb" << std::setw(4) << "e-"
+        << std::right << std::setw(10) << "min[ms]"
+        << std::setw(10) << "med[ms]" << std::setw(10) << "p99[ms]" << std::setw(10) << "punkty" << "\n";
+    std::cout << std::fixed << std::setprecision(3);
+
+    for (ViewMode mode : modes)
+    {
+        std::vector<std::tuple<CloudBlend, bool, bool>> passes = { { CloudBlend::Alpha, false, false } };
+        if (mode == ViewMode::ProbabilityCloud)
         {
-            float baseYaw = 18.0f * (G.electronCount - 1);
-            float basePitch = 7.0f * (G.electronCount - 1);
-            float animAngle = 0.4f * G.electronAngleDeg;
-            glRotatef(baseYaw + animAngle, 0.f, 1.f, 0.f);
-            glRotatef(basePitch, 1.f, 0.f, 0.f);
-            glPointSize(2.5f);
-            glBegin(GL_POINTS);
-            for (const CloudPoint& cp : gCloudPoints)
-            {
-                if (cp.shell >= activeShells) continue;
-                float alpha = 0.16f + 0.05f * cp.shell;
-                float r = 0.3f;
-                float g = 0.5f + 0.15f * cp.shell;
-                float b = 1.0f;
-                glColor4f(r, g, b, alpha);
-                glVertex3f(cp.x, cp.y, cp.z);
-            }
-            glEnd();
+            for (CloudBlend blend : { CloudBlend::Alpha, CloudBlend::Oit, CloudBlend::Sorted })
+            {
+                G.cloudBlend = blend;
+                if (activeCloudBlend() != blend)
+                    continue;
+                if (blend != CloudBlend::Alpha)
+                    passes.push_back({ blend, false, false });
+                if (blend == CloudBlend::Oit ? gCloudSplatOitProgram : gCloudSplatProgram)
+                    passes.push_back({ blend, true, false });
+            }
+            passes.push_back({ CloudBlend::Alpha, false, true });
+        }
+        for (const auto& pass : passes)
+        {
+            const CloudBlend blend = std::get<0>(pass);
+            const bool splats = std::get<1>(pass);
+            const bool volume = std::get<2>(pass);
+            for (int electrons : elements)
+            {
+                if ((mode == ViewMode::Molecule || mode == ViewMode::WavePacket) && electrons != elements.front())
+                    break;
+                G = AppState();
+                G.viewMode = mode;
+                G.cloudBlend = blend;
+                G.cloudSplats = splats;
+                G.cloudVolume = volume;
+                G.electronCount = electrons;
+                pumpCloudUploads();
+                finishCloudBuild();
+                if (volume)
+                    finishVolumeBake(electrons);
+                for (int i = 0; i < opt.warmupFrames; ++i)
+                    renderFrame(target, opt.dt);
+                glFinish();
+                samples.clear();
+                gCloudSorter.sortSamples.clear();
+                gCloudSorter.recordSamples = blend == CloudBlend::Sorted;
+                sf::Clock frameClock;
+                for (int frame = 0; frame < opt.frames; ++frame)
+                {
+                    frameClock.restart();
+                    renderFrame(target, opt.dt);
+                    glFinish();
+                    samples.push_back(frameClock.getElapsedTime().asMicroseconds() / 1000.0);
+                    if (!opt.dumpDir.empty() &&
+                        std::find(opt.dumpFrames.begin(), opt.dumpFrames.end(), frame) != opt.dumpFrames.end())
+                    {
+                        target.display();
+                        std::ostringstream path;
+                        path << opt.dumpDir << "/" << viewModeName(mode, blend, splats, volume) << "_e"
+                            << std::setw(2) << std::setfill('0') << electrons
+                            << "_f" << std::setw(4) << frame << std::setfill(' ') << ".png";
+                        if (!target.getTexture().copyToImage().saveToFile(path.str()))
+                            std::cerr << "Nie udalo sie zapisac klatki: " << path.str() << "\n";
+                        target.setActive(true);
+                        gGlState.framebufferKnown = false;
+                    }
+                }
+                gCloudSorter.recordSamples = false;
+                FrameStats st = computeFrameStats(samples);
+                allSamples.insert(allSamples.end(), samples.begin(), samples.end());
+                std::cout << std::left << std::setw(9) << viewModeName(mode, blend, splats, volume) << std::setw(4) << electrons
+                    << std::right << std::setw(10) << st.minMs
+                    << std::setw(10) << st.medianMs << std::setw(10) << st.p99Ms
+                    << std::setw(10) << gCullStats.drawnPoints << "\n";
+                if (mode == ViewMode::Isosurface)
+                {
+                    const IsoEntry& iso = isoMesh(electrons, G.isoLevel, gIsoGridSize);
+                    std::cout << std::left << std::setw(13) << "  MC CPU"
+                        << std::right << std::setw(10) << iso.buildMs << std::setw(30) << iso.triangles << "\n";
+                }
+                if (!gCloudSorter.sortSamples.empty())
+                {
+                    FrameStats sort = computeFrameStats(gCloudSorter.sortSamples);
+                    std::cout << std::left << std::setw(13) << "  sort CPU"
+                        << std::right << std::setw(10) << sort.minMs
+                        << std::setw(10) << sort.medianMs << std::setw(10) << sort.p99Ms << "\n";
+                }
+            }
         }
-        glPopMatrix();
-        glPointSize(prevPointSize);
-        glColor4fv(prevColor);
-        if (lighting) glEnable(GL_LIGHTING);
-        glUseProgram(prevProgram);
     }
-    glPopMatrix();
+    FrameStats total = computeFrameStats(allSamples);
+    std::cout << std::left << std::setw(13) << "razem"
+        << std::right << std::setw(10) << total.minMs
+        << std::setw(10) << total.medianMs << std::setw(10) << total.p99Ms << "\n";
+    runVolumeScaling(opt);
+    runIsoCacheSweep(target, opt);
+    runWaveBenchmark();
+    shutdownRenderer();
+    return 0;
 }
 
+static bool sceneAnimating()
+{
+    const Trajectory& t = gTrajectory;
+    const bool trajectoryLoading = t.frameCount && t.slots[t.currentFrame % TRAJECTORY_RING].gpuFrame != t.currentFrame;
+    return G.animateElectrons || cloudBuildPending() || assetLoadsPending() || trajectoryLoading || simulationPending()
+        || cloudSortPending() || wavePending() || volumeBakePending();
+}
 
+static int displayRefreshRate()
+{
+#ifdef _WIN32
+    DEVMODEA mode = {};
+    mode.dmSize = sizeof(mode);
+    if (EnumDisplaySettingsA(nullptr, ENUM_CURRENT_SETTINGS, &mode) && mode.dmDisplayFrequency > 1)
+        return static_cast<int>(mode.dmDisplayFrequency);
+#endif
+    return PACING_DEFAULT_REFRESH_HZ;
+}
 
-static void drawAtom()
+static void applyPacingMode(sf::Window& win)
 {
-    if (G.showLocalAxes)
-        drawAxes(0.5f);
-    if (gAtomProgram)
-        glUseProgram(gAtomProgram);
-    if (G.viewMode == ViewMode::BohrOrbits)
-        drawAtomBohrModel();
-    else
-        drawAtomProbabilityCloud();
-    if (gAtomProgram)
-        glUseProgram(0);
+    win.setVerticalSyncEnabled(gFramePacer.mode == PacingMode::Power);
+    gFramePacer.refreshHz = displayRefreshRate();
+    gFramePacer.nextFrame = std::chrono::steady_clock::time_point();
 }
 
-static void drawScene(float dt)
+static void waitForFrameSlot()
 {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    drawBackgroundQuad();
-    setupView();
-    {
-        GLfloat lightPos[] = { 2.0f, 3.0f, 4.0f, 1.0f };
-        glLightfv(GL_LIGHT0, GL_POSITION, lightPos);
-    }
-    glRotatef(G.rotX, 1.f, 0.f, 0.f);
-    glRotatef(G.rotY, 0.f, 1.f, 0.f);
-    drawAtom();
-    if (G.animateElectrons)
+    FramePacer& p = gFramePacer;
+    const int cap = frameCap();
+    if (cap <= 0) return;
+    using Clock = std::chrono::steady_clock;
+    const auto period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / cap));
+    const auto spin = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double, std::milli>(p.mode == PacingMode::Latency ? PACING_SPIN_MS : 0.0));
+    Clock::time_point now = Clock::now();
+    if (p.nextFrame < now)
+        p.nextFrame = now;
+    if (p.nextFrame - now > spin)
+        std::this_thread::sleep_for(p.nextFrame - now - spin);
+    while (Clock::now() < p.nextFrame)
+        std::this_thread::yield();
+    p.nextFrame += period;
+}
+
+static void recordFrameInterval()
+{
+    FramePacer& p = gFramePacer;
+    const auto now = std::chrono::steady_clock::now();
+    ++p.frames;
+    if (!p.resumed)
     {
-        G.electronAngleDeg += 40.f * dt;
-        if (G.electronAngleDeg >= 360.f) G.electronAngleDeg -= 360.f;
+        const double ms = std::chrono::duration<double, std::milli>(now - p.lastPresent).count();
+        if (p.intervalsMs.size() < FRAME_INTERVAL_HISTORY)
+            p.intervalsMs.push_back(ms);
+        else
+            p.intervalsMs[p.intervalCursor] = ms;
+        p.intervalCursor = (p.intervalCursor + 1) % FRAME_INTERVAL_HISTORY;
+        p.avgIntervalMs += (ms - p.avgIntervalMs) * (p.avgIntervalMs > 0.0 ? 1.0 / 30.0 : 1.0);
     }
+    p.lastPresent = now;
+    p.resumed = false;
 }
 
-static void drawGuiOverlay(sf::RenderWindow& win)
+static void reportFrameIntervals()
 {
-    if (!gFontLoaded) return;
-    win.pushGLStates();
+    const FramePacer& p = gFramePacer;
+    const double totalMs = elapsedMs(p.started);
+    const FrameStats st = computeFrameStats(p.intervalsMs);
+    std::cout << std::fixed << std::setprecision(2)
+        << "Odstepy klatek [ms] (ostatnie " << p.intervalsMs.size() << "): min " << st.minMs
+        << ", mediana " << st.medianMs << ", p99 " << st.p99Ms << "\n"
+        << "Klatek: " << p.frames << ", oczekiwan na zdarzenia: " << p.idleWaits
+        << ", bezczynnosc " << (totalMs > 0.0 ? 100.0 * p.idleMs / totalMs : 0.0) << "% czasu\n"
+        << std::defaultfloat;
+}
+
+static void handleWindowEvent(sf::RenderWindow& win, const sf::Event& e, bool& running)
+{
+    if (e.type == sf::Event::Closed)
+        running = false;
+    if (e.type == sf::Event::KeyPressed &&
+        e.key.code == sf::Keyboard::Escape)
+        running = false;
+    if (e.type == sf::Event::Resized)
     {
-        if (gGuiViewInitialized)
-            win.setView(gGuiView);
-        else
-            win.setView(win.getDefaultView());
-        sf::Text text;
-        text.setFont(gFont);
-        text.setCharacterSize(18);
-        text.setFillColor(sf::Color::White);
-        const ElementInfo* el = getCurrentElement();
-        std::ostringstream oss;
-        if (el)
-        {
-            oss << "Atom: Z = " << el->Z << "   "
-                << el->symbol << " (" << el->name << ")";
-        }
-        else
+        sf::Vector2u size = win.getSize();
+        setupProjection(size);
+        gGuiView.setSize(static_cast<float>(size.x),
+            static_cast<float>(size.y));
+        gGuiView.setCenter(size.x * 0.5f, size.y * 0.5f);
+    }
+    if (e.type == sf::Event::KeyPressed)
+    {
+        switch (e.key.code)
         {
-            oss << "Atom: (nieznany), e- = " << G.electronCount;
+        case sf::Keyboard::Left:  G.rotY -= 5.f; break;
+        case sf::Keyboard::Right: G.rotY += 5.f; break;
+        case sf::Keyboard::Up:    G.rotX += 5.f; break;
+        case sf::Keyboard::Down:  G.rotX -= 5.f; break;
+        case sf::Keyboard::Num1:
+        case sf::Keyboard::Numpad1:
+            G.viewMode = ViewMode::BohrOrbits; break;
+        case sf::Keyboard::Num2:
+        case sf::Keyboard::Numpad2:
+            G.viewMode = ViewMode::ProbabilityCloud; break;
+        case sf::Keyboard::Num3:
+        case sf::Keyboard::Numpad3:
+            if (!gMolecule.elements.empty()) G.viewMode = ViewMode::Molecule;
+            break;
+        case sf::Keyboard::Num4:
+        case sf::Keyboard::Numpad4:
+            G.viewMode = ViewMode::Isosurface; break;
+        case sf::Keyboard::Num5:
+        case sf::Keyboard::Numpad5:
+            G.viewMode = ViewMode::WavePacket; break;
+        case sf::Keyboard::LBracket:
+            if (G.isoLevel > ISO_LEVEL_MIN) --G.isoLevel;
+            break;
+        case sf::Keyboard::RBracket:
+            if (G.isoLevel < ISO_LEVEL_MAX) ++G.isoLevel;
+            break;
+        case sf::Keyboard::G:
+            gIsoGridSize = nextIsoGridSize(gIsoGridSize); break;
+        case sf::Keyboard::Space:
+            G.animateElectrons = !G.animateElectrons; break;
+        case sf::Keyboard::Add:
+        case sf::Keyboard::Equal:
+            if (G.electronCount < MAX_ELECTRONS) ++G.electronCount;
+            break;
+        case sf::Keyboard::Subtract:
+        case sf::Keyboard::Hyphen:
+            if (G.electronCount > 1) --G.electronCount;
+            break;
+        case sf::Keyboard::A:
+            G.showLocalAxes = !G.showLocalAxes; break;
+        case sf::Keyboard::P:
+            toggleProfilerHud(); break;
+        case sf::Keyboard::O:
+            G.cloudBlend = static_cast<CloudBlend>((static_cast<int>(G.cloudBlend) + 1) % CLOUD_BLEND_COUNT);
+            break;
+        case sf::Keyboard::S:
+            G.cloudSplats = !G.cloudSplats; break;
+        case sf::Keyboard::V:
+            G.cloudVolume = !G.cloudVolume; break;
+        case sf::Keyboard::M:
+            gFramePacer.mode = gFramePacer.mode == PacingMode::Power ? PacingMode::Latency : PacingMode::Power;
+            applyPacingMode(win);
+            break;
+        case sf::Keyboard::Comma:
+            requestTrajectorySeek(gTrajectory.currentFrame - 1.0); break;
+        case sf::Keyboard::Period:
+            requestTrajectorySeek(gTrajectory.currentFrame + 1.0); break;
+        case sf::Keyboard::PageUp:
+            requestTrajectorySeek(gTrajectory.position + std::max(1, gTrajectory.frameCount / 10)); break;
+        case sf::Keyboard::PageDown:
+            requestTrajectorySeek(gTrajectory.position - std::max(1, gTrajectory.frameCount / 10)); break;
+        case sf::Keyboard::Home:
+            requestTrajectorySeek(0.0); break;
+        case sf::Keyboard::End:
+            requestTrajectorySeek(gTrajectory.frameCount - 1.0); break;
+        case sf::Keyboard::L:
+            toggleTrajectoryLoop(); break;
+        case sf::Keyboard::R:
+            G.rotX = 20.f;
+            G.rotY = -30.f;
+            requestAnimationReset();
+            requestWaveReset();
+            G.animateElectrons = true;
+            if (G.viewMode != ViewMode::WavePacket)
+            {
+                G.viewMode = ViewMode::BohrOrbits;
+                G.electronCount = 6;
+            }
+            break;
+        default: break;
         }
-        oss << "\nTryb widoku: ";
-        if (G.viewMode == ViewMode::BohrOrbits)
-            oss << "orbity kolowe (Bohr)";
-        else
-            oss << "chmury prawdopodobienstwa";
-        text.setString(oss.str());
-        text.setPosition(10.f, 10.f);
-        win.draw(text);
-        text.setFont(gFont);
-        text.setCharacterSize(18);
-        text.setFillColor(sf::Color::White);
-        text.setString(
-            "Sterowanie:\n"
-            "Strzalki: obrot sceny\n"
-            "1 / 2: orbity / chmury\n"
-            "Num+/-: liczba elektronow (1..18)\n"
-            "Spacja: animacja ON/OFF\n"
-            "A: lokalne osie ON/OFF\n"
-            "R: reset widoku\n"
-            "Esc: wyjscie"
-        );
-        text.setPosition(10.f, 70.f);
-        win.draw(text);
-    }
-    win.popGLStates();
-}
-
-int main()
+        G.rotX = clampFloat(G.rotX, -89.f, +89.f);
+    }
+    if (e.type == sf::Event::KeyPressed || e.type == sf::Event::Resized || e.type == sf::Event::GainedFocus)
+        G.dirty = true;
+}
+
+static void waitForInput(sf::RenderWindow& win, sf::Event& e, bool& running)
 {
-    sf::ContextSettings cs;
-    cs.depthBits = 24;
-    cs.stencilBits = 8;
-    cs.majorVersion = 2;
-    cs.minorVersion = 1;
+    FramePacer& p = gFramePacer;
+    const auto start = std::chrono::steady_clock::now();
+    if (gShaderWatcher.thread.joinable())
+        std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_POLL_MS));
+    else if (win.waitEvent(e))
+        handleWindowEvent(win, e, running);
+    p.idleMs += elapsedMs(start);
+    ++p.idleWaits;
+    p.resumed = true;
+    p.nextFrame = std::chrono::steady_clock::time_point();
+}
+
+int main(int argc, char** argv)
+{
+    BenchmarkOptions bench;
+    if (!parseCommandLine(argc, argv, bench))
+        return 1;
+    if (bench.enabled)
+        return runBenchmark(bench);
+
     sf::RenderWindow win(sf::VideoMode(1024, 768),
         "Model atomu - SFML + OpenGL",
-        sf::Style::Default, cs);
-    win.setVerticalSyncEnabled(true);
+        sf::Style::Default, makeContextSettings());
+    applyPacingMode(win);
     win.setActive(true);
     gGuiView = win.getDefaultView();
     gGuiViewInitialized = true;
-    GLenum err = glewInit();
-    initOpenGL();
-    setupProjection(win.getSize());
-    initQuadric();
-    initCloudPoints();
-    initLighting();
-    initAtomShader();
-    gBackgroundTexLoaded = loadBackgroundTexture("resources/stars.png");
-    gFontLoaded = gFont.loadFromFile("resources/fonts/arial.ttf");
-    if (!gFontLoaded)
-    {
-        std::cout << "UWAGA: Nie udalo sie wczytac czcionki 'resources/fonts/arial.ttf'. "
-            << "GUI tekstowe bedzie wylaczone.\n";
-    }
+    if (!initRenderer(win.getSize()))
+        return 1;
+    startShaderWatcher();
+    startSimulation();
+#ifdef _WIN32
+    timeBeginPeriod(1);
+#endif
+    gFramePacer.started = std::chrono::steady_clock::now();
     sf::Clock clock;
     std::cout
         << "Sterowanie:\n"
         << "  Strzalki  : obrot sceny\n"
         << "  1 / 2     : orbity kolowe / chmury prawdopodobienstwa\n"
-        << "  Num+/-    : zwieksz / zmniejsz liczbe elektronow (1..18)\n"
+        << "  3         : wczytana struktura (--load)\n"
+        << "  , / .     : trajektoria - ramka wstecz / naprzod\n"
+        << "  PgUp/PgDn : trajektoria - skok o 10% ramek\n"
+        << "  Home/End  : trajektoria - pierwsza / ostatnia ramka\n"
+        << "  L         : trajektoria - zapetlanie ON/OFF\n"
+        << "  Num+/-    : zwieksz / zmniejsz liczbe elektronow (1..118)\n"
         << "  Spacja    : animacja elektronow ON/OFF\n"
         << "  A         : lokalne osie ON/OFF\n"
+        << "  P         : profiler klatki (HUD) ON/OFF\n"
+        << "  M         : tryb oszczedny (vsync) / niskie opoznienie\n"
         << "  R         : reset widoku\n"
         << "  Esc       : wyjscie\n";
 
     bool running = true;
     while (running)
     {
-        float dt = clock.restart().asSeconds();
-        for (sf::Event e; win.pollEvent(e);)
+        sf::Event e;
+        if (!G.dirty && !sceneAnimating())
         {
-            if (e.type == sf::Event::Closed)
-                running = false;
-            if (e.type == sf::Event::KeyPressed &&
-                e.key.code == sf::Keyboard::Escape)
-                running = false;
-            if (e.type == sf::Event::Resized)
-            {
-                sf::Vector2u size = win.getSize();
-                setupProjection(size);
-                gGuiView.setSize(static_cast<float>(size.x),
-                    static_cast<float>(size.y));
-                gGuiView.setCenter(size.x * 0.5f, size.y * 0.5f);
-            }
-            if (e.type == sf::Event::KeyPressed)
-            {
-                switch (e.key.code)
-                {
-                case sf::Keyboard::Left:  G.rotY -= 5.f; break;
-                case sf::Keyboard::Right: G.rotY += 5.f; break;
-                case sf::Keyboard::Up:    G.rotX += 5.f; break;
-                case sf::Keyboard::Down:  G.rotX -= 5.f; break;
-                case sf::Keyboard::Num1:
-                case sf::Keyboard::Numpad1:
-                    G.viewMode = ViewMode::BohrOrbits; break;
-                case sf::Keyboard::Num2:
-                case sf::Keyboard::Numpad2:
-                    G.viewMode = ViewMode::ProbabilityCloud; break;
-                case sf::Keyboard::Space:
-                    G.animateElectrons = !G.animateElectrons; break;
-                case sf::Keyboard::Add:
-                case sf::Keyboard::Equal:
-                    if (G.electronCount < 18) ++G.electronCount;
-                    break;
-                case sf::Keyboard::Subtract:
-                case sf::Keyboard::Hyphen:
-                    if (G.electronCount > 1) --G.electronCount;
-                    break;
-                case sf::Keyboard::A:
-                    G.showLocalAxes = !G.showLocalAxes; break;
-                case sf::Keyboard::R:
-                    G.rotX = 20.f;
-                    G.rotY = -30.f;
-                    G.electronAngleDeg = 0.f;
-                    G.animateElectrons = true;
-                    G.viewMode = ViewMode::BohrOrbits;
-                    G.electronCount = 6;
-                    break;
-                default: break;
-                }
-                G.rotX = clampFloat(G.rotX, -89.f, +89.f);
-            }
+            waitForInput(win, e, running);
+            clock.restart();
         }
-        drawScene(dt);
-        drawGuiOverlay(win);
+        else
+        {
+            waitForFrameSlot();
+        }
+        while (running && win.pollEvent(e))
+            handleWindowEvent(win, e, running);
+        if (applyShaderReloads())
+            G.dirty = true;
+        if (!running || (!G.dirty && !sceneAnimating()))
+            continue;
+        float dt = clock.restart().asSeconds();
+        renderFrame(win, dt);
         win.display();
+        G.dirty = false;
+        recordFrameInterval();
     }
-     freeQuadric();
-    if (gAtomProgram) glDeleteProgram(gAtomProgram);
+    reportFrameIntervals();
+#ifdef _WIN32
+    timeEndPeriod(1);
+#endif
+    shutdownRenderer();
 
     return 0;
 }
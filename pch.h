@@ -3,9 +3,9 @@
 #define PCH_H
 #include <GL/glew.h>
 
-#include <SFML\Window.hpp>
-#include <SFML\Graphics.hpp>
-#include <SFML\OpenGL.hpp>
-#include <gl\GLU.h>
+#include <SFML/Window.hpp>
+#include <SFML/Graphics.hpp>
+#include <SFML/OpenGL.hpp>
+#include <GL/glu.h>
 
 #endif
\ No newline at end of file
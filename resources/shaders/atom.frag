@@ -0,0 +1,28 @@
+varying vec3 vNormal;
+varying vec3 vPosEye;
+varying vec4 vColor;
+
+void main()
+{
+    vec3 N = normalize(vNormal);
+    vec3 V = normalize(-vPosEye);
+    vec3 lightPos = LIGHT_POSITION;
+    vec3 L = normalize(lightPos - vPosEye);
+    float NdotL = max(dot(N, L), 0.0);
+    vec3 baseColor = vColor.rgb;
+    vec3 ambient = 0.15 * baseColor;
+    vec3 diffuse = 0.75 * baseColor * NdotL;
+    vec3 specular = vec3(0.0);
+    if (NdotL > 0.0)
+    {
+        vec3 R = reflect(-L, N);
+        float RdotV = max(dot(R, V), 0.0);
+        specular = vec3(0.8) * pow(RdotV, 32.0);
+    }
+    vec3 color = ambient + diffuse + specular;
+    float rim = 1.0 - max(dot(N, V), 0.0);
+    float rimFactor = pow(rim, 3.0);
+    vec3 rimColor = vec3(0.2, 0.4, 1.0);
+    color += rimColor * rimFactor;
+    FRAG_COLOR = vec4(color, vColor.a);
+}
@@ -0,0 +1,12 @@
+varying vec3 vNormal;
+varying vec3 vPosEye;
+varying vec4 vColor;
+
+void main()
+{
+    vec4 posEye = MODEL_VIEW * VERTEX;
+    vPosEye = posEye.xyz;
+    vNormal = normalize(NORMAL_MATRIX * NORMAL);
+    vColor = VERTEX_COLOR;
+    gl_Position = PROJECTION * posEye;
+}
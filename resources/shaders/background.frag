@@ -0,0 +1,7 @@
+uniform sampler2D uTexture;
+varying vec2 vTexCoord;
+
+void main()
+{
+    FRAG_COLOR = texture2D(uTexture, vTexCoord);
+}
@@ -0,0 +1,8 @@
+attribute vec2 aTexCoord;
+varying vec2 vTexCoord;
+
+void main()
+{
+    vTexCoord = aTexCoord;
+    gl_Position = vec4(VERTEX.xy, 1.0, 1.0);
+}
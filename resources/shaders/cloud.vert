@@ -0,0 +1,28 @@
+attribute float aX;
+attribute float aY;
+attribute float aZ;
+uniform vec4 uShellColor[MAX_SHELLS];
+uniform float uShellScale[MAX_SHELLS];
+#ifdef CLOUD_SHELL_ATTRIB
+attribute float aShell;
+uniform float uAlphaScale[MAX_SHELLS];
+#else
+uniform int uShell;
+uniform float uAlphaScale;
+#endif
+varying vec4 vColor;
+
+void main()
+{
+#ifdef CLOUD_SHELL_ATTRIB
+    int shell = int(aShell + 0.5);
+    float alphaScale = uAlphaScale[shell];
+#else
+    int shell = uShell;
+    float alphaScale = uAlphaScale;
+#endif
+    vColor = uShellColor[shell];
+    vColor.a = min(1.0, vColor.a * alphaScale);
+    vec3 pos = vec3(aX, aY, aZ) * uShellScale[shell];
+    gl_Position = PROJECTION * MODEL_VIEW * vec4(pos, 1.0);
+}
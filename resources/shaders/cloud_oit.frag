@@ -0,0 +1,7 @@
+#include "oit.glsl"
+varying vec4 vColor;
+
+void main()
+{
+    writeOit(vColor);
+}
@@ -0,0 +1,20 @@
+#ifdef CLOUD_OIT
+#include "oit.glsl"
+#endif
+uniform sampler2D uColormap;
+varying vec2 vColormapCoord;
+varying float vAlpha;
+
+void main()
+{
+    vec2 d = POINT_COORD * 2.0 - 1.0;
+    float r2 = dot(d, d);
+    if (r2 > 1.0)
+        discard;
+    vec4 color = vec4(texture2D(uColormap, vColormapCoord).rgb, vAlpha * exp(-4.0 * r2));
+#ifdef CLOUD_OIT
+    writeOit(color);
+#else
+    FRAG_COLOR = color;
+#endif
+}
@@ -0,0 +1,34 @@
+attribute float aX;
+attribute float aY;
+attribute float aZ;
+attribute float aShell;
+attribute float aDensity;
+uniform vec4 uShellColor[MAX_SHELLS];
+uniform float uShellScale[MAX_SHELLS];
+uniform float uAlphaScale[MAX_SHELLS];
+uniform float uDrawnFraction[MAX_SHELLS];
+uniform vec2 uDensityRange[MAX_SHELLS];
+uniform float uPointScale;
+varying vec2 vColormapCoord;
+varying float vAlpha;
+
+const float SPLAT_RADIUS = 0.8;
+const float SPLAT_MAX_PX = 24.0;
+const float POINT_AREA_PX = 6.25;
+const float GAUSS_AREA = 0.19;
+
+void main()
+{
+    int shell = int(aShell + 0.5);
+    vec3 pos = vec3(aX, aY, aZ) * uShellScale[shell];
+    vec4 viewPos = MODEL_VIEW * vec4(pos, 1.0);
+    vec2 range = uDensityRange[shell];
+    float density = exp(mix(range.x, range.y, aDensity)) * uDrawnFraction[shell];
+    float radius = SPLAT_RADIUS * pow(density, -1.0 / 3.0);
+    float size = clamp(uPointScale * radius / max(-viewPos.z, 1e-3), 1.0, SPLAT_MAX_PX);
+    gl_PointSize = size;
+    vColormapCoord = vec2(aDensity, (float(shell) + 0.5) / float(MAX_SHELLS));
+    float coverage = min(1.0, POINT_AREA_PX / (GAUSS_AREA * size * size));
+    vAlpha = min(1.0, uShellColor[shell].a * uAlphaScale[shell] * coverage);
+    gl_Position = PROJECTION * viewPos;
+}
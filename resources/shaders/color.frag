@@ -0,0 +1,6 @@
+varying vec4 vColor;
+
+void main()
+{
+    FRAG_COLOR = vColor;
+}
@@ -0,0 +1,16 @@
+#include "orbit.glsl"
+
+varying vec3 vNormal;
+varying vec3 vPosEye;
+varying vec4 vColor;
+
+void main()
+{
+    float c, s;
+    vec3 pos = orbitPosition(VERTEX.xyz, c, s);
+    vec4 posEye = MODEL_VIEW * vec4(pos, 1.0);
+    vPosEye = posEye.xyz;
+    vNormal = normalize(NORMAL_MATRIX * orbitRotate(NORMAL, c, s));
+    vColor = VERTEX_COLOR;
+    gl_Position = PROJECTION * posEye;
+}
@@ -0,0 +1,11 @@
+#include "orbit.glsl"
+
+varying vec4 vColor;
+
+void main()
+{
+    float c, s;
+    vec3 pos = orbitPosition(VERTEX.xyz, c, s);
+    vColor = VERTEX_COLOR;
+    gl_Position = PROJECTION * MODEL_VIEW * vec4(pos, 1.0);
+}
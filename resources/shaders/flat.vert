@@ -0,0 +1,7 @@
+varying vec4 vColor;
+
+void main()
+{
+    vColor = VERTEX_COLOR;
+    gl_Position = PROJECTION * MODEL_VIEW * VERTEX;
+}
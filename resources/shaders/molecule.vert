@@ -0,0 +1,14 @@
+attribute vec4 aInstance;
+attribute vec4 aInstanceColor;
+varying vec3 vNormal;
+varying vec3 vPosEye;
+varying vec4 vColor;
+
+void main()
+{
+    vec4 posEye = MODEL_VIEW * vec4(VERTEX.xyz * aInstance.w + aInstance.xyz, 1.0);
+    vPosEye = posEye.xyz;
+    vNormal = normalize(NORMAL_MATRIX * NORMAL);
+    vColor = aInstanceColor;
+    gl_Position = PROJECTION * posEye;
+}
@@ -0,0 +1,7 @@
+void writeOit(vec4 color)
+{
+    float a = color.a;
+    float w = a * clamp(3e3 * pow(1.0 - gl_FragCoord.z, 3.0), 1e-2, 3e3);
+    FRAG_DATA0 = vec4(color.rgb * a * w, a);
+    FRAG_DATA1 = vec4(a * w);
+}
@@ -0,0 +1,12 @@
+uniform sampler2D uAccum;
+uniform sampler2D uWeight;
+varying vec2 vTexCoord;
+
+void main()
+{
+    vec4 accum = texture2D(uAccum, vTexCoord);
+    if (accum.a >= 0.999)
+        discard;
+    float weight = texture2D(uWeight, vTexCoord).r;
+    FRAG_COLOR = vec4(accum.rgb / clamp(weight, 1e-5, 5e4), accum.a);
+}
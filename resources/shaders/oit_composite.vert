@@ -0,0 +1,7 @@
+varying vec2 vTexCoord;
+
+void main()
+{
+    vTexCoord = VERTEX.xy * 0.5 + 0.5;
+    gl_Position = vec4(VERTEX.xy, 0.0, 1.0);
+}
@@ -0,0 +1,17 @@
+attribute vec3 aInstance;
+uniform float uShellRadius[MAX_SHELLS];
+uniform float uTime;
+
+vec3 orbitRotate(vec3 v, float c, float s)
+{
+    return vec3(c * v.x + s * v.z, v.y, -s * v.x + c * v.z);
+}
+
+vec3 orbitPosition(vec3 v, out float c, out float s)
+{
+    int shell = int(aInstance.x + 0.5);
+    float angle = radians(aInstance.y + uTime * aInstance.z);
+    c = cos(angle);
+    s = sin(angle);
+    return orbitRotate(v + vec3(uShellRadius[shell], 0.0, 0.0), c, s);
+}
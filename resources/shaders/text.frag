@@ -0,0 +1,8 @@
+uniform sampler2D uTexture;
+varying vec2 vTexCoord;
+varying vec4 vColor;
+
+void main()
+{
+    FRAG_COLOR = vec4(vColor.rgb, vColor.a * texture2D(uTexture, vTexCoord).a);
+}
@@ -0,0 +1,11 @@
+attribute vec2 aTexCoord;
+uniform vec2 uScreen;
+varying vec2 vTexCoord;
+varying vec4 vColor;
+
+void main()
+{
+    vTexCoord = aTexCoord;
+    vColor = VERTEX_COLOR;
+    gl_Position = vec4(VERTEX.x / uScreen.x * 2.0 - 1.0, 1.0 - VERTEX.y / uScreen.y * 2.0, 0.0, 1.0);
+}